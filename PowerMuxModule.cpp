@@ -2,6 +2,38 @@
 #include <iostream>
 #include <fstream>
 #include <array>
+#include <functional>
+#include <vector>
+#include <algorithm>
+#include <deque>
+#include <filesystem>
+#include <cstring>
+#include <cmath>
+#include <atomic>
+#include <chrono>
+#include <bit>
+#include <sstream>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+#include <mutex>
+#include <memory>
+#include <utility>
+#include <coroutine>
+#include <queue>
+#include <random>
+#include <thread>
+#include <list>
+#include <unordered_map>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <new>
+#include <string>
 
 #include "json.hpp"
 
@@ -128,7 +160,7 @@ struct ModuleStatus
         isProfilingOngoing(false),
         ProfileType(ProfilingType::INCREASE),
 
-        // Temp substitutions
+        // Temp substitutions, MaxCurrent follows moduleRatedCurrent (applyEngineConfig)
         isAlive(true),
         MaxCurrent(30.0f)
     {
@@ -137,6 +169,7 @@ struct ModuleStatus
 };
 
 ModuleStatus pmArray[49]; // 0 : Default , 1-48 : modules
+uint64_t substitutedRatingMask = ~1ull; // modules whose MaxCurrent is the moduleRatedCurrent substitute
 Connector connectorArray[13]; // 0 : Default , 1-12 : connectors
 
 struct ConnectorPairMux {
@@ -204,6 +237,292 @@ PmPairRelayMux relayMuxTable[] = {
 uint16_t relayMuxCount = sizeof(relayMuxTable) / sizeof(relayMuxTable[0]);
 uint16_t connectorMuxCount = sizeof(connectorPairMuxTable) / sizeof(connectorPairMuxTable[0]);
 
+//******************************************   CABINET LAYOUT START   ******************************************************/
+
+// Production cabinets come in a few fixed layouts : two connectors per subset
+// sharing one relay chain, two subsets per superset joined by normal muxes,
+// supersets joined in a ring by super muxes. A layout is a constexpr
+// description; CabinetTopology derives default modules, subsets, relay
+// adjacency and mux peers from it at compile time, so the topology queries of
+// the allocation engine fold to constants and table lookups, and their loops
+// have constant trip counts. RuntimeTopology answers the same queries from
+// the relay / mux tables above for cabinets not known at build time.
+
+struct CabinetLayout
+{
+    uint16_t subsets;        // 2 connectors each
+    uint16_t nodesPerChain;  // module pairs per relay chain
+    uint16_t relayIdBase;
+    uint16_t muxIdBase;
+    uint16_t superMuxIdBase;
+};
+
+constexpr CabinetLayout standardCabinet{ 6, 4, 201, 301, 401 }; // 12 connectors, 48 modules
+
+struct LayoutRelay { uint16_t pmA, pmB, id; };
+struct LayoutMux { uint16_t connectorA, connectorB, id; };
+
+template <CabinetLayout L>
+struct CabinetTopology
+{
+    static constexpr uint16_t connectorCount = 2 * L.subsets;
+    static constexpr uint16_t modulesPerSubset = 2 * L.nodesPerChain;
+    static constexpr uint16_t moduleCount = L.subsets * modulesPerSubset;
+    static constexpr uint16_t supersetCount = L.subsets / 2;
+    static constexpr uint16_t relayCount = L.subsets * (L.nodesPerChain - 1);
+    static constexpr uint16_t normalMuxCount = 4 * supersetCount;
+    static constexpr uint16_t superMuxCount = (supersetCount > 2) ? supersetCount : supersetCount - 1; // ring
+    static constexpr uint16_t muxCount = normalMuxCount + superMuxCount;
+
+    static constexpr std::array<LayoutRelay, relayCount> relays = [] {
+        std::array<LayoutRelay, relayCount> table{};
+        uint16_t n = 0;
+        for (uint16_t s = 0; s < L.subsets; s++) {
+            for (uint16_t k = 0; k + 1 < L.nodesPerChain; k++, n++) {
+                uint16_t pmA = static_cast<uint16_t>(s * 2 * L.nodesPerChain + 1 + 2 * k);
+                table[n] = { pmA, static_cast<uint16_t>(pmA + 2), static_cast<uint16_t>(L.relayIdBase + n) };
+            }
+        }
+        return table;
+    }();
+
+    // normal muxes : each connector of a subset to each connector of the other
+    // subset of its superset; super muxes : last connector of a superset to the
+    // first of the next, closing the ring
+    static constexpr std::array<LayoutMux, muxCount> muxes = [] {
+        std::array<LayoutMux, muxCount> table{};
+        uint16_t n = 0;
+        for (uint16_t s = 0; s < L.subsets / 2; s++) {
+            uint16_t c = static_cast<uint16_t>(4 * s + 1);
+            for (uint16_t a = 0; a < 2; a++) {
+                for (uint16_t b = 2; b < 4; b++, n++) {
+                    table[n] = { static_cast<uint16_t>(c + a), static_cast<uint16_t>(c + b), static_cast<uint16_t>(L.muxIdBase + n) };
+                }
+            }
+        }
+        for (uint16_t s = 0; s < superMuxCount; s++) {
+            uint16_t last = static_cast<uint16_t>(4 * (s + 1));
+            table[n + s] = (last == 2 * L.subsets)
+                ? LayoutMux{ 1, last, static_cast<uint16_t>(L.superMuxIdBase + s) }
+                : LayoutMux{ last, static_cast<uint16_t>(last + 1), static_cast<uint16_t>(L.superMuxIdBase + s) };
+        }
+        return table;
+    }();
+
+    // relay ids touching each module, in table order (0 : none)
+    static constexpr std::array<std::array<uint16_t, 2>, moduleCount + 1> moduleRelays = [] {
+        std::array<std::array<uint16_t, 2>, moduleCount + 1> table{};
+        for (const LayoutRelay& relay : relays) {
+            for (uint16_t module : { relay.pmA, relay.pmB }) {
+                table[module][table[module][0] == 0 ? 0 : 1] = relay.id;
+            }
+        }
+        return table;
+    }();
+
+    // mux id between two connectors (0 : none)
+    static constexpr std::array<std::array<uint16_t, connectorCount + 1>, connectorCount + 1> muxBetween = [] {
+        std::array<std::array<uint16_t, connectorCount + 1>, connectorCount + 1> table{};
+        for (const LayoutMux& mux : muxes) {
+            table[mux.connectorA][mux.connectorB] = mux.id;
+            table[mux.connectorB][mux.connectorA] = mux.id;
+        }
+        return table;
+    }();
+
+    static constexpr uint16_t defaultModule(uint16_t connector) {
+        return ((connector - 1) / 2) * modulesPerSubset + ((connector % 2 == 1) ? 1 : modulesPerSubset - 1);
+    }
+    static constexpr uint16_t subset(uint16_t connector) { return (connector - 1) / 2 + 1; }
+    static constexpr uint16_t superset(uint16_t connector) { return (connector - 1) / 4 + 1; }
+    static constexpr uint16_t subsetModuleBegin(uint16_t subsetId) { return (subsetId - 1) * modulesPerSubset + 1; }
+    static constexpr uint16_t supersetModuleBegin(uint16_t supersetId) { return (supersetId - 1) * 2 * modulesPerSubset + 1; }
+
+    static constexpr int relayIndex(uint16_t relayId) {
+        return (relayId >= L.relayIdBase && relayId < L.relayIdBase + relayCount) ? relayId - L.relayIdBase : -1;
+    }
+    static constexpr int muxIndex(uint16_t muxId) {
+        if (muxId >= L.muxIdBase && muxId < L.muxIdBase + normalMuxCount) return muxId - L.muxIdBase;
+        if (muxId >= L.superMuxIdBase && muxId < L.superMuxIdBase + superMuxCount) return normalMuxCount + muxId - L.superMuxIdBase;
+        return -1;
+    }
+    static constexpr uint16_t relayBetween(uint16_t moduleA, uint16_t moduleB) {
+        if (moduleA > moduleB) std::swap(moduleA, moduleB);
+        if (moduleB > moduleCount || moduleB - moduleA != 2) return 0;
+        for (uint16_t id : moduleRelays[moduleA]) {
+            if (id != 0 && relays[id - L.relayIdBase].pmB == moduleB) return id;
+        }
+        return 0;
+    }
+    static constexpr uint16_t muxExistence(uint16_t connectorA, uint16_t connectorB) {
+        return (connectorA > connectorCount || connectorB > connectorCount) ? 0 : muxBetween[connectorA][connectorB];
+    }
+};
+
+using StandardTopology = CabinetTopology<standardCabinet>;
+
+static_assert(StandardTopology::moduleCount == 48 && StandardTopology::relayCount == 18 && StandardTopology::muxCount == 15);
+static_assert(StandardTopology::defaultModule(1) == 1 && StandardTopology::defaultModule(2) == 7 && StandardTopology::defaultModule(12) == 47);
+static_assert(StandardTopology::relayBetween(45, 47) == 218 && StandardTopology::relayBetween(7, 9) == 0);
+static_assert(StandardTopology::muxExistence(2, 4) == 304 && StandardTopology::muxExistence(12, 1) == 403);
+
+// Runtime configured fallback : same queries, derived with divisions and
+// table scans over relayMuxTable / connectorPairMuxTable. runtimeCabinet is
+// derived from those tables by selectCabinetLayout().
+CabinetLayout runtimeCabinet = standardCabinet;
+
+struct RuntimeTopology
+{
+    static uint16_t modulesPerSubset() { return 2 * runtimeCabinet.nodesPerChain; }
+    static uint16_t moduleCountOf() { return runtimeCabinet.subsets * modulesPerSubset(); }
+
+    static uint16_t defaultModule(uint16_t connector) {
+        return ((connector - 1) / 2) * modulesPerSubset() + ((connector % 2 == 1) ? 1 : modulesPerSubset() - 1);
+    }
+    static uint16_t subset(uint16_t connector) { return (connector - 1) / 2 + 1; }
+    static uint16_t superset(uint16_t connector) { return (connector - 1) / 4 + 1; }
+    static uint16_t subsetModuleBegin(uint16_t subsetId) { return (subsetId - 1) * modulesPerSubset() + 1; }
+    static uint16_t supersetModuleBegin(uint16_t supersetId) { return (supersetId - 1) * 2 * modulesPerSubset() + 1; }
+
+    static int relayIndex(uint16_t relayId) {
+        for (uint16_t i = 0; i < relayMuxCount; i++) {
+            if (relayMuxTable[i].muxId == relayId) return i;
+        }
+        return -1;
+    }
+    static int muxIndex(uint16_t muxId) {
+        for (uint16_t i = 0; i < connectorMuxCount; i++) {
+            if (connectorPairMuxTable[i].muxId == muxId) return i;
+        }
+        return -1;
+    }
+    static uint16_t relayBetween(uint16_t moduleA, uint16_t moduleB) {
+        if (moduleA > moduleB) std::swap(moduleA, moduleB);
+        for (uint16_t i = 0; i < relayMuxCount; i++) {
+            if (relayMuxTable[i].pmA == moduleA && relayMuxTable[i].pmB == moduleB) return relayMuxTable[i].muxId;
+        }
+        return 0;
+    }
+    static uint16_t muxExistence(uint16_t connectorA, uint16_t connectorB) {
+        for (uint16_t i = 0; i < connectorMuxCount; i++) {
+            const ConnectorPairMux& mux = connectorPairMuxTable[i];
+            if ((static_cast<uint16_t>(mux.connectorA) == connectorA && static_cast<uint16_t>(mux.connectorB) == connectorB) ||
+                (static_cast<uint16_t>(mux.connectorA) == connectorB && static_cast<uint16_t>(mux.connectorB) == connectorA)) {
+                return mux.muxId;
+            }
+        }
+        return 0;
+    }
+};
+
+// Topology kernels of the allocation engine. Topology is CabinetTopology<...>
+// (compile time) or RuntimeTopology.
+template <class Topology>
+struct AllocationEngine
+{
+    static uint16_t moduleCount() {
+        if constexpr (requires { Topology::moduleCount; }) return Topology::moduleCount;
+        else return Topology::moduleCountOf();
+    }
+
+    static void getRelay(int moduleId, uint16_t relayIds[2]) {
+        if constexpr (requires { Topology::moduleRelays; }) {
+            relayIds[0] = Topology::moduleRelays[moduleId][0];
+            relayIds[1] = Topology::moduleRelays[moduleId][1];
+        }
+        else {
+            int count = 0;
+            for (int i = 0; i < relayMuxCount && count < 2; i++) {
+                if (relayMuxTable[i].pmA == moduleId || relayMuxTable[i].pmB == moduleId) relayIds[count++] = relayMuxTable[i].muxId;
+            }
+            while (count < 2) relayIds[count++] = 0;
+        }
+    }
+
+    static bool relayStatus(uint16_t relayId) {
+        int index = Topology::relayIndex(relayId);
+        return index >= 0 && relayMuxTable[index].status;
+    }
+
+    static bool muxStatus(uint16_t muxId) {
+        int index = Topology::muxIndex(muxId);
+        return index >= 0 && connectorPairMuxTable[index].status;
+    }
+
+    static float connectorCapacity(ConnectorType connector) {
+        float capacity = 0.0f;
+        for (uint16_t i = 1; i <= moduleCount(); i++) {
+            if (pmArray[i].Connector == connector && pmArray[i].isAlive) capacity += pmArray[i].MaxCurrent;
+        }
+        return capacity;
+    }
+
+    static float ownedCurrent(ConnectorType connector) { // alive or not, as sufficientPower() counts it
+        float current = 0.0f;
+        for (uint16_t i = 1; i <= moduleCount(); i++) {
+            if (pmArray[i].Connector == connector) current += pmArray[i].MaxCurrent;
+        }
+        return current;
+    }
+};
+
+using StandardEngine = AllocationEngine<StandardTopology>;
+using RuntimeEngine = AllocationEngine<RuntimeTopology>;
+
+// Cleared at startup when the relay / mux tables are not the standard cabinet
+bool specialisedLayout = true;
+
+template <class Topology>
+bool layoutMatchesTables() {
+    if (relayMuxCount != Topology::relayCount || connectorMuxCount != Topology::muxCount) return false;
+    for (uint16_t i = 0; i < Topology::relayCount; i++) {
+        const LayoutRelay& relay = Topology::relays[i];
+        if (relayMuxTable[i].pmA != relay.pmA || relayMuxTable[i].pmB != relay.pmB || relayMuxTable[i].muxId != relay.id) return false;
+    }
+    for (uint16_t i = 0; i < Topology::muxCount; i++) {
+        const LayoutMux& mux = Topology::muxes[i];
+        if (static_cast<uint16_t>(connectorPairMuxTable[i].connectorA) != mux.connectorA ||
+            static_cast<uint16_t>(connectorPairMuxTable[i].connectorB) != mux.connectorB ||
+            connectorPairMuxTable[i].muxId != mux.id) return false;
+    }
+    return true;
+}
+
+void planCacheClear();
+void rebuildOwnershipIndex();
+
+// Subsets and chain length of the loaded relay / mux tables : connectors come
+// in pairs per subset, modules fill the subsets evenly. Falls back to the
+// standard cabinet when the tables are not consistent with that shape.
+CabinetLayout deriveRuntimeCabinet() {
+    uint16_t lastModule = 0, lastConnector = 0;
+    for (uint16_t i = 0; i < relayMuxCount; i++) lastModule = std::max({ lastModule, relayMuxTable[i].pmA, relayMuxTable[i].pmB });
+    for (uint16_t i = 0; i < connectorMuxCount; i++) {
+        lastConnector = std::max({ lastConnector, static_cast<uint16_t>(connectorPairMuxTable[i].connectorA),
+            static_cast<uint16_t>(connectorPairMuxTable[i].connectorB) });
+    }
+    CabinetLayout layout = standardCabinet;
+    uint16_t subsets = (lastConnector + 1) / 2;
+    uint16_t modules = lastModule + (lastModule % 2); // the last relay may start on the node's first module
+    if (subsets == 0 || modules == 0 || modules > 48 || modules % (2 * subsets) != 0) {
+        std::cerr << "Cabinet layout : tables do not describe " << subsets << " even subsets, keeping the standard shape\n";
+        return layout;
+    }
+    layout.subsets = subsets;
+    layout.nodesPerChain = modules / (2 * subsets);
+    return layout;
+}
+
+void selectCabinetLayout() {
+    specialisedLayout = layoutMatchesTables<StandardTopology>();
+    runtimeCabinet = specialisedLayout ? standardCabinet : deriveRuntimeCabinet();
+    rebuildOwnershipIndex();
+    planCacheClear(); // plans were recorded against the previous layout
+    std::cout << "Cabinet layout : " << (specialisedLayout ? "standard (compile time)" : "runtime tables") << "\n";
+}
+
+//******************************************   CABINET LAYOUT END   ******************************************************/
+
 //********************************   JSON UTILS START   ********************************************************/
 
 void to_json(json& j, const Connector& c) {
@@ -328,12 +647,12 @@ ProfilingType stringToProfiling(const std::string& str) {
 
 // ------------ functions ------------
 
-// Save connectorArray → JSON file
-void saveConnectorArrayToJson(const std::string& filename) {
+// Save connectorArray (or a snapshot of it) → JSON file
+void saveConnectorArrayToJson(const std::string& filename, const Connector* connectors = connectorArray) {
     json j;
     for (int i = 0; i < 13; i++) {
         ConnectorType type = static_cast<ConnectorType>(i);
-        j[connectorName(type)] = connectorArray[i];  // uses to_json
+        j[connectorName(type)] = connectors[i];  // uses to_json
     }
 
     std::ofstream file(filename);
@@ -371,41 +690,41 @@ void loadConnectorArrayFromJson(const std::string& filename) {
     }
 }
 
-void createModuleStatusJson(const std::string& filename) {
+void createModuleStatusJson(const std::string& filename, const ModuleStatus* modules = pmArray) {
     json j = json::array();  // JSON array to hold all ModuleStatus objects
 
     for (int i = 0; i < 49; ++i) {
         json moduleJson;
 
         // Convert fields to JSON-friendly formats
-        moduleJson["isActive"] = pmArray[i].isActive;
-        moduleJson["isAlive"] = pmArray[i].isAlive;
-        moduleJson["Connector"] = connectorName(pmArray[i].Connector);
-        moduleJson["state"] = stateToString(pmArray[i].state);
-        //moduleJson["moduleAddress"] = pmArray[i].moduleAddress;
+        moduleJson["isActive"] = modules[i].isActive;
+        moduleJson["isAlive"] = modules[i].isAlive;
+        moduleJson["Connector"] = connectorName(modules[i].Connector);
+        moduleJson["state"] = stateToString(modules[i].state);
+        //moduleJson["moduleAddress"] = modules[i].moduleAddress;
         moduleJson["moduleAddress"] = i;
 
-        moduleJson["MaxVoltage"] = pmArray[i].MaxVoltage;
-        moduleJson["MaxCurrent"] = pmArray[i].MaxCurrent;
-        moduleJson["MinVoltage"] = pmArray[i].MinVoltage;
-        moduleJson["MinCurrent"] = pmArray[i].MinCurrent;
-        moduleJson["MaxPower"] = pmArray[i].MaxPower;
-        moduleJson["MinPower"] = pmArray[i].MinPower;
-        moduleJson["MaxTemperature"] = pmArray[i].MaxTemperature;
-        moduleJson["MinTemperature"] = pmArray[i].MinTemperature;
-        moduleJson["PhaseAVoltage"] = pmArray[i].PhaseAVoltage;
-        moduleJson["PhaseBVoltage"] = pmArray[i].PhaseBVoltage;
-        moduleJson["PhaseCVoltage"] = pmArray[i].PhaseCVoltage;
-        moduleJson["temperature"] = pmArray[i].temperature;
-        moduleJson["inputVoltage"] = pmArray[i].inputVoltage;
-        moduleJson["inputCurrent"] = pmArray[i].inputCurrent;
-        moduleJson["outputVoltage"] = pmArray[i].outputVoltage;
-        moduleJson["outputCurrent"] = pmArray[i].outputCurrent;
-
-        moduleJson["isFaultTriggered"] = pmArray[i].isFaultTriggered;
-        moduleJson["isProfilingOngoing"] = pmArray[i].isProfilingOngoing;
-        moduleJson["ProfileType"] = profilingToString(pmArray[i].ProfileType);
-        moduleJson["faultBits"] = faultBitsToString(pmArray[i].faultBits);
+        moduleJson["MaxVoltage"] = modules[i].MaxVoltage;
+        moduleJson["MaxCurrent"] = modules[i].MaxCurrent;
+        moduleJson["MinVoltage"] = modules[i].MinVoltage;
+        moduleJson["MinCurrent"] = modules[i].MinCurrent;
+        moduleJson["MaxPower"] = modules[i].MaxPower;
+        moduleJson["MinPower"] = modules[i].MinPower;
+        moduleJson["MaxTemperature"] = modules[i].MaxTemperature;
+        moduleJson["MinTemperature"] = modules[i].MinTemperature;
+        moduleJson["PhaseAVoltage"] = modules[i].PhaseAVoltage;
+        moduleJson["PhaseBVoltage"] = modules[i].PhaseBVoltage;
+        moduleJson["PhaseCVoltage"] = modules[i].PhaseCVoltage;
+        moduleJson["temperature"] = modules[i].temperature;
+        moduleJson["inputVoltage"] = modules[i].inputVoltage;
+        moduleJson["inputCurrent"] = modules[i].inputCurrent;
+        moduleJson["outputVoltage"] = modules[i].outputVoltage;
+        moduleJson["outputCurrent"] = modules[i].outputCurrent;
+
+        moduleJson["isFaultTriggered"] = modules[i].isFaultTriggered;
+        moduleJson["isProfilingOngoing"] = modules[i].isProfilingOngoing;
+        moduleJson["ProfileType"] = profilingToString(modules[i].ProfileType);
+        moduleJson["faultBits"] = faultBitsToString(modules[i].faultBits);
 
         // Push this module status to the JSON array
         j.push_back(moduleJson);
@@ -450,6 +769,7 @@ void loadModuleStatusJson(const std::string& filename, ModuleStatus pmArray[49])
         // Populate float fields with default 0.0f if missing or invalid
         pmArray[i].MaxVoltage = moduleJson.value("MaxVoltage", 0.0f);
         pmArray[i].MaxCurrent = moduleJson.value("MaxCurrent", 0.0f);
+        substitutedRatingMask &= ~(1ull << i);
         pmArray[i].MinVoltage = moduleJson.value("MinVoltage", 0.0f);
         pmArray[i].MinCurrent = moduleJson.value("MinCurrent", 0.0f);
         pmArray[i].MaxPower = moduleJson.value("MaxPower", 0.0f);
@@ -519,7 +839,7 @@ void createConnectorModuleJson2(const std::string& filename) {
     out.close();
 }
 
-void createConnectorModuleJson(const std::string& filename) {
+void createConnectorModuleJson(const std::string& filename, const ModuleStatus* modules = pmArray) {
     json j;
 
     // ensure all connectors appear in order, even if empty
@@ -529,7 +849,7 @@ void createConnectorModuleJson(const std::string& filename) {
     }
 
     for (int i = 0; i < 49; i++) {
-        std::string key = connectorName(pmArray[i].Connector);
+        std::string key = connectorName(modules[i].Connector);
         if (key != "DEFAULT") {
             j[key].push_back(i);
         }
@@ -549,17 +869,19 @@ void createConnectorModuleJson(const std::string& filename) {
     std::cout << j.dump(4) << std::endl;
 }
 
-void createMuxRelayJson(const std::string& filename) {
+void createMuxRelayJson(const std::string& filename,
+    const PmPairRelayMux* relays = relayMuxTable, size_t relayCount = relayMuxCount,
+    const ConnectorPairMux* muxes = connectorPairMuxTable, size_t muxCount = connectorMuxCount) {
     json j;  // use object, not array
 
     // add relay entries
-    for (size_t i = 0; i < relayMuxCount; i++) {
-        j[std::to_string(relayMuxTable[i].muxId)] = relayMuxTable[i].status;
+    for (size_t i = 0; i < relayCount; i++) {
+        j[std::to_string(relays[i].muxId)] = relays[i].status;
     }
 
     // add mux entries
-    for (size_t i = 0; i < connectorMuxCount; i++) {
-        j[std::to_string(connectorPairMuxTable[i].muxId)] = connectorPairMuxTable[i].status;
+    for (size_t i = 0; i < muxCount; i++) {
+        j[std::to_string(muxes[i].muxId)] = muxes[i].status;
     }
 
     // write to file
@@ -572,25 +894,489 @@ void createMuxRelayJson(const std::string& filename) {
 
 //******************************************   JSON UTILS END   ******************************************************/
 
+//******************************************   CONFIGURATION START   ******************************************************/
+
+// Ratings, margins, intervals and file paths that used to be compiled in.
+// json_data/pmm_config.json is loaded at start up and re-read whenever it
+// changes : the file (and the efficiency curve it names) is parsed and
+// validated off the engine thread, published in configSlot, and the engine
+// swaps it into activeConfig between two loop passes (applyEngineConfig). An
+// invalid file is reported and the running configuration stays. Keys missing
+// from the file keep their current value.
+
+const char* CONFIG_PATH = "json_data/pmm_config.json";
+const uint32_t CONFIG_POLL_MS = 1000;
+
+struct EfficiencyPoint;
+std::shared_ptr<const std::vector<EfficiencyPoint>> readEfficiencyCurve(const std::string& filename);
+
+struct PmmConfig
+{
+    uint64_t generation = 0;
+    float moduleRatedCurrent = 30.0f;  // A, modules that do not report MaxCurrent
+    float extraPowerMarginA = 60.0f;   // extraPower()
+    float spareModuleCurrentA = 33.5f; // hasSpareModules()
+    uint32_t triggerPollMs = 5000;
+    uint32_t optimisePeriodMs = 20000;
+    uint32_t heartbeatTimeoutMs = 500; // telemetry silence after which a module is dead
+    std::string triggerPath = "json_data/trigger.json";
+    std::string connectorsPath = "json_data/connectors.json";
+    std::string modulesPath = "json_data/modules.json";
+    std::string muxPath = "json_data/mux.json";
+    std::string connectorModulesPath = "json_data/connector_modules.json";
+    std::string efficiencyPath = "json_data/efficiency.json";
+    std::string snapshotPath = "json_data/cabinet.snapshot";
+    int64_t efficiencyStamp = 0; // modification time of efficiencyPath when published
+    std::shared_ptr<const std::vector<EfficiencyPoint>> efficiencyCurve; // parsed from efficiencyPath, null : keep the curve in use
+};
+
+PmmConfig activeConfig; // engine thread (and start up before it) only
+std::atomic<std::shared_ptr<const PmmConfig>> configSlot{ std::make_shared<const PmmConfig>() };
+std::atomic<uint64_t> configGeneration{ 0 };
+std::atomic<uint64_t> configReloads{ 0 };
+std::atomic<uint64_t> configRejects{ 0 };
+
+// Newest published configuration, for threads other than the engine
+std::shared_ptr<const PmmConfig> configSnapshot() {
+    return configSlot.load(std::memory_order_acquire);
+}
+
+void configRange(const char* key, double value, double low, double high) {
+    if (!(value >= low && value <= high)) {
+        throw std::runtime_error(std::string(key) + " = " + std::to_string(value) + " outside [" + std::to_string(low) + ", " + std::to_string(high) + "]");
+    }
+}
+
+// Overlays the keys of `j` on `base` and validates the result
+PmmConfig parseConfig(const json& j, const PmmConfig& base) {
+    PmmConfig config = base;
+    config.moduleRatedCurrent = j.value("moduleRatedCurrent", config.moduleRatedCurrent);
+    config.extraPowerMarginA = j.value("extraPowerMarginA", config.extraPowerMarginA);
+    config.spareModuleCurrentA = j.value("spareModuleCurrentA", config.spareModuleCurrentA);
+    config.triggerPollMs = j.value("triggerPollMs", config.triggerPollMs);
+    config.optimisePeriodMs = j.value("optimisePeriodMs", config.optimisePeriodMs);
+    config.heartbeatTimeoutMs = j.value("heartbeatTimeoutMs", config.heartbeatTimeoutMs);
+    config.triggerPath = j.value("triggerPath", config.triggerPath);
+    config.connectorsPath = j.value("connectorsPath", config.connectorsPath);
+    config.modulesPath = j.value("modulesPath", config.modulesPath);
+    config.muxPath = j.value("muxPath", config.muxPath);
+    config.connectorModulesPath = j.value("connectorModulesPath", config.connectorModulesPath);
+    config.efficiencyPath = j.value("efficiencyPath", config.efficiencyPath);
+    config.snapshotPath = j.value("snapshotPath", config.snapshotPath);
+
+    configRange("moduleRatedCurrent", config.moduleRatedCurrent, 1, 200);
+    configRange("extraPowerMarginA", config.extraPowerMarginA, 0, 1000);
+    configRange("spareModuleCurrentA", config.spareModuleCurrentA, 1, 200);
+    configRange("triggerPollMs", config.triggerPollMs, 10, 600000);
+    configRange("optimisePeriodMs", config.optimisePeriodMs, 100, 3600000);
+    configRange("heartbeatTimeoutMs", config.heartbeatTimeoutMs, 50, 600000);
+    for (const std::string* path : { &config.triggerPath, &config.connectorsPath, &config.modulesPath,
+                                     &config.muxPath, &config.connectorModulesPath, &config.efficiencyPath, &config.snapshotPath }) {
+        if (path->empty()) throw std::runtime_error("empty file path");
+    }
+    return config;
+}
+
+// Modification time of a file, 0 if it cannot be read
+int64_t fileStamp(const std::string& path) {
+    std::error_code ec;
+    auto stamp = std::filesystem::last_write_time(path, ec);
+    return ec ? 0 : static_cast<int64_t>(stamp.time_since_epoch().count());
+}
+
+// Reads, validates and publishes `filename`. False (and the old configuration
+// stays) if it cannot be read or is invalid.
+bool reloadConfig(const std::string& filename) {
+    std::ifstream file(filename);
+    if (!file.is_open()) return false;
+
+    std::shared_ptr<const PmmConfig> current = configSnapshot();
+    try {
+        json j;
+        file >> j;
+        auto next = std::make_shared<PmmConfig>(parseConfig(j, *current));
+        next->generation = current->generation + 1;
+        next->efficiencyStamp = fileStamp(next->efficiencyPath);
+        if (next->efficiencyPath != current->efficiencyPath || next->efficiencyStamp != current->efficiencyStamp || current->generation == 0) {
+            next->efficiencyCurve = readEfficiencyCurve(next->efficiencyPath); // the engine only swaps it in
+        }
+        configSlot.store(next, std::memory_order_release);
+        configGeneration.store(next->generation, std::memory_order_release);
+        configReloads.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+    catch (const std::exception& e) {
+        configRejects.fetch_add(1, std::memory_order_relaxed);
+        std::cerr << "ERROR : invalid configuration in " << filename << " : " << e.what() << "\n";
+        return false;
+    }
+}
+
+//******************************************   CONFIGURATION END   ******************************************************/
+
+
+
+//******************************************   OWNERSHIP INDEX START   ******************************************************/
+
+// Reverse index from each connector to exactly what its session holds : owned
+// modules (bit = module id), closed relays (bit = relayMuxTable index) and
+// closed muxes (bit = connectorPairMuxTable index, set for both ends).
+// Kept current by setModuleOwner(), setRelayStatus() and setMuxStatus(), so
+// isolation and stop walk the session's footprint instead of the cabinet.
+
+uint64_t ownedModuleMask[13] = {};
+uint64_t closedRelayMask[13] = {};
+uint64_t closedMuxMask[13] = {};
+uint8_t relayHolder[64] = {};     // connector a closed relay counts for, 0 none
+uint64_t nodeRelayMask[49] = {};  // relays touching each node, by primary module
+uint16_t evseLimitsStale = 0x1FFE; // connectors whose owned set changed since the EVSE limits were derived
+
+// Calls fn(bit) for every set bit, lowest first
+template <typename Fn>
+void forEachBit(uint64_t mask, Fn fn) {
+    while (mask) {
+        int bit = std::countr_zero(mask);
+        mask &= mask - 1;
+        fn(bit);
+    }
+}
+
+uint8_t indexedNodeOwner(uint16_t module) {
+    uint16_t node = (module % 2 == 0) ? module - 1 : module;
+    if (pmArray[node].isActive) return static_cast<uint8_t>(pmArray[node].Connector);
+    if (pmArray[node + 1].isActive) return static_cast<uint8_t>(pmArray[node + 1].Connector);
+    return 0;
+}
+
+void attributeRelay(uint16_t index, uint8_t connector) {
+    if (relayHolder[index]) closedRelayMask[relayHolder[index]] &= ~(1ull << index);
+    relayHolder[index] = connector;
+    if (connector) closedRelayMask[connector] |= 1ull << index;
+}
+
+// The only writer of pmArray[].Connector / isActive outside of loading
+void setModuleOwner(uint16_t module, ConnectorType connector) {
+    if (pmArray[module].isActive) {
+        ownedModuleMask[static_cast<int>(pmArray[module].Connector)] &= ~(1ull << module);
+        evseLimitsStale |= 1u << static_cast<int>(pmArray[module].Connector);
+    }
+    pmArray[module].Connector = connector;
+    pmArray[module].isActive = connector != ConnectorType::DEFAULT;
+    if (pmArray[module].isActive) {
+        ownedModuleMask[static_cast<int>(connector)] |= 1ull << module;
+        evseLimitsStale |= 1u << static_cast<int>(connector);
+    }
+
+    uint16_t node = (module % 2 == 0) ? module - 1 : module;
+    uint8_t owner = indexedNodeOwner(node);
+    if (owner) {
+        forEachBit(nodeRelayMask[node], [owner](int i) {
+            if (relayHolder[i]) attributeRelay(static_cast<uint16_t>(i), owner); // closed relays follow the node
+        });
+    }
+}
+
+void indexRelayStatus(const PmPairRelayMux& relay, bool status) {
+    uint16_t index = static_cast<uint16_t>(&relay - relayMuxTable);
+    uint8_t owner = status ? indexedNodeOwner(relay.pmA) : 0;
+    if (status && !owner) owner = indexedNodeOwner(relay.pmB);
+    attributeRelay(index, owner);
+}
+
+void indexMuxStatus(const ConnectorPairMux& mux, bool status) {
+    uint64_t bit = 1ull << (&mux - connectorPairMuxTable);
+    for (ConnectorType end : { mux.connectorA, mux.connectorB }) {
+        if (status) closedMuxMask[static_cast<int>(end)] |= bit;
+        else closedMuxMask[static_cast<int>(end)] &= ~bit;
+    }
+}
+
+// Full rebuild from pmArray and the tables : at start up and after bulk resets
+void rebuildOwnershipIndex() {
+    std::fill(ownedModuleMask, ownedModuleMask + 13, 0);
+    std::fill(closedRelayMask, closedRelayMask + 13, 0);
+    std::fill(closedMuxMask, closedMuxMask + 13, 0);
+    std::fill(relayHolder, relayHolder + 64, 0);
+    std::fill(nodeRelayMask, nodeRelayMask + 49, 0);
+    evseLimitsStale = 0x1FFE;
+    for (uint16_t m = 1; m < 49; m++) {
+        if (pmArray[m].isActive) ownedModuleMask[static_cast<int>(pmArray[m].Connector)] |= 1ull << m;
+    }
+    for (uint16_t i = 0; i < relayMuxCount && i < 64; i++) {
+        for (uint16_t module : { relayMuxTable[i].pmA, relayMuxTable[i].pmB }) {
+            nodeRelayMask[(module % 2 == 0) ? module - 1 : module] |= 1ull << i;
+        }
+        if (relayMuxTable[i].status) indexRelayStatus(relayMuxTable[i], true);
+    }
+    for (uint16_t i = 0; i < connectorMuxCount && i < 64; i++) {
+        if (connectorPairMuxTable[i].status) indexMuxStatus(connectorPairMuxTable[i], true);
+    }
+}
+
+const bool ownershipIndexBuilt = (rebuildOwnershipIndex(), true); // tables above are initialised by now
+
+//******************************************   OWNERSHIP INDEX END   ******************************************************/
+
+
+
+//******************************************   METRICS START   ******************************************************/
+
+// Log-linear latency histogram (HDR style) : 4 sub-buckets per power of two,
+// values in microseconds. Lock-free, safe to record from any thread.
+class LatencyHistogram
+{
+public:
+    static const int SUB_BUCKETS = 4;
+    static const int MAJOR_BUCKETS = 28; // up to 2^28 us (~268 s)
+    static const int BUCKETS = SUB_BUCKETS * MAJOR_BUCKETS;
+
+    void record(uint64_t us) {
+        counts[bucketIndex(us)].fetch_add(1, std::memory_order_relaxed);
+        sumUs.fetch_add(us, std::memory_order_relaxed);
+        total.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    static int bucketIndex(uint64_t us) {
+        if (us < SUB_BUCKETS) return static_cast<int>(us);
+        int major = std::bit_width(us) - 1;                 // floor(log2(us)) >= 2
+        int sub = static_cast<int>((us >> (major - 2)) & 3); // next 2 bits
+        int index = (major - 1) * SUB_BUCKETS + sub;
+        return std::min(index, BUCKETS - 1);
+    }
+
+    // Exclusive upper bound of a bucket in microseconds
+    static uint64_t bucketUpperUs(int index) {
+        if (index < SUB_BUCKETS) return index + 1;
+        int major = index / SUB_BUCKETS + 1;
+        int sub = index % SUB_BUCKETS;
+        return (static_cast<uint64_t>(SUB_BUCKETS + sub + 1)) << (major - 2);
+    }
+
+    std::atomic<uint64_t> counts[BUCKETS] = {};
+    std::atomic<uint64_t> sumUs{ 0 };
+    std::atomic<uint64_t> total{ 0 };
+};
+
+// Records the lifetime of the scope into a histogram
+class ScopedLatency
+{
+public:
+    explicit ScopedLatency(LatencyHistogram& h) : histogram(h), start(std::chrono::steady_clock::now()) {}
+    ~ScopedLatency() {
+        histogram.record(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+    }
+private:
+    LatencyHistogram& histogram;
+    std::chrono::steady_clock::time_point start;
+};
+
+LatencyHistogram assignLatency;         // assign_power_modules()
+LatencyHistogram isolateLatency;        // isolateConnector()
+LatencyHistogram stopLatency;           // STOP command -> session torn down (stop sequence)
+LatencyHistogram optimiseLatency;       // one worker optimisation pass
+LatencyHistogram triggerToAssignLatency; // trigger detected -> assign_power_modules() done
+LatencyHistogram configApplyLatency;    // applyEngineConfig() on the engine thread
+
+std::atomic<uint64_t> switchToggleCount[512] = {}; // indexed by relay / mux id (201-218, 301-312, 401-403)
+std::atomic<uint64_t> switchLastToggleMs[512] = {}; // steady clock time of the last state change, 0 : never
+std::atomic<uint64_t> triggerActionCount{ 0 };
+std::atomic<uint64_t> optimiseCycleCount{ 0 };
+std::atomic<uint64_t> setpointFastCount{ 0 };      // setpoints served by the owned modules
+std::atomic<uint64_t> setpointEscalatedCount{ 0 }; // setpoints that needed the allocator
+
+// Per connector view published by the allocator side after each change
+std::atomic<float> connectorDeliveredCurrent[13] = {}; // sum of owned modules' outputCurrent
+std::atomic<float> connectorAllocatedCurrent[13] = {}; // sum of owned modules' MaxCurrent
+std::atomic<float> connectorRequestedCurrent[13] = {}; // EVMaxCurrent
+
+uint64_t steadyMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void recordToggle(uint16_t switchId) {
+    switchToggleCount[switchId].fetch_add(1, std::memory_order_relaxed);
+    switchLastToggleMs[switchId].store(steadyMs(), std::memory_order_relaxed);
+}
+
+// All relay / mux state changes go through these so toggles are counted
+void setRelayStatus(PmPairRelayMux& relay, bool status) {
+    if (relay.status != status) recordToggle(relay.muxId);
+    relay.status = status;
+    indexRelayStatus(relay, status);
+}
+
+void setMuxStatus(ConnectorPairMux& mux, bool status) {
+    if (mux.status != status) recordToggle(mux.muxId);
+    mux.status = status;
+    indexMuxStatus(mux, status);
+}
+
+void updateConnectorMetrics(const ModuleStatus* modules = pmArray, const Connector* connectors = connectorArray) {
+    float delivered[13] = {};
+    float allocated[13] = {};
+    for (uint16_t i = 1; i < 49; i++) {
+        int c = static_cast<int>(modules[i].Connector);
+        if (c == 0) continue;
+        delivered[c] += modules[i].outputCurrent;
+        allocated[c] += modules[i].MaxCurrent;
+    }
+    for (int c = 1; c <= 12; c++) {
+        connectorDeliveredCurrent[c].store(delivered[c], std::memory_order_relaxed);
+        connectorAllocatedCurrent[c].store(allocated[c], std::memory_order_relaxed);
+        connectorRequestedCurrent[c].store(connectors[c].EVMaxCurrent, std::memory_order_relaxed);
+    }
+}
+
+//******************************************   METRICS END   ******************************************************/
+
+
+
+//******************************************   TRACING START   ******************************************************/
+
+// Hot path tracing, exported as Chrome trace-event JSON (chrome://tracing, Perfetto).
+// Build with -DPMM_TRACING=0 to compile every TRACE_SCOPE out. When compiled in,
+// a disabled scope costs one relaxed atomic load.
+#ifndef PMM_TRACING
+#define PMM_TRACING 1
+#endif
+
+std::atomic<bool> tracingEnabled{ false };
+
+struct TraceEvent
+{
+    const char* name; // string literal only
+    uint64_t startNs;
+    uint64_t durationNs;
+};
+
+// Single writer (owning thread) ring, overwrites oldest events when full
+struct TraceBuffer
+{
+    static const size_t CAPACITY = 1 << 16;
+
+    uint32_t tid;
+    std::string threadName;
+    std::atomic<uint64_t> head{ 0 };
+    TraceEvent events[CAPACITY];
+};
+
+std::mutex traceRegistryMtx; // taken once per thread on first event and by the exporter
+std::vector<std::shared_ptr<TraceBuffer>> traceRegistry;
+
+TraceBuffer& threadTraceBuffer() {
+    thread_local std::shared_ptr<TraceBuffer> buffer;
+    if (!buffer) {
+        buffer = std::make_shared<TraceBuffer>();
+        std::lock_guard<std::mutex> lock(traceRegistryMtx);
+        buffer->tid = static_cast<uint32_t>(traceRegistry.size() + 1);
+        buffer->threadName = "thread-" + std::to_string(buffer->tid);
+        traceRegistry.push_back(buffer);
+    }
+    return *buffer;
+}
+
+void traceThreadName(const std::string& name) {
+    if (!tracingEnabled.load(std::memory_order_relaxed)) return; // set before any thread starts
+    TraceBuffer& buffer = threadTraceBuffer();
+    std::lock_guard<std::mutex> lock(traceRegistryMtx);
+    buffer.threadName = name;
+}
+
+uint64_t traceClockNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+class TraceScope
+{
+public:
+    explicit TraceScope(const char* n) : name(n), startNs(tracingEnabled.load(std::memory_order_relaxed) ? traceClockNs() : 0) {}
+    ~TraceScope() {
+        if (startNs == 0) return;
+        TraceBuffer& buffer = threadTraceBuffer();
+        uint64_t h = buffer.head.load(std::memory_order_relaxed);
+        buffer.events[h % TraceBuffer::CAPACITY] = { name, startNs, traceClockNs() - startNs };
+        buffer.head.store(h + 1, std::memory_order_release);
+    }
+private:
+    const char* name;
+    uint64_t startNs;
+};
+
+#if PMM_TRACING
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(traceScope_, __LINE__)(name)
+#else
+#define TRACE_SCOPE(name) do {} while (0)
+#endif
+
+// Writes every buffered event of every thread as Chrome trace-event JSON
+bool exportChromeTrace(const std::string& filename) {
+    json events = json::array();
+    std::lock_guard<std::mutex> lock(traceRegistryMtx);
+
+    for (auto& buffer : traceRegistry) {
+        events.push_back({ {"name", "thread_name"}, {"ph", "M"}, {"pid", 1}, {"tid", buffer->tid},
+                           {"args", {{"name", buffer->threadName}}} });
+
+        uint64_t head = buffer->head.load(std::memory_order_acquire);
+        uint64_t first = (head > TraceBuffer::CAPACITY) ? head - TraceBuffer::CAPACITY : 0;
+        for (uint64_t i = first; i < head; i++) {
+            TraceEvent event = buffer->events[i % TraceBuffer::CAPACITY];
+            // skip slots the writer may have overwritten while copying
+            if (buffer->head.load(std::memory_order_acquire) - i > TraceBuffer::CAPACITY) continue;
+            events.push_back({ {"name", event.name}, {"ph", "X"}, {"pid", 1}, {"tid", buffer->tid},
+                               {"ts", event.startNs / 1000.0}, {"dur", event.durationNs / 1000.0} });
+        }
+    }
+
+    std::ofstream out(filename);
+    if (!out.is_open()) {
+        std::cerr << "Error opening file for writing: " << filename << "\n";
+        return false;
+    }
+    out << json{ {"traceEvents", events}, {"displayTimeUnit", "ms"} }.dump();
+    return true;
+}
+
+//******************************************   TRACING END   ******************************************************/
+
 
 
 //Funtion Declarations
 void isolateModule(uint16_t module);
+bool sufficientPower(ConnectorType connector);
+void stopConnectorState(ConnectorType connector);
 void isolateConnector(ConnectorType connector);
 void printModuleStatus();
 void printMuxStatus();
 void printRelayStatus();
+void rampHandover(uint16_t module, bool wholeNode = true);
+uint64_t monotonicNs();
+void assign_power_modules(ConnectorType connector);
+void rampRetarget(ConnectorType connector);
+void admissionUpdate(ConnectorType connector);
+void dispatchFreedCapacity();
+void solveSupersetsParallel(const std::vector<ConnectorType>& connectors);
+void releaseConnectorEvents(ConnectorType connector);
+
+bool moduleCapacityFreed = false; // set by isolateModule(), consumed by dispatchFreedCapacity()
 
 uint16_t defaultModule(ConnectorType connector) {
-    return ((static_cast<uint16_t>(connector) - 1) / 2) * 8 + ((static_cast<uint16_t>(connector) % 2 == 1) ? 1 : 7);
+    uint16_t c = static_cast<uint16_t>(connector);
+    return specialisedLayout ? StandardTopology::defaultModule(c) : RuntimeTopology::defaultModule(c);
 }
 
 uint16_t subset(ConnectorType connector) {
-    return (static_cast<uint16_t>(connector) - 1) / 2 + 1;
+    uint16_t c = static_cast<uint16_t>(connector);
+    return specialisedLayout ? StandardTopology::subset(c) : RuntimeTopology::subset(c);
 }
 
 uint16_t superset(ConnectorType connector) {
-    return (static_cast<uint16_t>(connector) - 1) / 4 + 1;
+    uint16_t c = static_cast<uint16_t>(connector);
+    return specialisedLayout ? StandardTopology::superset(c) : RuntimeTopology::superset(c);
 }
 
 bool connectorStatus(ConnectorType connector) {
@@ -601,6 +1387,45 @@ bool moduleStatus(uint16_t module) {
     return pmArray[module].isActive;
 }
 
+// Modules are wired in pairs sharing one relay node (odd primary, even
+// secondary). Relays and muxes switch nodes, ownership is kept per module :
+// a node is in use as soon as one of its modules is.
+uint16_t nodeOf(uint16_t module) {
+    return (module % 2 == 0) ? module - 1 : module;
+}
+
+bool nodeActive(uint16_t module) {
+    uint16_t node = nodeOf(module);
+    return pmArray[node].isActive || pmArray[node + 1].isActive;
+}
+
+bool nodeAlive(uint16_t module) {
+    uint16_t node = nodeOf(module);
+    return pmArray[node].isAlive || pmArray[node + 1].isAlive;
+}
+
+ConnectorType nodeOwner(uint16_t module) {
+    uint16_t node = nodeOf(module);
+    return pmArray[node].isActive ? pmArray[node].Connector : pmArray[node + 1].Connector;
+}
+
+// Active modules of the node owned by the connector
+uint16_t nodeModules(uint16_t module, ConnectorType connector) {
+    uint16_t node = nodeOf(module);
+    return (pmArray[node].isActive && pmArray[node].Connector == connector)
+        + (pmArray[node + 1].isActive && pmArray[node + 1].Connector == connector);
+}
+
+// Current of the alive modules of the node that are free (or owned by `connector`)
+float nodeCurrent(uint16_t module, ConnectorType connector = ConnectorType::DEFAULT) {
+    uint16_t node = nodeOf(module);
+    float current = 0.0f;
+    for (uint16_t m = node; m <= node + 1; m++) {
+        if (pmArray[m].isAlive && pmArray[m].Connector == connector) current += pmArray[m].MaxCurrent;
+    }
+    return current;
+}
+
 ConnectorType getdefaultConnector(uint16_t module) {
 
     if (module < 1 || module > 47) std::cerr << "Invalid module number. Must be between 1 and 47.\n";
@@ -624,50 +1449,61 @@ ConnectorType getdefaultConnector(uint16_t module) {
 
 
 void getRelay(int moduleId, uint16_t relayIds[2]) {
+    if (specialisedLayout) StandardEngine::getRelay(moduleId, relayIds);
+    else RuntimeEngine::getRelay(moduleId, relayIds);
+}
 
-    int count = 0;
-
-    for (int i = 0; i < relayMuxCount && count < 2; i++) {
-        if (relayMuxTable[i].pmA == moduleId || relayMuxTable[i].pmB == moduleId) {
-            relayIds[count++] = relayMuxTable[i].muxId;
-        }
-    }
+bool relayStatus(uint16_t relayId) {
+    return specialisedLayout ? StandardEngine::relayStatus(relayId) : RuntimeEngine::relayStatus(relayId);
+}
 
-    while (count < 2) {
-        relayIds[count++] = 0;
-    }
+uint16_t relayBetween(uint16_t moduleA, uint16_t moduleB) {
+    return specialisedLayout ? StandardTopology::relayBetween(moduleA, moduleB) : RuntimeTopology::relayBetween(moduleA, moduleB);
 }
 
-bool relayStatus(uint16_t relayId) {
-    for (int i = 0; i < relayMuxCount; i++) {
-        if (relayMuxTable[i].muxId == relayId) {
-            return relayMuxTable[i].status;
-        }
-    }
-    return false;
+// Index into relayMuxTable / connectorPairMuxTable, -1 if unknown
+int relayTableIndex(uint16_t relayId) {
+    return specialisedLayout ? StandardTopology::relayIndex(relayId) : RuntimeTopology::relayIndex(relayId);
 }
 
+int muxTableIndex(uint16_t muxId) {
+    return specialisedLayout ? StandardTopology::muxIndex(muxId) : RuntimeTopology::muxIndex(muxId);
+}
 
-bool assign(ConnectorType connector, uint16_t module) {
 
-    //Adjust if module directly gets assigned if becomes alive
-    //NOW : if supplementary module is active, it waits until next assignment
+// Claims the free alive modules of the node one at a time and stops once the
+// connector has sufficient power, so a node may be shared between "in use" and
+// "spare" (fullNode : claim both). A dead primary no longer blocks its secondary.
+// Returns false if the node belongs to another connector or nothing was claimed.
+bool assign(ConnectorType connector, uint16_t module, bool fullNode = false) {
 
-    if (pmArray[module].isActive || pmArray[module + 1].isActive) return false; // already assigned
+    module = nodeOf(module);
+    ConnectorType owner = nodeOwner(module);
+    if (owner != ConnectorType::DEFAULT && owner != connector) return false; // node used by another connector
 
-    // Check if the module is alive before assigning
-    if (pmArray[module].isAlive) {
-        pmArray[module].Connector = connector;
-        pmArray[module].isActive = true;
+    bool claimed = false;
+    for (uint16_t m = module; m <= module + 1; m++) {
+        if (pmArray[m].isActive || !pmArray[m].isAlive) continue;
+        if (claimed && !fullNode && sufficientPower(connector)) break; // one module is enough
+        setModuleOwner(m, connector);
+        claimed = true;
     }
+    return claimed;
+}
 
-    // Check if the supplementary module is alive before assigning
-    if (pmArray[module + 1].isAlive) {
-        pmArray[module + 1].Connector = connector;
-        pmArray[module + 1].isActive = true;
+// Claims one spare module in a node the connector is already connected to -
+// no relay or mux has to switch. True if a module was added.
+bool assignNodeSpare(ConnectorType connector) {
+    for (uint16_t node = 1; node < 49; node += 2) {
+        if (nodeOwner(node) != connector) continue;
+        for (uint16_t m = node; m <= node + 1; m++) {
+            if (pmArray[m].isActive || !pmArray[m].isAlive) continue;
+            setModuleOwner(m, connector);
+            std::cout << "\nModule " << m << " added to connector " << static_cast<int>(connector) << " (spare in node)";
+            return true;
+        }
     }
-
-    return (pmArray[module].isAlive || pmArray[module + 1].isAlive) ? true : false;
+    return false;
 }
 
 
@@ -677,12 +1513,11 @@ void relay_on(uint16_t moduleA, uint16_t moduleB) {
     }
 
     if (moduleB - moduleA == 2) {
-        for (uint16_t i = 0; i < relayMuxCount; i++) {
-            if (relayMuxTable[i].pmA == moduleA && relayMuxTable[i].pmB == moduleB) {
-                relayMuxTable[i].status = true;
-                std::cout << " : ON";
-                return;
-            }
+        int index = relayTableIndex(relayBetween(moduleA, moduleB));
+        if (index >= 0) {
+            setRelayStatus(relayMuxTable[index], true);
+            std::cout << " : ON";
+            return;
         }
     }
     else if (moduleB - moduleA == 4) {
@@ -700,88 +1535,59 @@ void relay_on(uint16_t moduleA, uint16_t moduleB) {
 }
 
 void mux_on(uint16_t muxid) {
-    for (uint16_t i = 0; i < connectorMuxCount; i++) {
-        if (connectorPairMuxTable[i].muxId == muxid) {
-            connectorPairMuxTable[i].status = true;
-            std::cout << "\nMux " << muxid << " is ON";
-            return;
-        }
+    int index = muxTableIndex(muxid);
+    if (index >= 0) {
+        setMuxStatus(connectorPairMuxTable[index], true);
+        std::cout << "\nMux " << muxid << " is ON";
+        return;
     }
     std::cerr << "\nMux " << muxid << " not found!";
 }
 
 void mux_off(uint16_t muxid) {
-    for (uint16_t i = 0; i < connectorMuxCount; i++) {
-        if (connectorPairMuxTable[i].muxId == muxid) {
-            connectorPairMuxTable[i].status = false;
-            std::cout << "\nMux " << muxid << " is OFF";
-            return;
-        }
+    int index = muxTableIndex(muxid);
+    if (index >= 0) {
+        setMuxStatus(connectorPairMuxTable[index], false);
+        std::cout << "\nMux " << muxid << " is OFF";
+        return;
     }
     std::cerr << "\nMux " << muxid << " not found!";
 }
 
 void allMuxesOff(ConnectorType connector) {
-    for (uint16_t i = 0; i < connectorMuxCount; i++) {
-        if (connectorPairMuxTable[i].connectorA == connector || connectorPairMuxTable[i].connectorB == connector) {
-            connectorPairMuxTable[i].status = false;
-        }
-    }
+    forEachBit(closedMuxMask[static_cast<int>(connector)], [](int i) { setMuxStatus(connectorPairMuxTable[i], false); });
 }
 
 bool isMuxIsolation(ConnectorType connector) {
-    for (uint16_t i = 0; i < connectorMuxCount; i++) {
-        if (connectorPairMuxTable[i].connectorA == connector || connectorPairMuxTable[i].connectorB == connector) {
-            if (connectorPairMuxTable[i].status) {
-                return false;
-            }
-        }
-    }
-    return true;
+    return closedMuxMask[static_cast<int>(connector)] == 0;
 }
 
 uint16_t subsetModuleBegin(uint16_t subsetId) {
-    return (subsetId - 1) * 8 + 1;
+    return specialisedLayout ? StandardTopology::subsetModuleBegin(subsetId) : RuntimeTopology::subsetModuleBegin(subsetId);
 }
 
 uint16_t supersetModuleBegin(uint16_t supersetId) {
-    return (supersetId - 1) * 16 + 1;
+    return specialisedLayout ? StandardTopology::supersetModuleBegin(supersetId) : RuntimeTopology::supersetModuleBegin(supersetId);
 }
 
 uint16_t muxExistence(ConnectorType connectorA, ConnectorType connectorB) {
-    for (uint16_t i = 0; i < connectorMuxCount; i++) {
-        if ((connectorPairMuxTable[i].connectorA == connectorA && connectorPairMuxTable[i].connectorB == connectorB) ||
-            (connectorPairMuxTable[i].connectorA == connectorB && connectorPairMuxTable[i].connectorB == connectorA)) {
-            return connectorPairMuxTable[i].muxId;
-        }
-    }
-    return 0;
+    uint16_t a = static_cast<uint16_t>(connectorA), b = static_cast<uint16_t>(connectorB);
+    return specialisedLayout ? StandardTopology::muxExistence(a, b) : RuntimeTopology::muxExistence(a, b);
 }
 
 bool muxStatus(uint16_t muxId) {
-    for (uint16_t i = 0; i < connectorMuxCount; i++) {
-        if (connectorPairMuxTable[i].muxId == muxId) {
-            return connectorPairMuxTable[i].status;
-        }
-    }
-    return false;
+    return specialisedLayout ? StandardEngine::muxStatus(muxId) : RuntimeEngine::muxStatus(muxId);
 }
 
 ConnectorType getActiveConnector(uint16_t module) {
-    return pmArray[module].Connector;
+    return nodeOwner(module);
     //return ConnectorType::DEFAULT;
 }
 
 //TODO change i to connectorMuxCount
 void getActiveMuxes(ConnectorType connector, uint16_t* outputArray) {
-    uint8_t count = 0;
-    for (uint8_t i = 0; i < connectorMuxCount; i++) { //Max Active Muxes = 2
-        if (connectorPairMuxTable[i].connectorA == connector || connectorPairMuxTable[i].connectorB == connector) {
-            if (connectorPairMuxTable[i].status) {
-                outputArray[count++] = connectorPairMuxTable[i].muxId;
-            }
-        }
-    }
+    uint8_t count = 0; //Max Active Muxes = 2
+    forEachBit(closedMuxMask[static_cast<int>(connector)], [&](int i) { outputArray[count++] = connectorPairMuxTable[i].muxId; });
 }
 
 void getAllMuxes(ConnectorType connector, uint16_t* outputArray) {
@@ -803,13 +1609,7 @@ bool sufficientPower(ConnectorType connector) {
     }
     */
 
-    float TotalCurrent = 0;
-
-    for (uint16_t i = 1; i < 49; i++) {
-        if (pmArray[i].Connector == connector) {
-            TotalCurrent += pmArray[i].MaxCurrent;
-        }
-    }
+    float TotalCurrent = specialisedLayout ? StandardEngine::ownedCurrent(connector) : RuntimeEngine::ownedCurrent(connector);
 
     return TotalCurrent - connectorArray[connectorIndex].EVMaxCurrent >= 0;
 
@@ -829,13 +1629,490 @@ bool extraPower(ConnectorType connector) {
         }
     }
 
-    return TotalCurrent - connectorArray[connectorIndex].EVMaxCurrent >= 60;
+    return TotalCurrent - connectorArray[connectorIndex].EVMaxCurrent >= activeConfig.extraPowerMarginA;
 
     std::cerr << "Invalid connector type";
     return false;
 }
 
-void assign_power_modules(ConnectorType connector) {
+//******************************************   EFFICIENCY POLICY START   ******************************************************/
+
+// Power modules are most efficient around 50-80 % load. The policy picks how
+// many modules a connector should run so that the (equal, load-fraction
+// balanced) split lands nearest that sweet spot, and opt_removeModules() /
+// assign_extra_modules() converge towards that count.
+
+struct EfficiencyPoint
+{
+    float load;       // output / rated current, 0..1
+    float efficiency; // 0..1
+};
+
+// Default curve of a typical 30 A module. Overridden by json_data/efficiency.json
+std::vector<EfficiencyPoint> moduleEfficiencyCurve = {
+    { 0.05f, 0.850f }, { 0.10f, 0.900f }, { 0.20f, 0.935f }, { 0.30f, 0.950f },
+    { 0.50f, 0.962f }, { 0.65f, 0.964f }, { 0.80f, 0.961f }, { 1.00f, 0.953f }
+};
+bool efficiencyPolicyEnabled = true;
+
+// Parses a JSON file ([[load, efficiency], ...]) into a sorted curve. Null if
+// the file cannot be opened (the curve in use stays), throws if it is invalid.
+std::shared_ptr<const std::vector<EfficiencyPoint>> readEfficiencyCurve(const std::string& filename) {
+    std::ifstream file(filename);
+    if (!file.is_open()) return nullptr;
+
+    json j;
+    try {
+        file >> j;
+        auto curve = std::make_shared<std::vector<EfficiencyPoint>>();
+        for (auto& point : j) curve->push_back({ point.at(0).get<float>(), point.at(1).get<float>() });
+        if (curve->size() < 2) throw std::runtime_error("need at least 2 points");
+        for (const EfficiencyPoint& point : *curve) {
+            if (!(point.efficiency > 0.0f && point.efficiency <= 1.0f)) throw std::runtime_error("efficiency outside (0, 1]");
+        }
+        std::sort(curve->begin(), curve->end(), [](const EfficiencyPoint& a, const EfficiencyPoint& b) { return a.load < b.load; });
+        return curve;
+    }
+    catch (const std::exception& e) {
+        throw std::runtime_error("invalid efficiency curve in " + filename + " : " + e.what());
+    }
+}
+
+float moduleEfficiency(float load) {
+    const auto& curve = moduleEfficiencyCurve;
+    if (load <= curve.front().load) return curve.front().efficiency;
+    if (load >= curve.back().load) return curve.back().efficiency;
+    for (size_t i = 1; i < curve.size(); i++) {
+        if (load <= curve[i].load) {
+            float t = (load - curve[i - 1].load) / (curve[i].load - curve[i - 1].load);
+            return curve[i - 1].efficiency + t * (curve[i].efficiency - curve[i - 1].efficiency);
+        }
+    }
+    return curve.back().efficiency;
+}
+
+// Conversion loss (W) of `modules` equal modules sharing `current` at `voltage`
+float conversionLoss(float current, float voltage, uint16_t modules, float moduleMaxCurrent) {
+    if (modules == 0 || current <= 0 || voltage <= 0) return 0.0f;
+    float load = current / (modules * moduleMaxCurrent);
+    float output = current * voltage;
+    return output / moduleEfficiency(load) - output;
+}
+
+float connectorVoltage(ConnectorType connector) {
+    const Connector& c = connectorArray[static_cast<int>(connector)];
+    return (c.EVTargetVoltage > 0) ? c.EVTargetVoltage : c.EVMaxVoltage;
+}
+
+uint16_t ownedModules(ConnectorType connector) {
+    uint16_t count = 0;
+    for (uint16_t i = 1; i < 49; i++) {
+        if (pmArray[i].Connector == connector && pmArray[i].isAlive) count++;
+    }
+    return count;
+}
+
+// Module count with the lowest conversion loss that still covers the demand
+uint16_t efficientModuleCount(ConnectorType connector) {
+    int c = static_cast<int>(connector);
+    float demand = connectorArray[c].EVMaxCurrent;
+    float moduleMaxCurrent = pmArray[defaultModule(connector)].MaxCurrent;
+    if (demand <= 0 || moduleMaxCurrent <= 0) return 0;
+
+    uint16_t minimum = static_cast<uint16_t>(std::ceil(demand / moduleMaxCurrent));
+    if (!efficiencyPolicyEnabled) return minimum;
+
+    float voltage = std::max(connectorVoltage(connector), 1.0f);
+    uint16_t best = minimum;
+    float bestLoss = conversionLoss(demand, voltage, minimum, moduleMaxCurrent);
+    for (uint16_t n = minimum + 1; n <= 16; n++) { // 16 : most a connector can reach
+        float loss = conversionLoss(demand, voltage, n, moduleMaxCurrent);
+        if (loss < bestLoss * 0.99f) { // ignore sub 1 % differences
+            best = n;
+            bestLoss = loss;
+        }
+    }
+    return best;
+}
+
+// Modules above the efficient count
+int excessModules(ConnectorType connector) {
+    int excess = static_cast<int>(ownedModules(connector)) - static_cast<int>(efficientModuleCount(connector));
+    return std::max(excess, 0);
+}
+
+// True if running more modules would be more efficient - used by assign_extra_modules()
+bool efficiencyWantsMore(ConnectorType connector) {
+    return efficiencyPolicyEnabled && ownedModules(connector) < efficientModuleCount(connector);
+}
+
+// ------------ savings estimate (simulator) ------------
+
+double efficiencySavedWh = 0.0;
+double efficiencyObservedHours = 0.0;
+
+// Compares the current ownership against the baseline allocator (just enough
+// modules to cover EVMaxCurrent) over the last `hours`.
+void accumulateEfficiencySavings(double hours) {
+    for (int c = 1; c <= 12; c++) {
+        ConnectorType connector = static_cast<ConnectorType>(c);
+        if (!connectorArray[c].isActive) continue;
+        float demand = connectorArray[c].EVMaxCurrent;
+        float moduleMaxCurrent = pmArray[defaultModule(connector)].MaxCurrent;
+        if (demand <= 0 || moduleMaxCurrent <= 0) continue;
+
+        float voltage = connectorVoltage(connector);
+        uint16_t baseline = static_cast<uint16_t>(std::ceil(demand / (2 * moduleMaxCurrent))) * 2; // whole pairs
+        uint16_t actual = ownedModules(connector);
+        if (actual * moduleMaxCurrent < demand) continue; // under powered, not comparable
+        efficiencySavedWh += (conversionLoss(demand, voltage, baseline, moduleMaxCurrent)
+            - conversionLoss(demand, voltage, actual, moduleMaxCurrent)) * hours;
+    }
+    efficiencyObservedHours += hours;
+}
+
+double estimatedKWhSavedPerDay() {
+    return (efficiencyObservedHours > 0) ? efficiencySavedWh / efficiencyObservedHours * 24.0 / 1000.0 : 0.0;
+}
+
+//******************************************   EFFICIENCY POLICY END   ******************************************************/
+
+//******************************************   THERMAL POLICY START   ******************************************************/
+
+// Among equivalent routing options the allocator prefers the coolest modules,
+// the optimiser removes the hottest end modules first, and the ramp engine
+// shifts current away from modules approaching their thermal limit before
+// the module derates itself (POWER_LIMIT_HIGH_TEMP).
+
+const float DEFAULT_MAX_TEMPERATURE = 75.0f; // used while MaxTemperature is not reported
+const float THERMAL_SHIFT_MARGIN = 10.0f;    // start shifting load this far below the limit
+const float THERMAL_MIN_WEIGHT = 0.3f;       // share kept by a module at its limit
+bool thermalPolicyEnabled = true;
+
+float thermalLimit(uint16_t module) {
+    return (pmArray[module].MaxTemperature > 0) ? pmArray[module].MaxTemperature : DEFAULT_MAX_TEMPERATURE;
+}
+
+bool isThermallyLimited(uint16_t module) {
+    return pmArray[module].faultBits[static_cast<size_t>(FaultBits::POWER_LIMIT_HIGH_TEMP)]
+        || pmArray[module].faultBits[static_cast<size_t>(FaultBits::HIGH_TEMPERATURE)];
+}
+
+// 1.0 : full share, down to THERMAL_MIN_WEIGHT at / over the limit
+float thermalWeight(uint16_t module) {
+    if (!thermalPolicyEnabled) return 1.0f;
+    if (isThermallyLimited(module)) return THERMAL_MIN_WEIGHT;
+    float headroom = thermalLimit(module) - pmArray[module].temperature;
+    if (headroom >= THERMAL_SHIFT_MARGIN) return 1.0f;
+    if (headroom <= 0) return THERMAL_MIN_WEIGHT;
+    return THERMAL_MIN_WEIGHT + (1.0f - THERMAL_MIN_WEIGHT) * headroom / THERMAL_SHIFT_MARGIN;
+}
+
+// Average temperature of the relay chain reachable from a connector's default module
+float chainTemperature(ConnectorType connector) {
+    uint16_t start = defaultModule(connector);
+    int step = (static_cast<uint8_t>(connector) % 2 == 0) ? -2 : 2;
+    float sum = 0.0f;
+    int count = 0;
+    for (int k = 0; k < 4; k++) {
+        uint16_t module = start + k * step;
+        if (nodeActive(module)) continue; // only what could be assigned
+        for (uint16_t m = module; m <= module + 1; m++) {
+            if (!pmArray[m].isAlive) continue;
+            sum += pmArray[m].temperature;
+            count++;
+        }
+    }
+    return (count == 0) ? 1e6f : sum / count;
+}
+
+ConnectorType muxPeer(uint16_t index, ConnectorType connector) {
+    const ConnectorPairMux& mux = connectorPairMuxTable[index];
+    if (mux.connectorA == connector) return mux.connectorB;
+    if (mux.connectorB == connector) return mux.connectorA;
+    return ConnectorType::DEFAULT;
+}
+
+// Fills order[0..connectorMuxCount) with mux table indices, muxes of
+// `connector` sorted coolest peer chain first. Table order when disabled.
+void thermalMuxOrder(ConnectorType connector, uint16_t* order) {
+    float key[64];
+    for (uint16_t i = 0; i < connectorMuxCount; i++) {
+        order[i] = i;
+        ConnectorType peer = muxPeer(i, connector);
+        if (peer == ConnectorType::DEFAULT) key[i] = 1e7f; // not a mux of this connector
+        else key[i] = thermalPolicyEnabled ? chainTemperature(peer) : 0.0f;
+    }
+    std::stable_sort(order, order + connectorMuxCount, [&](uint16_t a, uint16_t b) { return key[a] < key[b]; });
+}
+
+// Module ids 1-48, hottest first (ascending id when disabled)
+void thermalRemovalOrder(uint16_t* order) {
+    for (uint16_t i = 0; i < 48; i++) order[i] = i + 1;
+    if (!thermalPolicyEnabled) return;
+    std::stable_sort(order, order + 48, [](uint16_t a, uint16_t b) { return pmArray[a].temperature > pmArray[b].temperature; });
+}
+
+// True if a module of the connector is within THERMAL_SHIFT_MARGIN of its limit
+// and the policy can shift load off it : the default node is never removed,
+// so a hot default module alone does not ask for more modules
+bool thermalWantsMore(ConnectorType connector) {
+    if (!thermalPolicyEnabled) return false;
+    uint16_t defaultNode = defaultModule(connector); // and defaultNode + 1
+    for (uint16_t i = 1; i < 49; i++) {
+        if (i == defaultNode || i == defaultNode + 1) continue;
+        if (pmArray[i].Connector == connector && pmArray[i].isAlive && thermalWeight(i) < 1.0f) return true;
+    }
+    return false;
+}
+
+//******************************************   THERMAL POLICY END   ******************************************************/
+
+//******************************************   EVSE LIMITS START   ******************************************************/
+
+// The EVSE limits a connector reports to the vehicle follow from the modules
+// it owns. They run in parallel on one output : currents and powers add up,
+// the voltage window is the intersection of the module windows. Thermal
+// derating scales a module's current and power by thermalWeight(), a dead
+// module contributes nothing. Only connectors in evseLimitsStale (owned set
+// changed) or whose modules' ratings moved are recomputed; the present
+// values are refreshed from telemetry on every pass.
+
+const float MODULE_DEFAULT_MAX_VOLTAGE = 1000.0f; // used while MaxVoltage is not reported
+const float MODULE_DEFAULT_MIN_VOLTAGE = 150.0f;
+const float EVSE_PRESENT_DEADBAND = 0.1f;         // A / V change that is worth a publish
+const uint32_t EVSE_REFRESH_MS = 100;             // telemetry refresh of derating and present values
+
+struct EvseModuleRating
+{
+    bool alive = false;
+    float weight = 0.0f; // thermalWeight() when last derived
+    float maxCurrent = 0.0f;
+};
+
+EvseModuleRating evseModuleRating[49]; // engine thread only
+
+float moduleMaxVoltage(uint16_t module) {
+    return (pmArray[module].MaxVoltage > 0) ? pmArray[module].MaxVoltage : MODULE_DEFAULT_MAX_VOLTAGE;
+}
+
+float moduleMinVoltage(uint16_t module) {
+    return (pmArray[module].MinVoltage > 0) ? pmArray[module].MinVoltage : MODULE_DEFAULT_MIN_VOLTAGE;
+}
+
+float moduleMaxPower(uint16_t module) {
+    return (pmArray[module].MaxPower > 0) ? pmArray[module].MaxPower : pmArray[module].MaxCurrent * moduleMaxVoltage(module);
+}
+
+// Marks owners whose modules changed health, derating or rating since the last derivation
+void markDeratedConnectors() {
+    uint64_t owned = 0;
+    for (int c = 1; c <= 12; c++) owned |= ownedModuleMask[c];
+    forEachBit(owned, [](int m) {
+        const EvseModuleRating& last = evseModuleRating[m];
+        if (last.alive != pmArray[m].isAlive || last.weight != thermalWeight(m) || last.maxCurrent != pmArray[m].MaxCurrent) {
+            evseLimitsStale |= 1u << static_cast<int>(pmArray[m].Connector);
+        }
+    });
+}
+
+bool evseValueMoved(float& field, float value, float deadband) {
+    if (std::fabs(field - value) <= deadband) return false;
+    field = value;
+    return true;
+}
+
+void deriveEvseLimits(int c) {
+    Connector& connector = connectorArray[c];
+    float maxCurrent = 0.0f, minCurrent = 0.0f, maxPower = 0.0f;
+    float maxVoltage = 0.0f, minVoltage = 0.0f;
+    bool any = false;
+
+    forEachBit(connector.isActive ? ownedModuleMask[c] : 0, [&](int m) {
+        float weight = thermalWeight(m);
+        evseModuleRating[m] = { pmArray[m].isAlive, weight, pmArray[m].MaxCurrent };
+        if (!pmArray[m].isAlive) return;
+        maxCurrent += pmArray[m].MaxCurrent * weight;
+        minCurrent += pmArray[m].MinCurrent; // the ramp engine drives every owned module
+        maxPower += moduleMaxPower(m) * weight;
+        maxVoltage = any ? std::min(maxVoltage, moduleMaxVoltage(m)) : moduleMaxVoltage(m);
+        minVoltage = any ? std::max(minVoltage, moduleMinVoltage(m)) : moduleMinVoltage(m);
+        any = true;
+    });
+    if (any && minVoltage > maxVoltage) any = false; // no common window : nothing can be delivered
+
+    connector.EVSEMaxCurrent = any ? maxCurrent : 0.0f;
+    connector.EVSEMinCurrent = any ? std::min(minCurrent, maxCurrent) : 0.0f;
+    connector.EVSEMaxVoltage = any ? maxVoltage : 0.0f;
+    connector.EVSEMinVoltage = any ? minVoltage : 0.0f;
+    connector.EVSEMaxPower = any ? std::min(maxPower, maxCurrent * maxVoltage) : 0.0f;
+}
+
+// Engine thread. Returns true if anything the vehicle side sees changed.
+bool updateEvseLimits(bool refreshPresent) {
+    bool moved = false;
+    for (int c = 1; c <= 12; c++) {
+        Connector& connector = connectorArray[c];
+        if (evseLimitsStale & (1u << c)) {
+            Connector before = connector;
+            deriveEvseLimits(c);
+            moved |= before.EVSEMaxCurrent != connector.EVSEMaxCurrent || before.EVSEMinCurrent != connector.EVSEMinCurrent
+                || before.EVSEMaxVoltage != connector.EVSEMaxVoltage || before.EVSEMinVoltage != connector.EVSEMinVoltage
+                || before.EVSEMaxPower != connector.EVSEMaxPower;
+        }
+        if (!refreshPresent && !(evseLimitsStale & (1u << c))) continue;
+
+        float current = 0.0f, voltage = 0.0f;
+        forEachBit(connector.isActive ? ownedModuleMask[c] : 0, [&](int m) {
+            if (!pmArray[m].isAlive) return;
+            current += pmArray[m].outputCurrent;
+            voltage = std::max(voltage, pmArray[m].outputVoltage); // common output bus
+        });
+        moved |= evseValueMoved(connector.EVSEPresentCurrent, current, EVSE_PRESENT_DEADBAND);
+        moved |= evseValueMoved(connector.EVSEPresentVoltage, voltage, EVSE_PRESENT_DEADBAND);
+    }
+    evseLimitsStale = 0;
+    return moved;
+}
+
+//******************************************   EVSE LIMITS END   ******************************************************/
+
+//******************************************   SWITCHING COST START   ******************************************************/
+
+// Keeps the optimiser from flapping relays / muxes when EV demand hovers
+// around a module boundary :
+//  - hysteresis band between the add (capacity < demand) and remove
+//    (capacity - pair >= demand + band) decisions
+//  - minimum dwell time per relay / mux after each actuation
+//  - per optimisation cycle switch budget
+//  - a move is made only if its expected gain outweighs its switching cost
+// Session start / stop switching is never gated.
+
+const float SWITCH_HYSTERESIS_A = 10.0f;
+const uint32_t SWITCH_MIN_DWELL_MS = 60000;
+const uint16_t SWITCH_BUDGET_PER_CYCLE = 8;
+const float SWITCH_COST_W = 200.0f;            // per actuation, amortised
+const float SWITCH_RATED_ACTUATIONS = 100000;  // cost doubles at rated life
+
+uint16_t switchBudgetLeft = SWITCH_BUDGET_PER_CYCLE;
+
+void beginOptimiserCycle() {
+    switchBudgetLeft = SWITCH_BUDGET_PER_CYCLE;
+}
+
+float switchCost(uint16_t switchId) {
+    float wear = switchToggleCount[switchId].load(std::memory_order_relaxed) / SWITCH_RATED_ACTUATIONS;
+    return SWITCH_COST_W * (1.0f + wear);
+}
+
+// Gate for optimiser moves. Returns true (and consumes budget) if every switch
+// is past its dwell time, the budget allows it and gainW exceeds the cost.
+bool optimiserMayToggle(std::initializer_list<uint16_t> switchIds, float gainW) {
+    uint64_t now = steadyMs();
+    float cost = 0.0f;
+    uint16_t count = 0;
+    for (uint16_t id : switchIds) {
+        if (id == 0) continue;
+        uint64_t last = switchLastToggleMs[id].load(std::memory_order_relaxed);
+        if (last != 0 && now - last < SWITCH_MIN_DWELL_MS) {
+            std::cout << "\n[Switching] " << id << " within dwell time, move skipped";
+            return false;
+        }
+        cost += switchCost(id);
+        count++;
+    }
+    if (count > switchBudgetLeft) {
+        std::cout << "\n[Switching] cycle budget exhausted, move skipped";
+        return false;
+    }
+    if (gainW <= cost) {
+        std::cout << "\n[Switching] gain " << gainW << " W <= cost " << cost << " W, move skipped";
+        return false;
+    }
+    switchBudgetLeft -= count;
+    return true;
+}
+
+float connectorCapacity(ConnectorType connector) {
+    return specialisedLayout ? StandardEngine::connectorCapacity(connector) : RuntimeEngine::connectorCapacity(connector);
+}
+
+// Modules opt_removeModules() may take : above the efficient count, and what
+// remains must still cover EVMaxCurrent + SWITCH_HYSTERESIS_A
+int removableModules(ConnectorType connector) {
+    int modules = excessModules(connector);
+    float demand = connectorArray[static_cast<int>(connector)].EVMaxCurrent;
+    float moduleCurrent = pmArray[defaultModule(connector)].MaxCurrent;
+    while (modules > 0 && connectorCapacity(connector) - modules * moduleCurrent < demand + SWITCH_HYSTERESIS_A) modules--;
+    return modules;
+}
+
+// Whole modules in `current`, for the conversion loss model
+int16_t modulesIn(ConnectorType connector, float current) {
+    float moduleMaxCurrent = pmArray[defaultModule(connector)].MaxCurrent;
+    return (moduleMaxCurrent > 0) ? static_cast<int16_t>(std::lround(current / moduleMaxCurrent)) : 0;
+}
+
+float connectorDeficit(ConnectorType connector) {
+    int c = static_cast<int>(connector);
+    if (!connectorArray[c].isActive) return 0.0f;
+    return std::max(0.0f, connectorArray[c].EVMaxCurrent - connectorCapacity(connector));
+}
+
+// Expected gain (W) of giving `current` (one or two modules of the node of
+// `module`) to `connector` : delivered power it lacks, else conversion loss
+// saved plus the share of the demand the candidate takes off hot modules
+float assignGainW(ConnectorType connector, uint16_t module, float current) {
+    float voltage = std::max(connectorVoltage(connector), 1.0f);
+    float deficit = connectorDeficit(connector);
+    if (deficit > 0) return std::min(deficit, current) * voltage;
+
+    float demand = connectorArray[static_cast<int>(connector)].EVMaxCurrent;
+    float moduleMaxCurrent = pmArray[defaultModule(connector)].MaxCurrent;
+    uint16_t owned = ownedModules(connector);
+    float gain = conversionLoss(demand, voltage, owned, moduleMaxCurrent) - conversionLoss(demand, voltage, owned + modulesIn(connector, current), moduleMaxCurrent);
+
+    // Owned modules share the demand by MaxCurrent * thermalWeight(), as
+    // rampRetarget() splits it; a warm candidate takes a smaller share
+    float weightSum = 0.0f, hotWeight = 0.0f, atRisk = 0.0f;
+    for (uint16_t i = 1; i < 49; i++) {
+        if (pmArray[i].Connector != connector || !pmArray[i].isAlive) continue;
+        float weight = thermalWeight(i);
+        weightSum += pmArray[i].MaxCurrent * weight;
+        if (weight < 1.0f) {
+            hotWeight += pmArray[i].MaxCurrent * weight;
+            atRisk += (1.0f - weight) * pmArray[i].MaxCurrent; // current derating would take away
+        }
+    }
+    if (hotWeight <= 0 || demand <= 0) return gain;
+    uint16_t node = nodeOf(module);
+    float added = current * std::min(thermalWeight(node), thermalWeight(node + 1));
+    float relief = demand * hotWeight * (1.0f / weightSum - 1.0f / (weightSum + added)); // current moved off hot modules
+    return gain + std::min(relief, atRisk) * voltage;
+}
+
+// Expected gain (W) of freeing `current` (one or two modules) of `connector` :
+// capacity other connectors are short of plus conversion loss saved
+float removalGainW(ConnectorType connector, float current) {
+    float voltage = std::max(connectorVoltage(connector), 1.0f);
+    float othersShort = 0.0f;
+    for (int c = 1; c <= 12; c++) {
+        if (c != static_cast<int>(connector)) othersShort += connectorDeficit(static_cast<ConnectorType>(c));
+    }
+    float demand = connectorArray[static_cast<int>(connector)].EVMaxCurrent;
+    float moduleMaxCurrent = pmArray[defaultModule(connector)].MaxCurrent;
+    uint16_t owned = ownedModules(connector);
+    float lossSaved = conversionLoss(demand, voltage, owned, moduleMaxCurrent) - conversionLoss(demand, voltage, owned - modulesIn(connector, current), moduleMaxCurrent);
+    return std::min(othersShort, current) * voltage + lossSaved;
+}
+
+//******************************************   SWITCHING COST END   ******************************************************/
+
+// First fit search : default node, own chain, normal mux, super mux.
+// assign_power_modules() looks the result up in the plan cache first.
+void assign_power_modules_search(ConnectorType connector) {
+
+    TRACE_SCOPE("assign_power_modules");
 
     isolateConnector(connector);
 
@@ -865,8 +2142,11 @@ void assign_power_modules(ConnectorType connector) {
         if (sufficientPower(connector)) return;
     }
 
-    // Normal mux subset (muxId < 400)
-    for (uint16_t i = 0; i < connectorMuxCount; i++) {
+    // Normal mux subset (muxId < 400), coolest peer first
+    uint16_t muxOrder[64];
+    thermalMuxOrder(connector, muxOrder);
+    for (uint16_t k = 0; k < connectorMuxCount; k++) {
+        uint16_t i = muxOrder[k];
         if (connectorPairMuxTable[i].muxId > 400) continue;
 
         ConnectorType peer = ConnectorType::DEFAULT;
@@ -881,7 +2161,7 @@ void assign_power_modules(ConnectorType connector) {
         }
 
         connection_module = defaultModule(peer);
-        if (!moduleStatus(connection_module) && pmArray[connection_module].isAlive) {
+        if (!nodeActive(connection_module) && nodeAlive(connection_module)) {
             assign(connector, connection_module); mux_on(connectorPairMuxTable[i].muxId); if (sufficientPower(connector)) return;
             if (static_cast<uint8_t>(peer) % 2 == 0) {
                 if (assign(connector, connection_module - 2)) relay_on(connection_module, connection_module - 2);
@@ -920,7 +2200,7 @@ void assign_power_modules(ConnectorType connector) {
         }
 
         connection_module = defaultModule(superPeer);
-        if (!moduleStatus(connection_module) && pmArray[connection_module].isAlive) {
+        if (!nodeActive(connection_module) && nodeAlive(connection_module)) {
             assign(connector, connection_module); mux_on(connectorPairMuxTable[i].muxId); if (sufficientPower(connector)) return;
             if (static_cast<uint8_t>(superPeer) % 2 == 0) {
                 if (assign(connector, connection_module - 2)) relay_on(connection_module, connection_module - 2);
@@ -941,8 +2221,11 @@ void assign_power_modules(ConnectorType connector) {
             //mux_on(connectorPairMuxTable[i].muxId);
         }
 
-        // Try finding a second-level mux from the peer
-        for (uint16_t j = 0; j < connectorMuxCount; j++) {
+        // Try finding a second-level mux from the peer, coolest first
+        uint16_t subMuxOrder[64];
+        thermalMuxOrder(superPeer, subMuxOrder);
+        for (uint16_t k = 0; k < connectorMuxCount; k++) {
+            uint16_t j = subMuxOrder[k];
             if (connectorPairMuxTable[j].muxId > 400) continue;
 
             ConnectorType subPeer = ConnectorType::DEFAULT;
@@ -960,7 +2243,7 @@ void assign_power_modules(ConnectorType connector) {
 
             // Check if the module is not already assigned and is alive
             // change moduleStatus fn to pmArray[module].isActive - check redability
-            if (!moduleStatus(connection_module) && pmArray[connection_module].isAlive) {
+            if (!nodeActive(connection_module) && nodeAlive(connection_module)) {
                 assign(connector, connection_module); mux_on(connectorPairMuxTable[j].muxId); if (sufficientPower(connector)) return;
                 if (static_cast<uint8_t>(subPeer) % 2 == 0) {
                     if (assign(connector, connection_module - 2)) relay_on(connection_module, connection_module - 2);
@@ -987,14 +2270,29 @@ void assign_power_modules(ConnectorType connector) {
 
 void assign_extra_modules(ConnectorType connector) {
 
+    TRACE_SCOPE("assign_extra_modules");
+
     std::cout << "\nAssigning extra modules for connector: " << static_cast<int>(connector) << "\n";
     int connectorIndex = static_cast<int>(connector);
     if (connectorArray[connectorIndex].isActive == false) return;
-    if (sufficientPower(connector) == true) return;
+    if (sufficientPower(connector) == true && !efficiencyWantsMore(connector) && !thermalWantsMore(connector)) return;
+
+    if (assignNodeSpare(connector)) return; // spare module in a connected node : no switching
 
     uint16_t allMuxArray[4] = { 0, 0, 0, 0 };
 
     getAllMuxes(connector, allMuxArray);
+    if (thermalPolicyEnabled) { // coolest peer first
+        std::stable_sort(allMuxArray, allMuxArray + 4, [connector](uint16_t a, uint16_t b) {
+            if (a == 0 || b == 0) return b == 0 && a != 0;
+            ConnectorType peerA = ConnectorType::DEFAULT, peerB = ConnectorType::DEFAULT;
+            for (uint16_t i = 0; i < connectorMuxCount; i++) {
+                if (connectorPairMuxTable[i].muxId == a) peerA = muxPeer(i, connector);
+                if (connectorPairMuxTable[i].muxId == b) peerB = muxPeer(i, connector);
+            }
+            return chainTemperature(peerA) < chainTemperature(peerB);
+        });
+    }
 
     for (uint8_t i = 0; i < 4; i++) {
         uint16_t muxId = allMuxArray[i];
@@ -1008,7 +2306,8 @@ void assign_extra_modules(ConnectorType connector) {
                 if (connectorPairMuxTable[i].muxId == muxId) {
                     ConnectorType peer = (connectorPairMuxTable[i].connectorA == connector) ? connectorPairMuxTable[i].connectorB : connectorPairMuxTable[i].connectorA;
                     uint16_t connection_module = defaultModule(peer);
-                    if (!connectorArray[static_cast<int>(peer)].isActive && pmArray[connection_module].isAlive && !moduleStatus(connection_module)) {
+                    if (!connectorArray[static_cast<int>(peer)].isActive && nodeAlive(connection_module) && !nodeActive(connection_module)) {
+                        if (!optimiserMayToggle({ muxId }, assignGainW(connector, connection_module, nodeCurrent(connection_module)))) continue;
                         assign(connector, connection_module); mux_on(muxId);
                         return; // return after assigning one module
                     }
@@ -1022,7 +2321,8 @@ void assign_extra_modules(ConnectorType connector) {
                 if (connectorPairMuxTable[i].muxId == muxId) {
                     ConnectorType peer = (connectorPairMuxTable[i].connectorA == connector) ? connectorPairMuxTable[i].connectorB : connectorPairMuxTable[i].connectorA;
                     uint16_t connection_module = defaultModule(peer);
-                    if (!connectorArray[static_cast<int>(peer)].isActive && pmArray[connection_module].isAlive && !moduleStatus(connection_module)) {
+                    if (!connectorArray[static_cast<int>(peer)].isActive && nodeAlive(connection_module) && !nodeActive(connection_module)) {
+                        if (!optimiserMayToggle({ muxId }, assignGainW(connector, connection_module, nodeCurrent(connection_module)))) continue;
                         assign(connector, connection_module); mux_on(muxId);
                         return;
                     }
@@ -1039,14 +2339,16 @@ void assign_extra_modules(ConnectorType connector) {
 
 void isolateModule(uint16_t module) {
 
+    TRACE_SCOPE("isolateModule");
+
     std::cout << "\nIsolating module: " << module << "\n";
 
     if (module > 0 && module < 49) {
-        pmArray[module].Connector = ConnectorType::DEFAULT;
-        pmArray[module].isActive = false;
+        module = nodeOf(module); // relays switch the whole node
 
-        pmArray[module + 1].Connector = ConnectorType::DEFAULT;
-        pmArray[module + 1].isActive = false;
+        setModuleOwner(module, ConnectorType::DEFAULT);
+        setModuleOwner(module + 1, ConnectorType::DEFAULT);
+        moduleCapacityFreed = true;
 
         std::cout << "Module " << module << " and " << module + 1 << " isolated.\n";
     }
@@ -1059,11 +2361,31 @@ void isolateModule(uint16_t module) {
     //pmArray[module].isActive = false;
 
     //switchOff relays
-    for (uint8_t i = 0; i < relayMuxCount; i++) {
-        if (relayMuxTable[i].pmA == module || relayMuxTable[i].pmB == module) {
-            relayMuxTable[i].status = false;
-            //send command to switch off relay
-        }
+    if (module > 0 && module < 49) {
+        forEachBit(nodeRelayMask[module], [](int i) {
+            if (relayMuxTable[i].status) setRelayStatus(relayMuxTable[i], false); //send command to switch off relay
+        });
+    }
+}
+
+// Frees a single module; its partner keeps the node (and its relays) in use.
+// Isolates the node when it was the last active module.
+void releaseModule(uint16_t module) {
+    uint16_t partner = (module % 2 == 0) ? module - 1 : module + 1;
+    if (!pmArray[partner].isActive) {
+        isolateModule(module);
+        return;
+    }
+    std::cout << "\nReleasing module: " << module << "\n";
+    setModuleOwner(module, ConnectorType::DEFAULT);
+    moduleCapacityFreed = true;
+}
+
+// Isolates the nodes `owner` holds in modules [begin, begin + count), from the ownership index
+void isolateOwnedModules(ConnectorType owner, uint16_t begin, uint16_t count) {
+    uint64_t range = ((count >= 64) ? ~0ull : ((1ull << count) - 1)) << begin;
+    for (uint64_t held = ownedModuleMask[static_cast<int>(owner)] & range; held; held = ownedModuleMask[static_cast<int>(owner)] & range) {
+        isolateModule(static_cast<uint16_t>(std::countr_zero(held))); // clears the whole node
     }
 }
 
@@ -1071,20 +2393,21 @@ void isolateConnector(ConnectorType connector) {
     //TODO : when isolating entire subset. check for order
     //TODO : implement isolation logic for connector subsets or supersets as whole.
 
+    ScopedLatency latency(isolateLatency);
+    TRACE_SCOPE("isolateConnector");
+
     std::cout << "\nIsolating connector: " << static_cast<int>(connector) << "\n";
 
     if (connectorArray[static_cast<int>(connector)].isActive == true) {
-        std::cerr << "Connector is active. Cannot isolate!\n USE stopConnector() function.\n";
+        std::cerr << "Connector is active. Cannot isolate!\n Send a STOP first.\n";
     }
 
-    printModuleStatus();
-
     //check if default module is already assigned
     uint16_t defaultModuleId = defaultModule(connector);
-    if (moduleStatus(defaultModuleId) == false && isMuxIsolation(connector)) return;
+    if (nodeActive(defaultModuleId) == false && isMuxIsolation(connector)) return;
 
     //check if this if is needed
-    if (moduleStatus(defaultModuleId)) {
+    if (nodeActive(defaultModuleId)) {
         //Already Assigned
         ConnectorType active_connector = getActiveConnector(defaultModuleId);
         uint16_t activeMuxes[2] = { 0, 0 };
@@ -1104,37 +2427,20 @@ void isolateConnector(ConnectorType connector) {
             if (activeMuxes[0] != 0 && activeMuxes[1] != 0) {
                 // No zeros exist, both Muxes are active
                 //case 2.1 : if both muxes are active, isolate all modules of superset
-                uint16_t i = supersetModuleBegin(superset(connector));
-                for (; i < supersetModuleBegin(superset(connector)) + 16; i++) {
-                    if (getActiveConnector(i) == active_connector) {
-                        isolateModule(i);
-                    }
-                }
+                isolateOwnedModules(active_connector, supersetModuleBegin(superset(connector)), 16);
             }
             else {
                 //case 2.2 : if only one mux is active, isolate all modules of subset
-                uint16_t i = subsetModuleBegin(subset(connector));
-                for (; i < subsetModuleBegin(subset(connector)) + 8; i++) {
-                    if (getActiveConnector(i) == active_connector) {
-                        isolateModule(i);
-                    }
-                }
+                isolateOwnedModules(active_connector, subsetModuleBegin(subset(connector)), 8);
             }
         }
 
         //case 3 : if direct mux connection not exists: isolate all modules of subset
         else if (muxId == 0) {
             std::cout << "CASE 3";
-            uint16_t i = subsetModuleBegin(subset(connector));
-            for (; i < subsetModuleBegin(subset(connector)) + 8; i++) {
-                if (getActiveConnector(i) == active_connector) {
-                    isolateModule(i);
-                }
-            }
+            isolateOwnedModules(active_connector, subsetModuleBegin(subset(connector)), 8);
         }
-        std::cout << "\nAfter Isolation:\n";
         allMuxesOff(connector);
-        printModuleStatus();
         return;
     }
     else {
@@ -1145,39 +2451,30 @@ void isolateConnector(ConnectorType connector) {
 
 }
 
-void stopConnector(ConnectorType connector) {
+// Tears a session down in the allocator state (ownership, relay / mux tables)
+// once its modules are at 0 A; the stop sequence ramps them down first.
+void stopConnectorState(ConnectorType connector) {
 
     if (connectorArray[static_cast<int>(connector)].isActive == false) return;
 
-    for (int i = 1; i < 49; i++) {
-        if (pmArray[i].Connector == connector) {
-            //Power Down first
-        }
-    }
-
-    for (int i = 1; i < 49; i++) {
-        if (pmArray[i].Connector == connector) {
-            isolateModule(i);
-        }
-    }
-
-    uint16_t activeMuxes[2] = { 0,0 };
-    getActiveMuxes(connector, activeMuxes);
-    for (uint8_t i = 0; i < 2; i++) {
-        if (activeMuxes[i] == 0) continue;
-        for (uint8_t j = 0; j < connectorMuxCount; j++) {
-            if (connectorPairMuxTable[j].muxId == activeMuxes[i]) {
-                ConnectorType peer = (connectorPairMuxTable[j].connectorA == connector) ? connectorPairMuxTable[j].connectorB : connectorPairMuxTable[j].connectorA;
-                isolateConnector(peer);
-                connectorPairMuxTable[j].status = false; // mux_off(activeMuxes[i]);
-            }
-        }
+    isolateOwnedModules(connector, 1, 48);
+    forEachBit(closedRelayMask[static_cast<int>(connector)], [](int i) {
+        setRelayStatus(relayMuxTable[i], false); // still attributed to the session, e.g. left closed by a released module
+    });
 
-    }
+    forEachBit(closedMuxMask[static_cast<int>(connector)], [connector](int j) {
+        ConnectorType peer = (connectorPairMuxTable[j].connectorA == connector) ? connectorPairMuxTable[j].connectorB : connectorPairMuxTable[j].connectorA;
+        isolateConnector(peer);
+        setMuxStatus(connectorPairMuxTable[j], false); // mux_off(activeMuxes[i]);
+    });
     connectorArray[static_cast<int>(connector)].isActive = false;
+
+    admissionUpdate(connector);
+    dispatchFreedCapacity(); // freed modules go to waiting connectors now
 }
 
 void printModuleStatus() {
+    TRACE_SCOPE("printModuleStatus");
     std::cout << "\n ****** Module Status (1-48) ****** \n";
     // Print column headers
     std::cout << "\n      ";  // padding for row labels
@@ -1224,10 +2521,10 @@ uint16_t hasSpareModules(ConnectorType connector) {
 
     int connectorIndex = static_cast<int>(connector);
 
-    int baseModuleCurrent = 33.5;
-    int extraCurrent = connectorArray[connectorIndex].EVSEMaxCurrent - connectorArray[connectorIndex].EVMaxCurrent;
+    float baseModuleCurrent = activeConfig.spareModuleCurrentA;
+    float extraCurrent = connectorArray[connectorIndex].EVSEMaxCurrent - connectorArray[connectorIndex].EVMaxCurrent; // derived by updateEvseLimits()
 
-    return (extraCurrent <= 0) ? 0 : extraCurrent / (2 * baseModuleCurrent); // 0 or no of extra modules
+    return (extraCurrent <= 0) ? 0 : static_cast<uint16_t>(extraCurrent / (2 * baseModuleCurrent)); // 0 or no of extra pairs
 
 }
 
@@ -1260,6 +2557,8 @@ bool preference(ConnectorType connectorA, ConnectorType connectorB) { //TODO: Wo
 
 void opt_removeModules(ConnectorType connector, int num = -1) {
 
+    TRACE_SCOPE("opt_removeModules");
+
     // will remove END modules only
 
     int connectorIndex = static_cast<int>(connector);
@@ -1269,19 +2568,27 @@ void opt_removeModules(ConnectorType connector, int num = -1) {
 
     if (num == -1)
     {
-        if (!extraPower(connector)) return;
-        int num = extraPower(connector) / 60;
+        num = removableModules(connector); // modules above the efficient module count, with hysteresis
+        if (num <= 0) return;
     }
 
     uint16_t defaultModuleId = defaultModule(connector);
 
-    for (int i = 1; i < 49; i++) {
+    uint16_t removalOrder[48];
+    thermalRemovalOrder(removalOrder); // hottest end modules go first
 
-        if (i % 2 == 0) continue; //secondary modules
-        if (pmArray[i].isAlive == false) continue; //not alive
-        if (pmArray[i].isActive == false) continue; //not active
-        if (pmArray[i].Connector != connector) continue; // not connected to this connector 
+    // Whole END nodes first : frees routable capacity for other connectors
+    bool visited[49] = {};
+    for (int k = 0; k < 48 && num > 0; k++) {
+        int i = nodeOf(removalOrder[k]);
+
+        if (visited[i]) continue;
+        visited[i] = true;
+        if (nodeOwner(i) != connector) continue; // not connected to this connector
         if (i == defaultModuleId) continue; //default module - not removable
+        int modules = nodeModules(i, connector);
+        if (modules > num) continue; // would drop below demand - single modules below
+        float nodeCurrentA = nodeCurrent(i, connector);
 
         uint16_t relayIds[2];
         getRelay(i, relayIds);
@@ -1289,10 +2596,12 @@ void opt_removeModules(ConnectorType connector, int num = -1) {
         //Remove End PM (Has two relays & one of the is off)
         if (relayIds[0] != 0 && relayIds[1] != 0) {
             if (relayStatus(relayIds[0]) == false || relayStatus(relayIds[1]) == false) {
+                uint16_t closedRelay = relayStatus(relayIds[0]) ? relayIds[0] : relayIds[1];
+                if (!optimiserMayToggle({ closedRelay }, removalGainW(connector, nodeCurrentA))) continue;
+                rampHandover(i);
                 isolateModule(i);
 
-                num--;
-                if (num == 0) break;
+                num -= modules;
             }
         }
         //PMs with 1 relay (has direct connection to connector)
@@ -1304,9 +2613,10 @@ void opt_removeModules(ConnectorType connector, int num = -1) {
 
             //if relay = ON, MuxIsolation = true -> powering only through relay -> Isolate module
             if (relayStatus(relayIds[0]) == true && isMuxIsolation(defaultConnector) == true) {
+                if (!optimiserMayToggle({ relayIds[0] }, removalGainW(connector, nodeCurrentA))) continue;
+                rampHandover(i);
                 isolateModule(i);
-                num--;
-                if (num == 0) break;
+                num -= modules;
             }
 
             //if relay = OFF, MuxIsolation = false -> powering through mux -> Isolate connector(shutsdown PM and all connector muxes)
@@ -1317,10 +2627,11 @@ void opt_removeModules(ConnectorType connector, int num = -1) {
                 getActiveMuxes(defaultConnector, activeMuxes);
                 // Only 1 mux should be active to be END module - alredy checked mux isolation
                 if (activeMuxes[0] == 0 || activeMuxes[1] == 0) {
+                    if (!optimiserMayToggle({ activeMuxes[0], activeMuxes[1] }, removalGainW(connector, nodeCurrentA))) continue;
+                    rampHandover(i);
                     isolateModule(i);
                     isolateConnector(defaultConnector); // isolates connector as well as powermodules
-                    num--;
-                    if (num == 0) break;
+                    num -= modules;
                 }
             }
         }
@@ -1328,13 +2639,33 @@ void opt_removeModules(ConnectorType connector, int num = -1) {
             std::cerr << "Error :: invalid relay ids for module: " << i << std::endl;
         }
     }
+
+    // Then single modules of nodes the connector holds both modules of - any
+    // node, the relays stay as they are
+    for (int k = 0; k < 48 && num > 0; k++) {
+        int i = removalOrder[k];
+
+        if (!pmArray[i].isActive || pmArray[i].Connector != connector) continue;
+        if (nodeModules(i, connector) < 2) continue; // last module of its node
+        if (!optimiserMayToggle({}, removalGainW(connector, pmArray[i].MaxCurrent))) continue;
+        rampHandover(i, false);
+        releaseModule(i);
+        num--;
+    }
 }
 
 void opt_assignModules(int iteration) {
-    for (int i = 1; i < 49; i++) {
-        if (i % 2 == 0) continue; //secondary modules - TODO: modify for primary not alive
-        if (pmArray[i].isAlive == false) continue; //not alive
-        if (pmArray[i].isActive) continue; //already active
+    TRACE_SCOPE("opt_assignModules");
+
+    // spare modules in connected nodes first - no switching
+    for (int c = 1; c <= 12; c++) {
+        ConnectorType connector = static_cast<ConnectorType>(c);
+        while (connectorDeficit(connector) > 0 && assignNodeSpare(connector)) {}
+    }
+
+    for (int i = 1; i < 49; i += 2) { // relay nodes, a dead primary is covered by its secondary
+        if (nodeAlive(i) == false) continue; //not alive
+        if (nodeActive(i)) continue; //already active
 
         uint16_t relayIds[2];
         getRelay(i, relayIds);
@@ -1342,8 +2673,8 @@ void opt_assignModules(int iteration) {
             // Middle modules
             if (relayIds[0] != 0 && relayIds[1] != 0) {
 
-                uint16_t moduleA = i - 2; ConnectorType connectorA = pmArray[moduleA].Connector;
-                uint16_t moduleB = i + 2; ConnectorType connectorB = pmArray[moduleB].Connector;
+                uint16_t moduleA = i - 2; ConnectorType connectorA = nodeOwner(moduleA);
+                uint16_t moduleB = i + 2; ConnectorType connectorB = nodeOwner(moduleB);
 
                 if (connectorA == ConnectorType::DEFAULT && connectorB == ConnectorType::DEFAULT) continue; // No active adjacent powerModules
                 if (sufficientPower(connectorA) && sufficientPower(connectorB)) continue; // Both connectors have sufficient power
@@ -1351,10 +2682,12 @@ void opt_assignModules(int iteration) {
 
                 if (preference(connectorA, connectorB)) {
                     if (sufficientPower(connectorA)) continue;
+                    if (!optimiserMayToggle({ relayBetween(i - 2, i) }, assignGainW(connectorA, i, nodeCurrent(i)))) continue;
                     if (assign(connectorA, i)) relay_on(i - 2, i);
                 }
                 else {
                     if (sufficientPower(connectorB)) continue;
+                    if (!optimiserMayToggle({ relayBetween(i, i + 2) }, assignGainW(connectorB, i, nodeCurrent(i)))) continue;
                     if (assign(connectorB, i)) relay_on(i, i + 2);
                 }
             }
@@ -1364,8 +2697,9 @@ void opt_assignModules(int iteration) {
             if (connectorArray[static_cast<int>(defaultConnector)].isActive == true) continue;
 
             uint16_t moduleA = ((i - 1) % 8 == 0) ? i + 2 : i - 2;
-            ConnectorType ConnectorA = pmArray[moduleA].Connector;
+            ConnectorType ConnectorA = nodeOwner(moduleA);
             if (ConnectorA != ConnectorType::DEFAULT && !sufficientPower(ConnectorA)) {
+                if (!optimiserMayToggle({ relayBetween(moduleA, i) }, assignGainW(ConnectorA, i, nodeCurrent(i)))) continue;
                 if (assign(ConnectorA, i)) relay_on(moduleA, i);
             }
         }
@@ -1375,147 +2709,3684 @@ void opt_assignModules(int iteration) {
 }
 
 
-//Threads - for simulator
-
-#include <thread>
-#include <mutex>
-#include <condition_variable>
-#include <atomic>
-#include <chrono>
+//******************************************   DEFRAGMENTATION START   ******************************************************/
 
-// ---- Global Control Flags ----
-std::atomic<bool> running{ true };
-std::mutex mtx;
-std::condition_variable cv;
-bool workerRunning = false;   // worker is in opt_remove/opt_assign
-bool workerSleeping = false;  // worker finished and is in sleep
+// Relay chains are linear (1-3-5-7, ...) and entered at either end, so free
+// capacity gets stranded when a session keeps modules that block a neighbour.
+// The compaction pass migrates module ownership make-before-break :
+//  - borrowed chain : an active connector powering itself through the chain of
+//    an idle connector (via mux) moves onto free modules of its own chain, so
+//    the idle connector's chain becomes one contiguous free run again
+//  - boundary shift : the module at the boundary of two sessions in a chain
+//    moves from a connector with spare capacity to a short neighbour
+// Runs from the worker when cabinet demand is low; every move goes through
+// the switching cost gate.
 
+const float DEFRAG_DEMAND_RATIO = 0.5f;    // run only below this share of alive capacity
+const float DEFRAG_VALUE_W_PER_A = 50.0f;  // value of restoring 1 A of contiguous free capacity
 
-void runTriggerActions(json& trig) {
-    bool modified = false;  // track if we changed anything
+// k-th primary module of a connector's chain (k = 0 : default module)
+uint16_t chainModule(ConnectorType connector, int k) {
+    int step = (static_cast<uint8_t>(connector) % 2 == 0) ? -2 : 2;
+    return static_cast<uint16_t>(defaultModule(connector) + k * step);
+}
 
-    for (auto& kv : trig.items()) {
-        auto& key = kv.key();
-        auto& val = kv.value();
+bool defragAllowed() {
+    float demand = 0.0f, capacity = 0.0f;
+    for (int c = 1; c <= 12; c++) {
+        if (connectorArray[c].isActive) demand += connectorArray[c].EVMaxCurrent;
+    }
+    for (uint16_t i = 1; i < 49; i++) {
+        if (pmArray[i].isAlive) capacity += pmArray[i].MaxCurrent;
+    }
+    return demand <= DEFRAG_DEMAND_RATIO * capacity;
+}
 
-        std::string action = val.value("action", "none");
-        int voltage = val.value("EVMaxVoltage", 0);
-        int current = val.value("EVMaxCurrent", 0);
+// Moves `owner` off the chain of idle connector `idle`. Returns true if migrated.
+bool defragBorrowedChain(ConnectorType owner, ConnectorType idle) {
+    uint16_t muxId = muxExistence(owner, idle);
+    if (muxId == 0 || !muxStatus(muxId)) return false; // reached through a second level mux
+
+    // borrowed primaries, from the idle connector's default module outwards
+    uint16_t borrowed[4];
+    int borrowedCount = 0;
+    float borrowedCurrent = 0.0f;
+    for (int k = 0; k < 4; k++) {
+        uint16_t m = chainModule(idle, k);
+        if (nodeOwner(m) != owner) break;
+        borrowed[borrowedCount++] = m;
+        borrowedCurrent += nodeCurrent(m, owner);
+    }
+    if (borrowedCount == 0) return false;
+
+    // free alive primaries right after the end of the owner's own run
+    int k = 0;
+    while (k < 4 && nodeOwner(chainModule(owner, k)) == owner) k++;
+    if (k == 0) return false; // owner does not hold its own default module
+    uint16_t replacement[4];
+    int replacementCount = 0;
+    for (; k < 4 && replacementCount < borrowedCount; k++) {
+        uint16_t m = chainModule(owner, k);
+        if (nodeActive(m) || !nodeAlive(m)) break;
+        replacement[replacementCount++] = m;
+    }
+    if (replacementCount < borrowedCount) return false; // not enough room, would lose power
+    float replacementCurrent = 0.0f;
+    for (int r = 0; r < replacementCount; r++) replacementCurrent += nodeCurrent(replacement[r]);
+    if (replacementCurrent < borrowedCurrent) return false; // dead modules in the replacement
+
+    // relays closed for the replacement + relays opened inside the borrowed run + the mux
+    uint16_t switches[8] = {};
+    int s = 0;
+    for (int r = 0; r < replacementCount; r++) {
+        switches[s++] = relayBetween(replacement[r], static_cast<uint16_t>(replacement[r] + ((static_cast<uint8_t>(owner) % 2 == 0) ? 2 : -2)));
+    }
+    for (int b = 1; b < borrowedCount; b++) switches[s++] = relayBetween(borrowed[b - 1], borrowed[b]);
+    switches[s++] = muxId;
+    if (!optimiserMayToggle({ switches[0], switches[1], switches[2], switches[3], switches[4], switches[5], switches[6], switches[7] },
+        borrowedCurrent * DEFRAG_VALUE_W_PER_A)) return false;
+
+    std::cout << "\n[Defrag] Connector " << static_cast<int>(owner) << " leaves chain of connector " << static_cast<int>(idle);
+
+    // make : extend the owner's own run and let the ramp pick the new modules up
+    uint16_t previous = chainModule(owner, k - replacementCount - 1);
+    for (int r = 0; r < replacementCount; r++) {
+        if (assign(owner, replacement[r], true)) relay_on(previous, replacement[r]);
+        previous = replacement[r];
+    }
+    rampRetarget(owner);
 
-        std::cout << "[Trigger] " << key
-            << " action=" << action
-            << " V=" << voltage
-            << " I=" << current << "\n";
+    // break : hand over and isolate the borrowed run from its far end, then the mux
+    for (int b = borrowedCount - 1; b >= 0; b--) {
+        rampHandover(borrowed[b]);
+        isolateModule(borrowed[b]);
+    }
+    mux_off(muxId);
+    rampRetarget(owner);
+    return true;
+}
 
-        if (action == "none") continue;
+// Moves the boundary node between `from` and `to` (adjacent runs in one chain)
+bool defragBoundaryShift(ConnectorType from, ConnectorType to) {
+    if (connectorDeficit(to) <= 0 || removableModules(from) <= 0) return false;
+    if (subset(from) != subset(to)) return false;
+
+    // end of `to`'s own run and the next module, which must be `from`'s end module
+    int k = 0;
+    while (k < 4 && nodeOwner(chainModule(to, k)) == to) k++;
+    if (k == 0 || k >= 4) return false;
+    uint16_t toEnd = chainModule(to, k - 1);
+    uint16_t boundary = chainModule(to, k);
+    if (nodeOwner(boundary) != from || boundary == defaultModule(from)) return false;
+    if (nodeModules(boundary, from) > removableModules(from)) return false;
+
+    // boundary must be the end of `from`'s run : nothing of `from` beyond it on the `to` side
+    uint16_t relayFrom = relayBetween(boundary, static_cast<uint16_t>(boundary + (boundary > toEnd ? 2 : -2)));
+    uint16_t relayTo = relayBetween(toEnd, boundary);
+    if (!optimiserMayToggle({ relayFrom, relayTo }, assignGainW(to, boundary, nodeCurrent(boundary, from)))) return false;
+
+    std::cout << "\n[Defrag] Module " << boundary << " moves from connector " << static_cast<int>(from)
+        << " to connector " << static_cast<int>(to);
+    rampHandover(boundary);
+    isolateModule(boundary);
+    rampRetarget(from);
+    if (assign(to, boundary)) relay_on(toEnd, boundary);
+    rampRetarget(to);
+    return true;
+}
 
-        if (action == "start") {
-            //ConnectorType conn = static_cast<ConnectorType>(std::stoi(key.substr(9))); // "connectorX"
-            ConnectorType conn = stringToConnector(key);
-            connectorArray[static_cast<int>(conn)].EVMaxVoltage = voltage;
-            connectorArray[static_cast<int>(conn)].EVMaxCurrent = current;
-            std::cout << "Key is " << key << ", conn=" << static_cast<int>(conn) << "\n";
-            std::cout << "Assigning PM to connector " << static_cast<int>(conn) << "\n";
-            assign_power_modules(conn);
-        }
-        else if (action == "stop") {
-            ConnectorType conn = stringToConnector(key);
-            stopConnector(conn);
-            connectorArray[static_cast<int>(conn)].EVMaxVoltage = 0;
-            connectorArray[static_cast<int>(conn)].EVMaxCurrent = 0;
-        }
-        else if (action == "update") {
-            ConnectorType conn = stringToConnector(key);
-            connectorArray[static_cast<int>(conn)].EVMaxVoltage = voltage;
-            connectorArray[static_cast<int>(conn)].EVMaxCurrent = current;
+// Background compaction pass, called by the worker after optimisation
+void defragmentCabinet() {
+    TRACE_SCOPE("defragmentCabinet");
+    if (!defragAllowed()) return;
 
-        }
+    for (int c = 1; c <= 12; c++) {
+        ConnectorType idle = static_cast<ConnectorType>(c);
+        if (connectorArray[c].isActive) continue;
+        uint16_t d = defaultModule(idle);
+        ConnectorType owner = nodeOwner(d);
+        if (owner == ConnectorType::DEFAULT || owner == idle) continue;
+        if (!connectorArray[static_cast<int>(owner)].isActive) continue;
+        defragBorrowedChain(owner, idle);
+    }
 
+    for (int c = 1; c <= 12; c += 2) { // both connectors of each subset
+        ConnectorType odd = static_cast<ConnectorType>(c);
+        ConnectorType even = static_cast<ConnectorType>(c + 1);
+        if (!connectorArray[c].isActive || !connectorArray[c + 1].isActive) continue;
+        if (!defragBoundaryShift(odd, even)) defragBoundaryShift(even, odd);
+    }
+}
 
+//******************************************   DEFRAGMENTATION END   ******************************************************/
 
-        // TODO: call assign_power_modules2(), opt_removeModules(), etc.
-        std::this_thread::sleep_for(std::chrono::seconds(2));
+//******************************************   ADMISSION QUEUE START   ******************************************************/
 
-        // Reset action after handling
-        val["action"] = "none";
-        modified = true;
-    }
+// Connectors that could not reach sufficientPower() wait here with their
+// shortfall, ordered by priority (high first) then arrival. Whenever
+// isolateModule() / stopConnectorState() free modules, they are dispatched to the
+// waiting connectors right away instead of idling until the next worker cycle.
 
-    // If we modified anything, write back to file
-    if (modified) {
-        std::ofstream out("json_data/trigger.json");
-        if (out) {
-            out << std::setw(4) << trig;  // pretty print with 4 spaces
-        }
-    }
+struct AdmissionEntry
+{
+    ConnectorType connector;
+    float shortfall;     // A missing to EVMaxCurrent
+    uint8_t priority;    // higher first
+    uint64_t arrival;    // admission order
+};
 
-    //saving to json file
-    saveConnectorArrayToJson("json_data/connectors.json");
-    createModuleStatusJson("json_data/modules.json");
-    createMuxRelayJson("json_data/mux.json");
-    createConnectorModuleJson("json_data/connector_modules.json");
+std::vector<AdmissionEntry> admissionQueue;
+uint8_t connectorPriority[13] = {}; // from trigger.json "priority", default 0
+uint64_t admissionSeq = 0;
+std::atomic<uint32_t> admissionWaiting{ 0 };
+
+void admissionSort() {
+    std::stable_sort(admissionQueue.begin(), admissionQueue.end(), [](const AdmissionEntry& a, const AdmissionEntry& b) {
+        if (a.priority != b.priority) return a.priority > b.priority;
+        return a.arrival < b.arrival;
+    });
+    admissionWaiting.store(static_cast<uint32_t>(admissionQueue.size()), std::memory_order_relaxed);
 }
 
+// Adds, refreshes or removes the connector's entry from its current shortfall
+void admissionUpdate(ConnectorType connector) {
+    float shortfall = connectorDeficit(connector);
+    auto it = std::find_if(admissionQueue.begin(), admissionQueue.end(), [connector](const AdmissionEntry& e) { return e.connector == connector; });
 
-// ---- Worker Thread ----
-void workerLoop() {
-    while (running) {
+    if (shortfall <= 0) {
+        if (it != admissionQueue.end()) {
+            std::cout << "\n[Admission] Connector " << static_cast<int>(connector) << " satisfied";
+            admissionQueue.erase(it);
+        }
+    }
+    else if (it == admissionQueue.end()) {
+        std::cout << "\n[Admission] Connector " << static_cast<int>(connector) << " waiting, short " << shortfall << " A";
+        admissionQueue.push_back({ connector, shortfall, connectorPriority[static_cast<int>(connector)], admissionSeq++ });
+    }
+    else {
+        it->shortfall = shortfall;
+        it->priority = connectorPriority[static_cast<int>(connector)];
+    }
+    admissionSort();
+}
+
+// Refreshes every connector - an assignment may have taken modules from others
+void admissionUpdateAll() {
+    for (int c = 1; c <= 12; c++) admissionUpdate(static_cast<ConnectorType>(c));
+}
+
+// Extends the run `owner` holds in `chainOf`'s relay chain by one free pair
+bool extendRun(ConnectorType owner, ConnectorType chainOf) {
+    int k = 0;
+    while (k < 4 && nodeOwner(chainModule(chainOf, k)) == owner) k++;
+    if (k == 0 || k >= 4) return false;
+    uint16_t next = chainModule(chainOf, k);
+    if (nodeActive(next) || !nodeAlive(next)) return false;
+    if (!assign(owner, next)) return false;
+    relay_on(chainModule(chainOf, k - 1), next);
+    return true;
+}
+
+// One dispatch step : spare modules of connected nodes first, then own chain,
+// then chains already reached through a closed mux, then a new normal / super
+// mux to an idle peer. True if a module was added.
+bool dispatchStep(ConnectorType connector) {
+    if (assignNodeSpare(connector)) return true;
+    if (extendRun(connector, connector)) return true;
+
+    uint16_t muxOrder[64];
+    thermalMuxOrder(connector, muxOrder);
+    for (uint16_t k = 0; k < connectorMuxCount; k++) {
+        uint16_t i = muxOrder[k];
+        ConnectorType peer = muxPeer(i, connector);
+        if (peer == ConnectorType::DEFAULT || !connectorPairMuxTable[i].status) continue;
+        if (extendRun(connector, peer)) return true;
+    }
+
+    for (uint16_t k = 0; k < connectorMuxCount; k++) {
+        uint16_t i = muxOrder[k];
+        uint16_t muxId = connectorPairMuxTable[i].muxId;
+        ConnectorType peer = muxPeer(i, connector);
+        if (peer == ConnectorType::DEFAULT || connectorPairMuxTable[i].status || connectorStatus(peer)) continue;
+        if (muxId < 400 && muxStatus(muxId + (muxId % 2 ? 1 : -1))) continue; // one normal mux per connector
+        uint16_t entry = defaultModule(peer);
+        if (!nodeAlive(entry) || nodeActive(entry)) continue;
+        if (assign(connector, entry)) {
+            mux_on(muxId);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Hands freed capacity to waiting connectors in queue order
+void dispatchFreedCapacity() {
+    if (!moduleCapacityFreed) return;
+    moduleCapacityFreed = false;
+    if (admissionQueue.empty()) return;
+
+    TRACE_SCOPE("dispatchFreedCapacity");
+    std::vector<AdmissionEntry> waiting = admissionQueue; // entries change while dispatching
+    for (const AdmissionEntry& entry : waiting) {
+        ConnectorType connector = entry.connector;
+        if (!connectorStatus(connector)) {
+            admissionUpdate(connector); // stopped meanwhile
+            continue;
+        }
+        bool changed = false;
+        while (connectorDeficit(connector) > 0 && dispatchStep(connector)) changed = true;
+        if (changed) {
+            std::cout << "\n[Admission] Dispatched freed modules to connector " << static_cast<int>(connector);
+            rampRetarget(connector);
+        }
+        admissionUpdate(connector);
+    }
+    moduleCapacityFreed = false; // own isolations during dispatch do not re-trigger
+}
+
+//******************************************   ADMISSION QUEUE END   ******************************************************/
+
+//******************************************   BATCH ALLOCATION START   ******************************************************/
+
+// All "start" actions of one trigger batch are solved together : every
+// starting connector is activated on its default pair first (so no starter
+// borrows another starter's chain), then pairs are handed out one at a time to
+// the least satisfied connector (capacity / EVMaxCurrent, priority first)
+// until nobody can grow. Shared relays / muxes are split max-min fair instead
+// of going to whoever was first in trigger.json.
+// With hierarchicalAllocation the growth inside each superset is solved first,
+// in parallel (HIERARCHICAL ALLOCATION), and the loop below only coordinates
+// what is left : borrowing across supersets through the 40x muxes.
+
+bool hierarchicalAllocation = true;
+std::atomic<uint64_t> coordinationSteps{ 0 }; // pairs added by the loop after the superset solve
+
+struct SwitchCommand
+{
+    uint16_t id; // relay or mux id
+    bool on;
+};
+
+// Hardware hook : receives the switching plan of a batch in execution order
+void (*switchingPlanSink)(const std::vector<SwitchCommand>& plan) = nullptr;
+
+std::vector<SwitchCommand> captureSwitchState() {
+    std::vector<SwitchCommand> state;
+    for (uint16_t i = 0; i < relayMuxCount; i++) state.push_back({ relayMuxTable[i].muxId, relayMuxTable[i].status });
+    for (uint16_t i = 0; i < connectorMuxCount; i++) state.push_back({ connectorPairMuxTable[i].muxId, connectorPairMuxTable[i].status });
+    return state;
+}
+
+// Difference to a captured state as one plan : all opens, then all closes
+std::vector<SwitchCommand> switchingPlanSince(const std::vector<SwitchCommand>& before) {
+    std::vector<SwitchCommand> now = captureSwitchState();
+    std::vector<SwitchCommand> plan;
+    for (size_t i = 0; i < now.size(); i++) {
+        if (now[i].on != before[i].on && !now[i].on) plan.push_back(now[i]);
+    }
+    for (size_t i = 0; i < now.size(); i++) {
+        if (now[i].on != before[i].on && now[i].on) plan.push_back(now[i]);
+    }
+    return plan;
+}
+
+void applySwitchingPlan(const std::vector<SwitchCommand>& plan) {
+    if (plan.empty()) return;
+    std::cout << "\n[Switching] Plan :";
+    for (const SwitchCommand& command : plan) std::cout << " " << command.id << (command.on ? "+" : "-");
+    std::cout << "\n";
+    if (switchingPlanSink) switchingPlanSink(plan);
+}
+
+float satisfiedFraction(ConnectorType connector) {
+    float demand = connectorArray[static_cast<int>(connector)].EVMaxCurrent;
+    return (demand > 0) ? connectorCapacity(connector) / demand : 1.0f;
+}
+
+void assign_power_modules_batch(const std::vector<ConnectorType>& connectors) {
+    if (connectors.size() == 1) {
+        assign_power_modules(connectors[0]);
+        return;
+    }
+
+    ScopedLatency latency(assignLatency);
+    TRACE_SCOPE("assign_power_modules_batch");
+
+    for (ConnectorType connector : connectors) isolateConnector(connector);
+
+    for (ConnectorType connector : connectors) {
+        if (assign(connector, defaultModule(connector))) {
+            connectorArray[static_cast<int>(connector)].isActive = true;
+        }
+    }
+    if (hierarchicalAllocation) solveSupersetsParallel(connectors);
+
+    std::vector<ConnectorType> order = connectors;
+    for (;;) {
+        std::stable_sort(order.begin(), order.end(), [](ConnectorType a, ConnectorType b) {
+            uint8_t pa = connectorPriority[static_cast<int>(a)], pb = connectorPriority[static_cast<int>(b)];
+            if (pa != pb) return pa > pb;
+            return satisfiedFraction(a) < satisfiedFraction(b);
+        });
+
+        bool grown = false;
+        for (ConnectorType connector : order) {
+            if (!connectorStatus(connector) || sufficientPower(connector)) continue;
+            if (dispatchStep(connector)) {
+                if (hierarchicalAllocation) coordinationSteps.fetch_add(1, std::memory_order_relaxed);
+                grown = true;
+                break; // re-rank after every module
+            }
+        }
+        if (!grown) break;
+    }
+}
+
+//******************************************   BATCH ALLOCATION END   ******************************************************/
+
+//******************************************   PLAN CACHE START   ******************************************************/
+
+// The same situations repeat all day : same connectors active, similar demand,
+// same dead modules. assign_power_modules() and the what-if planner look their
+// result up by a hash of the compact cabinet state first. A key holds the
+// alive mask, one ownership mask per connector, the relay / mux masks and the
+// demand per connector in whole modules, and the thermal ranking the search
+// follows (coolest peer chain first, modules near their limit). It is compared
+// in full on a hit, so an entry only replays onto the exact state it was
+// recorded from.
+// Each cache is bounded by PLAN_CACHE_CAPACITY with LRU eviction; all of them
+// are dropped when module health or the cabinet layout changes.
+
+const size_t PLAN_CACHE_CAPACITY = 256;
+
+enum class PlanKind : uint8_t
+{
+    ASSIGN,   // assign_power_modules(connector)
+    OPTIMISE  // whatIfRebalance()
+};
+
+struct PlanKey
+{
+    uint8_t kind;
+    uint8_t connector;
+    uint8_t demandModules[13];   // ceil(EVMaxCurrent / smallest module), 0 inactive
+    uint8_t priority[13];
+    uint64_t aliveMask;
+    uint64_t ownerMask[13];
+    uint64_t relayClosed;
+    uint64_t muxClosed;
+    uint64_t capacityHash;       // MaxCurrent of every module
+    uint8_t chainRank[13];       // chains strictly cooler than the connector's (thermalMuxOrder())
+    uint64_t hotMask;            // alive modules within THERMAL_SHIFT_MARGIN (thermalWantsMore())
+};
+
+// Result of one assign_power_modules() call on its key's state
+struct CabinetDelta
+{
+    std::vector<std::pair<uint16_t, ConnectorType>> modules; // DEFAULT : freed
+    std::vector<std::pair<uint16_t, bool>> relays;           // relayMuxTable index
+    std::vector<std::pair<uint16_t, bool>> muxes;            // connectorPairMuxTable index
+    std::vector<std::pair<uint8_t, bool>> connectors;        // isActive
+    bool satisfied = false;                                   // sufficientPower() afterwards
+};
+
+uint64_t planCacheGeneration = 1; // bumped by planCacheClear()
+std::atomic<uint64_t> planCacheHits{ 0 };
+std::atomic<uint64_t> planCacheMisses{ 0 };
+std::atomic<uint64_t> planCacheEvictions{ 0 };
+
+uint64_t planKeyHash(const PlanKey& key) {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(&key);
+    uint64_t hash = 1469598103934665603ull; // FNV-1a
+    for (size_t i = 0; i < sizeof(PlanKey); i++) hash = (hash ^ p[i]) * 1099511628211ull;
+    return hash;
+}
+
+PlanKey capturePlanKey(PlanKind kind, ConnectorType connector) {
+    PlanKey key;
+    std::memset(&key, 0, sizeof(key)); // padding takes part in hash and compare
+    key.kind = static_cast<uint8_t>(kind);
+    key.connector = static_cast<uint8_t>(connector);
+
+    float smallest = 0.0f;
+    uint64_t capacityHash = 1469598103934665603ull;
+    for (uint16_t m = 1; m < 49; m++) {
+        if (pmArray[m].isAlive) {
+            key.aliveMask |= 1ull << m;
+            if (smallest == 0.0f || pmArray[m].MaxCurrent < smallest) smallest = pmArray[m].MaxCurrent;
+        }
+        if (pmArray[m].isActive) key.ownerMask[static_cast<int>(pmArray[m].Connector)] |= 1ull << m;
+        capacityHash = (capacityHash ^ static_cast<uint64_t>(pmArray[m].MaxCurrent * 10.0f)) * 1099511628211ull;
+    }
+    key.capacityHash = capacityHash;
+    for (int c = 1; c <= 12; c++) {
+        bool demanding = connectorArray[c].isActive || (c == key.connector && kind == PlanKind::ASSIGN);
+        if (demanding && smallest > 0) {
+            float modules = std::ceil(connectorArray[c].EVMaxCurrent / smallest);
+            key.demandModules[c] = static_cast<uint8_t>(std::clamp(modules, 1.0f, 255.0f));
+        }
+        key.priority[c] = connectorPriority[c];
+    }
+    for (uint16_t i = 0; i < relayMuxCount && i < 64; i++) {
+        if (relayMuxTable[i].status) key.relayClosed |= 1ull << i;
+    }
+    for (uint16_t i = 0; i < connectorMuxCount && i < 64; i++) {
+        if (connectorPairMuxTable[i].status) key.muxClosed |= 1ull << i;
+    }
+    if (thermalPolicyEnabled) {
+        float temperature[13];
+        for (int c = 1; c <= 12; c++) temperature[c] = chainTemperature(static_cast<ConnectorType>(c));
+        for (int c = 1; c <= 12; c++) {
+            for (int d = 1; d <= 12; d++) key.chainRank[c] += temperature[d] < temperature[c];
+        }
+        for (uint16_t m = 1; m < 49; m++) {
+            if (pmArray[m].isAlive && thermalWeight(m) < 1.0f) key.hotMask |= 1ull << m;
+        }
+    }
+    return key;
+}
+
+void planCacheClear() {
+    planCacheGeneration++;
+}
+
+// LRU map from PlanKey to a recorded plan. Engine thread only.
+template <typename Plan>
+class PlanCache {
+public:
+    // Most recently used entry for the key, nullptr on a miss
+    Plan* find(const PlanKey& key, uint64_t hash) {
+        dropIfStale();
+        auto it = index.find(hash);
+        if (it == index.end() || std::memcmp(&it->second->key, &key, sizeof(PlanKey)) != 0) {
+            planCacheMisses.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        lru.splice(lru.begin(), lru, it->second);
+        planCacheHits.fetch_add(1, std::memory_order_relaxed);
+        return &lru.front().plan;
+    }
+
+    Plan& insert(const PlanKey& key, uint64_t hash) {
+        dropIfStale();
+        erase(hash); // replaces a colliding or stale entry
+        if (lru.size() >= PLAN_CACHE_CAPACITY) {
+            index.erase(lru.back().hash);
+            lru.pop_back();
+            planCacheEvictions.fetch_add(1, std::memory_order_relaxed);
+        }
+        lru.push_front({ hash, key, Plan() });
+        index[hash] = lru.begin();
+        return lru.front().plan;
+    }
+
+    void erase(uint64_t hash) {
+        auto it = index.find(hash);
+        if (it == index.end()) return;
+        lru.erase(it->second);
+        index.erase(it);
+    }
+
+    size_t size() const { return lru.size(); }
+
+private:
+    struct Entry
+    {
+        uint64_t hash;
+        PlanKey key;
+        Plan plan;
+    };
+
+    void dropIfStale() {
+        if (generation == planCacheGeneration) return;
+        lru.clear();
+        index.clear();
+        generation = planCacheGeneration;
+    }
+
+    std::list<Entry> lru; // most recent first
+    std::unordered_map<uint64_t, typename std::list<Entry>::iterator> index;
+    uint64_t generation = 0;
+};
+
+struct CabinetImage
+{
+    ConnectorType owner[49];   // DEFAULT : free
+    bool relay[64];
+    bool mux[64];
+    bool active[13];
+};
+
+CabinetImage captureCabinetImage() {
+    CabinetImage image{};
+    for (uint16_t m = 1; m < 49; m++) image.owner[m] = pmArray[m].isActive ? pmArray[m].Connector : ConnectorType::DEFAULT;
+    for (uint16_t i = 0; i < relayMuxCount && i < 64; i++) image.relay[i] = relayMuxTable[i].status;
+    for (uint16_t i = 0; i < connectorMuxCount && i < 64; i++) image.mux[i] = connectorPairMuxTable[i].status;
+    for (int c = 1; c <= 12; c++) image.active[c] = connectorArray[c].isActive;
+    return image;
+}
+
+CabinetDelta cabinetDeltaSince(const CabinetImage& before) {
+    CabinetImage now = captureCabinetImage();
+    CabinetDelta delta;
+    for (uint16_t m = 1; m < 49; m++) {
+        if (now.owner[m] != before.owner[m]) delta.modules.push_back({ m, now.owner[m] });
+    }
+    for (uint16_t i = 0; i < relayMuxCount && i < 64; i++) {
+        if (now.relay[i] != before.relay[i]) delta.relays.push_back({ i, now.relay[i] });
+    }
+    for (uint16_t i = 0; i < connectorMuxCount && i < 64; i++) {
+        if (now.mux[i] != before.mux[i]) delta.muxes.push_back({ i, now.mux[i] });
+    }
+    for (uint8_t c = 1; c <= 12; c++) {
+        if (now.active[c] != before.active[c]) delta.connectors.push_back({ c, now.active[c] });
+    }
+    return delta;
+}
+
+void applyCabinetDelta(const CabinetDelta& delta) {
+    for (auto& [m, owner] : delta.modules) {
+        if (owner == ConnectorType::DEFAULT && pmArray[m].isActive) moduleCapacityFreed = true;
+        setModuleOwner(m, owner);
+    }
+    for (auto& [i, on] : delta.relays) setRelayStatus(relayMuxTable[i], on);
+    for (auto& [i, on] : delta.muxes) setMuxStatus(connectorPairMuxTable[i], on);
+    for (auto& [c, active] : delta.connectors) connectorArray[c].isActive = active;
+}
+
+// Puts ownership and switch state back to the image (undoes a replayed delta)
+void restoreCabinetImage(const CabinetImage& image) {
+    CabinetImage now = captureCabinetImage();
+    for (uint16_t m = 1; m < 49; m++) {
+        if (now.owner[m] != image.owner[m]) setModuleOwner(m, image.owner[m]);
+    }
+    for (uint16_t i = 0; i < relayMuxCount && i < 64; i++) {
+        if (now.relay[i] != image.relay[i]) setRelayStatus(relayMuxTable[i], image.relay[i]);
+    }
+    for (uint16_t i = 0; i < connectorMuxCount && i < 64; i++) {
+        if (now.mux[i] != image.mux[i]) setMuxStatus(connectorPairMuxTable[i], image.mux[i]);
+    }
+    for (int c = 1; c <= 12; c++) connectorArray[c].isActive = image.active[c];
+}
+
+PlanCache<CabinetDelta> assignPlanCache;
+
+void assign_power_modules(ConnectorType connector) {
+    ScopedLatency latency(assignLatency);
+
+    PlanKey key = capturePlanKey(PlanKind::ASSIGN, connector);
+    uint64_t hash = planKeyHash(key);
+    CabinetImage before = captureCabinetImage();
+    if (CabinetDelta* cached = assignPlanCache.find(key, hash)) {
+        applyCabinetDelta(*cached);
+        if (sufficientPower(connector) == cached->satisfied) {
+            std::cout << "\n[PlanCache] Connector " << static_cast<int>(connector) << " assigned from cache";
+            return;
+        }
+        assignPlanCache.erase(hash); // demand class hid a difference : undo it, search from the recorded state
+        restoreCabinetImage(before);
+    }
+
+    assign_power_modules_search(connector);
+    CabinetDelta delta = cabinetDeltaSince(before);
+    delta.satisfied = sufficientPower(connector);
+    assignPlanCache.insert(key, hash) = std::move(delta);
+}
+
+//******************************************   PLAN CACHE END   ******************************************************/
+
+//******************************************   WHAT-IF PLANNER START   ******************************************************/
+
+// Instead of committing to the first local move, the optimiser generates
+// candidate rebalancing plans, plays each against its own copy of a compact
+// cabinet state and commits the best one. A candidate is a greedy policy
+// (connector order, mux order, shed before / after growing); its moves mirror
+// the live primitives (extendRun, new mux, releaseModule, isolateModule) so the
+// winning plan replays exactly. Candidates are scored on a thread pool within
+// WHATIF_DEADLINE_MS : delivered power - conversion loss - switching cost +
+// fairness bonus.
+
+const uint16_t WHATIF_CANDIDATES = 64;
+const uint32_t WHATIF_DEADLINE_MS = 20;
+const float WHATIF_FAIRNESS_W = 2000.0f;  // bonus for a Jain index of 1
+const float WHATIF_MIN_GAIN_W = 50.0f;    // over doing nothing
+
+struct CompactCabinet
+{
+    uint8_t owner[49];         // ConnectorType, 0 free
+    uint64_t aliveMask;
+    float maxCurrent[49];
+    float demand[13];          // EVMaxCurrent of active connectors, else 0
+    float voltage[13];
+    uint8_t priority[13];
+    uint64_t relayClosed;      // bit per relayMuxTable index
+    uint64_t muxClosed;        // bit per connectorPairMuxTable index
+    uint16_t muxOrder[13][64]; // thermalMuxOrder() per connector
+};
+
+enum class WhatIfMoveType : uint8_t
+{
+    SPARE,       // assignNodeSpare
+    EXTEND,      // extendRun(connector, chainOf)
+    MUX,         // new mux to an idle peer
+    RELEASE,     // releaseModule(module)
+    ISOLATE      // isolateModule(node) (+ mux_off when reached through a mux)
+};
+
+struct WhatIfMove
+{
+    WhatIfMoveType type;
+    ConnectorType connector;
+    uint16_t arg; // chainOf connector (EXTEND), mux id (MUX / ISOLATE), module
+    uint16_t module;
+};
+
+struct WhatIfPlan
+{
+    std::vector<WhatIfMove> moves;
+    std::vector<uint16_t> switches; // toggled relay / mux ids
+    float score = 0.0f;
+    bool evaluated = false;
+    bool dwellLimited = false; // a move was skipped for a switch's dwell time
+    bool sessionStart = false; // session start switching, never gated by dwell times
+};
+
+bool compactAlive(const CompactCabinet& s, uint16_t m) { return (s.aliveMask >> m) & 1u; }
+
+float compactCapacity(const CompactCabinet& s, int c) {
+    float total = 0.0f;
+    for (uint16_t m = 1; m < 49; m++) {
+        if (s.owner[m] == c && compactAlive(s, m)) total += s.maxCurrent[m];
+    }
+    return total;
+}
+
+int compactNodeOwner(const CompactCabinet& s, uint16_t node) {
+    return s.owner[node] ? s.owner[node] : s.owner[node + 1];
+}
+
+bool compactSwitchRecent(uint16_t id) {
+    uint64_t last = switchLastToggleMs[id].load(std::memory_order_relaxed);
+    return last != 0 && steadyMs() - last < SWITCH_MIN_DWELL_MS;
+}
+
+bool compactSwitchBlocked(WhatIfPlan& plan, uint16_t id) {
+    if (plan.sessionStart || !compactSwitchRecent(id)) return false;
+    plan.dwellLimited = true;
+    return true;
+}
+
+// Claims the node's modules one at a time until the demand is covered (assign())
+void compactClaim(CompactCabinet& s, int c, uint16_t node) {
+    bool claimed = false;
+    for (uint16_t m = node; m <= node + 1; m++) {
+        if (s.owner[m] || !compactAlive(s, m)) continue;
+        if (claimed && compactCapacity(s, c) >= s.demand[c]) break;
+        s.owner[m] = static_cast<uint8_t>(c);
+        claimed = true;
+    }
+}
+
+// Nodes of chainOf's chain the connector holds from its start
+int compactRun(const CompactCabinet& s, int c, int chainOf) {
+    int k = 0;
+    while (k < 4 && compactNodeOwner(s, chainModule(static_cast<ConnectorType>(chainOf), k)) == c) k++;
+    return k;
+}
+
+bool compactExtend(CompactCabinet& s, int c, int chainOf, WhatIfPlan& plan) {
+    ConnectorType chain = static_cast<ConnectorType>(chainOf);
+    int k = compactRun(s, c, chainOf);
+    if (k == 0 || k >= 4) return false;
+    uint16_t next = chainModule(chain, k);
+    if (s.owner[next] || s.owner[next + 1] || !compactAlive(s, next)) return false;
+    uint16_t relayId = relayBetween(chainModule(chain, k - 1), next);
+    int index = relayTableIndex(relayId);
+    if (index < 0 || compactSwitchBlocked(plan, relayId)) return false;
+    compactClaim(s, c, next);
+    s.relayClosed |= 1ull << index;
+    plan.moves.push_back({ WhatIfMoveType::EXTEND, static_cast<ConnectorType>(c), static_cast<uint16_t>(chainOf), next });
+    plan.switches.push_back(relayId);
+    return true;
+}
+
+// One growth step of dispatchStep() on the compact state; a non zero
+// withinSuperset keeps it off muxes leading out of that superset
+bool compactGrow(CompactCabinet& s, int c, WhatIfPlan& plan, uint16_t withinSuperset = 0) {
+    for (uint16_t node = 1; node < 49; node += 2) {
+        if (compactNodeOwner(s, node) != c) continue;
+        for (uint16_t m = node; m <= node + 1; m++) {
+            if (s.owner[m] || !compactAlive(s, m)) continue;
+            s.owner[m] = static_cast<uint8_t>(c);
+            plan.moves.push_back({ WhatIfMoveType::SPARE, static_cast<ConnectorType>(c), 0, m });
+            return true;
+        }
+    }
+    if (compactExtend(s, c, c, plan)) return true;
+
+    ConnectorType connector = static_cast<ConnectorType>(c);
+    for (uint16_t k = 0; k < connectorMuxCount; k++) {
+        uint16_t i = s.muxOrder[c][k];
+        ConnectorType peer = muxPeer(i, connector);
+        if (peer == ConnectorType::DEFAULT || !((s.muxClosed >> i) & 1u)) continue;
+        if (withinSuperset && superset(peer) != withinSuperset) continue;
+        if (compactExtend(s, c, static_cast<int>(peer), plan)) return true;
+    }
+    for (uint16_t k = 0; k < connectorMuxCount; k++) {
+        uint16_t i = s.muxOrder[c][k];
+        uint16_t muxId = connectorPairMuxTable[i].muxId;
+        ConnectorType peer = muxPeer(i, connector);
+        if (peer == ConnectorType::DEFAULT || ((s.muxClosed >> i) & 1u) || s.demand[static_cast<int>(peer)] > 0) continue;
+        if (withinSuperset && superset(peer) != withinSuperset) continue;
+        if (muxId < 400) {
+            int partner = muxTableIndex(muxId + (muxId % 2 ? 1 : -1));
+            if (partner >= 0 && ((s.muxClosed >> partner) & 1u)) continue; // one normal mux per connector
+        }
+        uint16_t entry = defaultModule(peer);
+        if (!compactAlive(s, entry) || s.owner[entry] || s.owner[entry + 1] || compactSwitchBlocked(plan, muxId)) continue;
+        compactClaim(s, c, entry);
+        s.muxClosed |= 1ull << i;
+        plan.moves.push_back({ WhatIfMoveType::MUX, connector, muxId, entry });
+        plan.switches.push_back(muxId);
+        return true;
+    }
+    return false;
+}
+
+// Frees capacity above demand + SWITCH_HYSTERESIS_A from the end of the
+// connector's runs : spare modules of shared nodes first, then tail nodes.
+bool compactShed(CompactCabinet& s, int c, WhatIfPlan& plan) {
+    ConnectorType connector = static_cast<ConnectorType>(c);
+    float margin = compactCapacity(s, c) - s.demand[c] - SWITCH_HYSTERESIS_A;
+    for (uint16_t node = 1; node < 49; node += 2) {
+        if (s.owner[node] != c || s.owner[node + 1] != c) continue;
+        for (uint16_t m = node + 1; m >= node; m--) {
+            if (!compactAlive(s, m) || s.maxCurrent[m] > margin) continue;
+            s.owner[m] = 0;
+            plan.moves.push_back({ WhatIfMoveType::RELEASE, connector, 0, m });
+            return true;
+        }
+    }
+    for (int chainOf = 1; chainOf <= 12; chainOf++) {
+        int k = compactRun(s, c, chainOf);
+        if (k == 0 || (chainOf == c && k == 1)) continue; // default node stays
+        uint16_t tail = chainModule(static_cast<ConnectorType>(chainOf), k - 1);
+        float nodeA = 0.0f;
+        for (uint16_t m = tail; m <= tail + 1; m++) {
+            if (s.owner[m] == c && compactAlive(s, m)) nodeA += s.maxCurrent[m];
+        }
+        if (nodeA > margin) continue;
+        uint16_t switchId = 0;
+        if (k > 1) {
+            switchId = relayBetween(chainModule(static_cast<ConnectorType>(chainOf), k - 2), tail);
+            int index = relayTableIndex(switchId);
+            if (index < 0) continue;
+            if (compactSwitchBlocked(plan, switchId)) continue;
+            s.relayClosed &= ~(1ull << index);
+        }
+        else {
+            switchId = muxExistence(connector, static_cast<ConnectorType>(chainOf));
+            int index = muxTableIndex(switchId);
+            if (index < 0 || !((s.muxClosed >> index) & 1u) || compactSwitchBlocked(plan, switchId)) continue; // second level
+            s.muxClosed &= ~(1ull << index);
+        }
+        s.owner[tail] = s.owner[tail + 1] = 0;
+        plan.moves.push_back({ WhatIfMoveType::ISOLATE, connector, static_cast<uint16_t>(k > 1 ? 0 : switchId), tail });
+        plan.switches.push_back(switchId);
+        return true;
+    }
+    return false;
+}
+
+float compactScore(const CompactCabinet& s, const WhatIfPlan& plan) {
+    float deliveredW = 0.0f, lossW = 0.0f, sum = 0.0f, sumSq = 0.0f;
+    int active = 0;
+    for (int c = 1; c <= 12; c++) {
+        if (s.demand[c] <= 0) continue;
+        float capacity = compactCapacity(s, c);
+        uint16_t modules = 0;
+        for (uint16_t m = 1; m < 49; m++) modules += (s.owner[m] == c && compactAlive(s, m));
+        float delivered = std::min(capacity, s.demand[c]);
+        deliveredW += delivered * s.voltage[c];
+        if (modules > 0) lossW += conversionLoss(delivered, s.voltage[c], modules, capacity / modules);
+        float satisfied = std::min(1.0f, capacity / s.demand[c]);
+        sum += satisfied;
+        sumSq += satisfied * satisfied;
+        active++;
+    }
+    float jain = (sumSq > 0) ? sum * sum / (active * sumSq) : 1.0f;
+    float costW = 0.0f;
+    for (uint16_t id : plan.switches) costW += switchCost(id);
+    return deliveredW - lossW - costW + WHATIF_FAIRNESS_W * jain;
+}
+
+// Candidate `seed` : 0 is "do nothing", 1 the optimiser's usual order
+// (priority, then least satisfied), the rest shuffle connector and mux order.
+void evaluateCandidate(CompactCabinet s, uint32_t seed, WhatIfPlan& plan) {
+    if (seed > 0) {
+        std::mt19937 rng(seed);
+        bool shedFirst = seed % 2;
+        int order[12];
+        for (int i = 0; i < 12; i++) order[i] = i + 1;
+        if (seed > 2) {
+            std::shuffle(order, order + 12, rng);
+            for (int c = 1; c <= 12; c++) std::shuffle(s.muxOrder[c], s.muxOrder[c] + connectorMuxCount, rng);
+        }
+        auto shedAll = [&]() {
+            for (int c : order) {
+                while (s.demand[c] > 0 && plan.switches.size() < SWITCH_BUDGET_PER_CYCLE && compactShed(s, c, plan)) {}
+            }
+        };
+        if (shedFirst) shedAll();
+        for (;;) {
+            if (seed <= 2) {
+                std::stable_sort(order, order + 12, [&](int a, int b) {
+                    if (s.priority[a] != s.priority[b]) return s.priority[a] > s.priority[b];
+                    float fa = s.demand[a] > 0 ? compactCapacity(s, a) / s.demand[a] : 1.0f;
+                    float fb = s.demand[b] > 0 ? compactCapacity(s, b) / s.demand[b] : 1.0f;
+                    return fa < fb;
+                });
+            }
+            bool grown = false;
+            for (int c : order) {
+                if (s.demand[c] <= 0 || compactCapacity(s, c) >= s.demand[c]) continue;
+                if (plan.switches.size() >= SWITCH_BUDGET_PER_CYCLE) break;
+                if (compactGrow(s, c, plan)) {
+                    grown = true;
+                    break;
+                }
+            }
+            if (!grown) break;
+        }
+        if (!shedFirst) shedAll();
+    }
+    plan.score = compactScore(s, plan);
+    plan.evaluated = true;
+}
+
+// Persistent workers; the engine thread evaluates alongside them
+class WhatIfPool {
+public:
+    ~WhatIfPool() {
+        stopping = true;
+        generation.fetch_add(1);
+        generation.notify_all();
+        for (std::thread& worker : workers) worker.join();
+    }
+
+    // Evaluates plans[0..count) until done or the deadline; returns how many were evaluated
+    size_t run(const CompactCabinet& state, std::vector<WhatIfPlan>& plans, uint64_t deadlineNs,
+        std::function<void(CompactCabinet s, uint32_t index, WhatIfPlan& plan)> evaluate = evaluateCandidate) {
+        if (workers.empty()) {
+            unsigned count = std::max(1u, std::thread::hardware_concurrency()) - 1;
+            for (unsigned i = 0; i < count; i++) workers.emplace_back([this] { workerLoop(); });
+        }
+        job = { &state, &plans, deadlineNs, std::move(evaluate) };
+        next.store(0);
+        busy.store(static_cast<uint32_t>(workers.size()));
+        generation.fetch_add(1);
+        generation.notify_all();
+        work();
+        for (uint32_t left = busy.load(); left != 0; left = busy.load()) busy.wait(left);
+        return std::count_if(plans.begin(), plans.end(), [](const WhatIfPlan& p) { return p.evaluated; });
+    }
+
+private:
+    struct Job
+    {
+        const CompactCabinet* state = nullptr;
+        std::vector<WhatIfPlan>* plans = nullptr;
+        uint64_t deadlineNs = 0;
+        std::function<void(CompactCabinet s, uint32_t index, WhatIfPlan& plan)> evaluate; // with whatever context the caller binds
+    };
+
+    void work() {
+        for (;;) {
+            uint32_t i = next.fetch_add(1);
+            if (i >= job.plans->size() || monotonicNs() >= job.deadlineNs) return;
+            job.evaluate(*job.state, i, (*job.plans)[i]);
+        }
+    }
+
+    void workerLoop() {
+        uint64_t seen = 0;
+        for (;;) {
+            generation.wait(seen);
+            seen = generation.load();
+            if (stopping) return;
+            work();
+            if (busy.fetch_sub(1) == 1) busy.notify_one();
+        }
+    }
+
+    std::vector<std::thread> workers;
+    Job job;
+    std::atomic<uint64_t> generation{ 0 };
+    std::atomic<uint32_t> next{ 0 };
+    std::atomic<uint32_t> busy{ 0 };
+    std::atomic<bool> stopping{ false };
+};
+
+WhatIfPool whatIfPool;
+PlanCache<WhatIfPlan> optimisePlanCache; // no moves : nothing beat doing nothing
+std::atomic<uint64_t> whatIfPlansCommitted{ 0 };
+std::atomic<uint64_t> whatIfCandidatesEvaluated{ 0 };
+
+CompactCabinet captureCompactCabinet() {
+    CompactCabinet s{};
+    for (uint16_t m = 1; m < 49; m++) {
+        s.owner[m] = pmArray[m].isActive ? static_cast<uint8_t>(pmArray[m].Connector) : 0;
+        if (pmArray[m].isAlive) s.aliveMask |= 1ull << m;
+        s.maxCurrent[m] = pmArray[m].MaxCurrent;
+    }
+    for (int c = 1; c <= 12; c++) {
+        ConnectorType connector = static_cast<ConnectorType>(c);
+        s.demand[c] = connectorArray[c].isActive ? connectorArray[c].EVMaxCurrent : 0.0f;
+        s.voltage[c] = std::max(connectorVoltage(connector), 1.0f);
+        s.priority[c] = connectorPriority[c];
+        thermalMuxOrder(connector, s.muxOrder[c]);
+    }
+    for (uint16_t i = 0; i < relayMuxCount && i < 64; i++) {
+        if (relayMuxTable[i].status) s.relayClosed |= 1ull << i;
+    }
+    for (uint16_t i = 0; i < connectorMuxCount && i < 64; i++) {
+        if (connectorPairMuxTable[i].status) s.muxClosed |= 1ull << i;
+    }
+    return s;
+}
+
+// Replays a plan on the live state; false if the state diverged. Session
+// start plans are not optimiser moves and leave the cycle budget alone.
+bool commitWhatIfPlan(const WhatIfPlan& plan, bool optimiserMove = true) {
+    for (const WhatIfMove& move : plan.moves) {
+        bool done = true;
+        switch (move.type) {
+        case WhatIfMoveType::SPARE:
+            done = assignNodeSpare(move.connector);
+            break;
+        case WhatIfMoveType::EXTEND:
+            done = extendRun(move.connector, static_cast<ConnectorType>(move.arg));
+            break;
+        case WhatIfMoveType::MUX:
+            done = assign(move.connector, move.module);
+            if (done) mux_on(move.arg);
+            break;
+        case WhatIfMoveType::RELEASE:
+            rampHandover(move.module, false);
+            releaseModule(move.module);
+            break;
+        case WhatIfMoveType::ISOLATE:
+            rampHandover(move.module);
+            isolateModule(move.module);
+            if (move.arg) mux_off(move.arg);
+            break;
+        }
+        if (!done) {
+            std::cerr << "[WhatIf] plan diverged from the cabinet state, stopped\n";
+            return false;
+        }
+    }
+    if (optimiserMove) switchBudgetLeft -= std::min<uint16_t>(switchBudgetLeft, static_cast<uint16_t>(plan.switches.size()));
+    return true;
+}
+
+// Returns true if a plan was committed
+bool whatIfRebalance() {
+    TRACE_SCOPE("whatIfRebalance");
+    PlanKey key = capturePlanKey(PlanKind::OPTIMISE, ConnectorType::DEFAULT);
+    uint64_t hash = planKeyHash(key);
+    if (WhatIfPlan* entry = optimisePlanCache.find(key, hash)) {
+        WhatIfPlan cached = *entry;
+        bool dwelling = std::any_of(cached.switches.begin(), cached.switches.end(), compactSwitchRecent);
+        if (cached.moves.empty()) return false; // evaluated before : nothing beats doing nothing
+        if (!dwelling) {
+            std::cout << "\n[WhatIf] committing cached plan of " << cached.moves.size() << " moves";
+            bool committed = commitWhatIfPlan(cached);
+            if (committed) whatIfPlansCommitted.fetch_add(1, std::memory_order_relaxed);
+            else optimisePlanCache.erase(hash);
+            dispatchFreedCapacity();
+            return committed;
+        }
+    }
+
+    CompactCabinet state = captureCompactCabinet();
+    std::vector<WhatIfPlan> plans(WHATIF_CANDIDATES);
+    size_t evaluated = whatIfPool.run(state, plans, monotonicNs() + WHATIF_DEADLINE_MS * 1000000ull);
+    whatIfCandidatesEvaluated.fetch_add(evaluated, std::memory_order_relaxed);
+
+    const WhatIfPlan* best = &plans[0];
+    for (const WhatIfPlan& plan : plans) {
+        if (plan.evaluated && plan.score > best->score) best = &plan;
+    }
+    std::cout << "\n[WhatIf] " << evaluated << " candidates, best " << best->score << " vs " << plans[0].score << " W";
+    if (!plans[0].evaluated) return false;
+    // only a complete evaluation that dwell times did not restrict is worth keeping
+    bool cacheable = evaluated == plans.size() && std::none_of(plans.begin(), plans.end(), [](const WhatIfPlan& p) { return p.dwellLimited; });
+    if (best->moves.empty() || best->score < plans[0].score + WHATIF_MIN_GAIN_W) {
+        if (cacheable) optimisePlanCache.insert(key, hash);
+        return false;
+    }
+    if (cacheable) optimisePlanCache.insert(key, hash) = *best;
+
+    std::cout << "\n[WhatIf] committing plan of " << best->moves.size() << " moves, " << best->switches.size() << " switches";
+    bool committed = commitWhatIfPlan(*best);
+    if (committed) whatIfPlansCommitted.fetch_add(1, std::memory_order_relaxed);
+    dispatchFreedCapacity();
+    return committed;
+}
+
+//******************************************   WHAT-IF PLANNER END   ******************************************************/
+
+
+//******************************************   HIERARCHICAL ALLOCATION START   ******************************************************/
+
+// First level of assign_power_modules_batch(). Normal muxes never leave their
+// superset, so the starters of each superset are grown on their own copy of the
+// compact cabinet, one WhatIfPool job per superset, with compactGrow() kept off
+// the 40x muxes. The resulting plans touch disjoint nodes and switches and are
+// replayed one after the other; the batch loop then only has the cross superset
+// borrowing (and whatever a diverged plan left) to coordinate.
+
+std::atomic<uint64_t> supersetPlansCommitted{ 0 };
+std::atomic<uint64_t> supersetPlansDiverged{ 0 };
+
+// Pool job `index` : the starters (bit per connector of the batch) of
+// superset index + 1, least satisfied first
+void solveSuperset(CompactCabinet s, uint32_t index, WhatIfPlan& plan, uint16_t starters) {
+    uint16_t supersetId = static_cast<uint16_t>(index + 1);
+    int order[12];
+    int count = 0;
+    for (int c = 1; c <= 12; c++) {
+        if ((starters >> c) & 1u && superset(static_cast<ConnectorType>(c)) == supersetId) order[count++] = c;
+    }
+    plan.sessionStart = true;
+    for (;;) {
+        std::stable_sort(order, order + count, [&](int a, int b) {
+            if (s.priority[a] != s.priority[b]) return s.priority[a] > s.priority[b];
+            return compactCapacity(s, a) / s.demand[a] < compactCapacity(s, b) / s.demand[b];
+        });
+        bool grown = false;
+        for (int i = 0; i < count; i++) {
+            int c = order[i];
+            if (compactCapacity(s, c) >= s.demand[c]) continue;
+            if (compactGrow(s, c, plan, supersetId)) {
+                grown = true;
+                break; // re-rank after every move, as the batch loop does
+            }
+        }
+        if (!grown) break;
+    }
+    plan.evaluated = true;
+}
+
+void solveSupersetsParallel(const std::vector<ConnectorType>& connectors) {
+    TRACE_SCOPE("solveSupersetsParallel");
+    uint16_t starters = 0;
+    uint16_t supersets = 0;
+    uint32_t spanned = 0; // bit per superset with a starter
+    for (ConnectorType connector : connectors) {
+        int c = static_cast<int>(connector);
+        if (!connectorStatus(connector) || connectorArray[c].EVMaxCurrent <= 0) continue; // default pair failed
+        starters |= 1u << c;
+        supersets = std::max(supersets, superset(connector));
+        spanned |= 1u << superset(connector);
+    }
+    if (std::popcount(spanned) < 2) return; // nothing to solve side by side : the batch loop is cheaper
+
+    CompactCabinet state = captureCompactCabinet();
+    std::vector<WhatIfPlan> plans(supersets);
+    whatIfPool.run(state, plans, monotonicNs() + WHATIF_DEADLINE_MS * 1000000ull,
+        [starters](CompactCabinet s, uint32_t index, WhatIfPlan& plan) { solveSuperset(s, index, plan, starters); });
+
+    for (const WhatIfPlan& plan : plans) {
+        if (!plan.evaluated || plan.moves.empty()) continue; // past the deadline : left to the batch loop
+        if (commitWhatIfPlan(plan, false)) supersetPlansCommitted.fetch_add(1, std::memory_order_relaxed);
+        else supersetPlansDiverged.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+//******************************************   HIERARCHICAL ALLOCATION END   ******************************************************/
+
+
+//Threads - for simulator
+
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+// ---- Global Control Flags ----
+std::atomic<bool> running{ true };
+
+
+//********************************   TELEMETRY INGESTION START   ********************************************************/
+
+// Raw frame as reported by a power module (driver or synthetic generator).
+// Payload layout depends on frame type, values are little endian and scaled.
+enum class TelemetryFrameType : uint8_t
+{
+    OUTPUT = 0x01, // outputVoltage (0.1 V), outputCurrent (0.01 A)
+    INPUT = 0x02,  // inputVoltage (0.1 V), inputCurrent (0.01 A)
+    PHASE = 0x03,  // PhaseA/B/C voltage (0.1 V)
+    STATUS = 0x04  // temperature (0.1 C, signed), state, fault word (24 bits)
+};
+
+struct TelemetryFrame
+{
+    uint16_t moduleAddress;
+    TelemetryFrameType type;
+    uint8_t length;
+    uint8_t data[8];
+    uint64_t timestampNs; // time the frame was received from the bus
+};
+
+uint64_t monotonicNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Bounded lock-free multi producer / single consumer ring (sequence per cell).
+// push() never blocks, it returns false when the ring is full.
+template <typename T, size_t Capacity>
+class MpscRing
+{
+    static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of 2");
+
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+public:
+    MpscRing() {
+        for (size_t i = 0; i < Capacity; i++) cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    bool push(const T& value) {
+        size_t pos = tail.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell& cell = cells[pos & (Capacity - 1)];
+            size_t seq = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.value = value;
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0) {
+                return false; // full
+            }
+            else {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool pop(T& value) {
+        Cell& cell = cells[head & (Capacity - 1)];
+        size_t seq = cell.sequence.load(std::memory_order_acquire);
+        if (static_cast<intptr_t>(seq) - static_cast<intptr_t>(head + 1) < 0) return false; // empty
+        value = cell.value;
+        cell.sequence.store(head + Capacity, std::memory_order_release);
+        head++;
+        return true;
+    }
+
+    // Consumer side : nothing published at the head
+    bool empty() const {
+        const Cell& cell = cells[head & (Capacity - 1)];
+        return static_cast<intptr_t>(cell.sequence.load(std::memory_order_acquire)) - static_cast<intptr_t>(head + 1) < 0;
+    }
+
+    // Pops up to maxCount items, returns number popped
+    size_t popBatch(T* out, size_t maxCount) {
+        size_t n = 0;
+        while (n < maxCount && pop(out[n])) n++;
+        return n;
+    }
+
+private:
+    alignas(64) std::atomic<size_t> tail{ 0 };
+    alignas(64) size_t head = 0; // consumer only
+    alignas(64) Cell cells[Capacity];
+};
+
+// Bounded lock-free single producer / single consumer ring. Each side caches
+// the other side's index and only reloads it when the ring looks full / empty.
+template <typename T, size_t Capacity>
+class SpscRing
+{
+    static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of 2");
+
+public:
+    bool push(const T& value) {
+        size_t pos = tail.load(std::memory_order_relaxed);
+        if (pos - headCache == Capacity) {
+            headCache = head.load(std::memory_order_acquire);
+            if (pos - headCache == Capacity) return false; // full
+        }
+        cells[pos & (Capacity - 1)] = value;
+        tail.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T& value) {
+        size_t pos = head.load(std::memory_order_relaxed);
+        if (pos == tailCache) {
+            tailCache = tail.load(std::memory_order_acquire);
+            if (pos == tailCache) return false; // empty
+        }
+        value = cells[pos & (Capacity - 1)];
+        head.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    alignas(64) std::atomic<size_t> tail{ 0 };
+    size_t headCache = 0; // producer only
+    alignas(64) std::atomic<size_t> head{ 0 };
+    size_t tailCache = 0; // consumer only
+    alignas(64) T cells[Capacity];
+};
+
+// Latest decoded telemetry per module. Written only by the ingestion thread,
+// read by the allocator side through a seqlock - ingestion never takes mtx.
+struct TelemetrySnapshot
+{
+    float PhaseAVoltage = 0.0f;
+    float PhaseBVoltage = 0.0f;
+    float PhaseCVoltage = 0.0f;
+    float temperature = 0.0f;
+    float inputVoltage = 0.0f;
+    float inputCurrent = 0.0f;
+    float outputVoltage = 0.0f;
+    float outputCurrent = 0.0f;
+    uint32_t faultWord = 0;
+    ChargingModuleState state = ChargingModuleState::NORMAL_OFF;
+    uint64_t lastSeenNs = 0; // 0 : never reported
+};
+
+struct alignas(64) TelemetrySlot
+{
+    std::atomic<uint32_t> seq{ 0 };
+    TelemetrySnapshot data;
+};
+
+TelemetrySlot telemetryStore[49]; // 0 : Default , 1-48 : modules
+MpscRing<TelemetryFrame, 8192> telemetryQueue;
+std::atomic<uint64_t> telemetryFramesDecoded{ 0 };
+std::atomic<uint64_t> telemetryFramesDropped{ 0 };
+std::atomic<uint64_t> telemetryFramesInvalid{ 0 };
+
+// Faults that make a module unusable for allocation
+const uint32_t TELEMETRY_FATAL_FAULTS =
+    (1u << static_cast<uint32_t>(FaultBits::HARDWARE_FAULT)) |
+    (1u << static_cast<uint32_t>(FaultBits::SHORT_CIRCUIT_FAULT)) |
+    (1u << static_cast<uint32_t>(FaultBits::PFC_SHUTDOWN_EXCEPTION)) |
+    (1u << static_cast<uint32_t>(FaultBits::OUTPUT_OVER_CURRENT));
+
+// Driver entry point. Safe to call from any thread, never blocks.
+bool submitTelemetryFrame(const TelemetryFrame& frame) {
+    if (telemetryQueue.push(frame)) return true;
+    telemetryFramesDropped.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+static uint16_t readU16(const uint8_t* p) { return static_cast<uint16_t>(p[0] | (p[1] << 8)); }
+static int16_t readI16(const uint8_t* p) { return static_cast<int16_t>(readU16(p)); }
+static uint32_t readU24(const uint8_t* p) { return p[0] | (p[1] << 8) | (static_cast<uint32_t>(p[2]) << 16); }
+
+bool decodeTelemetryFrame(const TelemetryFrame& frame, TelemetrySnapshot& snap) {
+    if (frame.moduleAddress < 1 || frame.moduleAddress > 48) return false;
+
+    switch (frame.type) {
+    case TelemetryFrameType::OUTPUT:
+        if (frame.length < 4) return false;
+        snap.outputVoltage = readU16(frame.data) * 0.1f;
+        snap.outputCurrent = readU16(frame.data + 2) * 0.01f;
+        break;
+    case TelemetryFrameType::INPUT:
+        if (frame.length < 4) return false;
+        snap.inputVoltage = readU16(frame.data) * 0.1f;
+        snap.inputCurrent = readU16(frame.data + 2) * 0.01f;
+        break;
+    case TelemetryFrameType::PHASE:
+        if (frame.length < 6) return false;
+        snap.PhaseAVoltage = readU16(frame.data) * 0.1f;
+        snap.PhaseBVoltage = readU16(frame.data + 2) * 0.1f;
+        snap.PhaseCVoltage = readU16(frame.data + 4) * 0.1f;
+        break;
+    case TelemetryFrameType::STATUS:
+        if (frame.length < 6) return false;
+        snap.temperature = readI16(frame.data) * 0.1f;
+        snap.state = static_cast<ChargingModuleState>(frame.data[2]);
+        snap.faultWord = readU24(frame.data + 3);
+        break;
+    default:
+        return false;
+    }
+    snap.lastSeenNs = frame.timestampNs;
+    return true;
+}
+
+void publishTelemetry(uint16_t module, const TelemetrySnapshot& snap) {
+    TelemetrySlot& slot = telemetryStore[module];
+    uint32_t seq = slot.seq.load(std::memory_order_relaxed);
+    slot.seq.store(seq + 1, std::memory_order_relaxed); // odd : write in progress
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.data = snap;
+    slot.seq.store(seq + 2, std::memory_order_release);
+}
+
+TelemetrySnapshot readTelemetry(uint16_t module) {
+    TelemetrySlot& slot = telemetryStore[module];
+    TelemetrySnapshot snap;
+    uint32_t before, after;
+    do {
+        before = slot.seq.load(std::memory_order_acquire);
+        snap = slot.data;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        after = slot.seq.load(std::memory_order_relaxed);
+    } while ((before & 1) || before != after);
+    return snap;
+}
+
+// Optional per frame observer (latency measurement, history, ...)
+void (*telemetryFrameHook)(const TelemetryFrame& frame, uint64_t decodedNs) = nullptr;
+
+// Optional per batch observer : modules published in this batch and the
+// alive state of every reported module (bit per module)
+void (*telemetryBatchHook)(uint64_t touched, uint64_t aliveMask) = nullptr;
+
+bool telemetryAlive(const TelemetrySnapshot& snap) {
+    return snap.state != ChargingModuleState::FAULT_OFF && (snap.faultWord & TELEMETRY_FATAL_FAULTS) == 0;
+}
+
+// ------------ heartbeat tracking ------------
+
+// Liveness from the telemetry stream itself : a module that has not sent a
+// frame for heartbeatTimeoutMs is reported dead and its connector rerouted
+// (FAULT -> handleModuleFault), one that reports again comes back. Modules
+// are armed when startup discovery verified them, so one that never reports
+// is caught too.
+//
+// Deadlines live in a hierarchical timing wheel, four levels of 64 slots of
+// HEARTBEAT_TICK_MS. touch() only stores the last seen tick, it never moves
+// the entry. When an entry fires, a module seen meanwhile is re-armed at
+// lastSeen + timeout, one that was not is expired. Heartbeats and expiries
+// are O(1) whatever the number of tracked ids, and nothing scans pmArray.
+
+const uint32_t HEARTBEAT_TICK_MS = 10;
+const uint32_t HEARTBEAT_CAPACITY = 4096; // ids trackable by one wheel
+
+class HeartbeatWheel
+{
+public:
+    static constexpr int LEVELS = 4;
+    static constexpr int SLOT_BITS = 6;
+    static constexpr uint32_t SLOTS = 1u << SLOT_BITS;
+    static constexpr uint32_t NONE = UINT32_MAX;
+
+    explicit HeartbeatWheel(uint32_t capacity) : entries(capacity) {
+        for (auto& level : heads) std::fill(level, level + SLOTS, NONE);
+    }
+
+    // New deadlines use it; armed ones keep theirs until they fire
+    void setTimeout(uint64_t ticks) { timeout = std::max<uint64_t>(ticks, 1); }
+
+    // Records a heartbeat of `id` at tick `now`. True if `id` was expired and is back.
+    bool touch(uint32_t id, uint64_t now) {
+        if (id >= entries.size()) return false;
+        if (current == 0) current = now; // first heartbeat
+        Entry& entry = entries[id];
+        entry.lastSeen = now;
+        if (entry.armed) return false;
+        bool back = entry.expired;
+        entry.expired = false;
+        schedule(id, now + timeout);
+        return back;
+    }
+
+    // Starts the deadline of an id that never reported (no-op once armed or expired)
+    void arm(uint32_t id, uint64_t now) {
+        if (id >= entries.size() || entries[id].armed || entries[id].expired) return;
+        if (current == 0) current = now;
+        entries[id].lastSeen = now;
+        schedule(id, now + timeout);
+    }
+
+    // Processes every tick up to `now`; expired(id) for each id not seen for a timeout
+    template <typename Fn>
+    void advance(uint64_t now, Fn expired) {
+        if (current == 0) current = now; // first call
+        for (; current <= now; current++) {
+            for (int level = LEVELS - 1; level > 0; level--) { // higher levels first : they refill the lower ones
+                if (current & ((1ull << (SLOT_BITS * level)) - 1)) continue;
+                relinkSlot(level, (current >> (SLOT_BITS * level)) & (SLOTS - 1));
+            }
+            uint32_t id = takeSlot(0, current & (SLOTS - 1));
+            while (id != NONE) {
+                Entry& entry = entries[id];
+                uint32_t next = entry.next;
+                entry.armed = false;
+                if (entry.lastSeen + timeout > current) schedule(id, entry.lastSeen + timeout); // seen meanwhile
+                else {
+                    entry.expired = true;
+                    expired(id);
+                }
+                id = next;
+            }
+        }
+    }
+
+    bool isExpired(uint32_t id) const { return id < entries.size() && entries[id].expired; }
+
+private:
+    struct Entry
+    {
+        uint64_t deadline = 0;
+        uint64_t lastSeen = 0;
+        uint32_t next = NONE;
+        bool armed = false;   // linked in a slot
+        bool expired = false;
+    };
+
+    std::vector<Entry> entries;
+    uint32_t heads[LEVELS][SLOTS];
+    uint64_t current = 0; // next tick to process
+    uint64_t timeout = 1;
+
+    void schedule(uint32_t id, uint64_t deadline) {
+        Entry& entry = entries[id];
+        entry.deadline = std::max(deadline, current);
+        uint64_t delta = entry.deadline - current;
+        int level = 0;
+        while (level < LEVELS - 1 && delta >= (1ull << (SLOT_BITS * (level + 1)))) level++;
+        uint32_t slot = (entry.deadline >> (SLOT_BITS * level)) & (SLOTS - 1);
+        entry.next = heads[level][slot];
+        heads[level][slot] = id;
+        entry.armed = true;
+    }
+
+    uint32_t takeSlot(int level, uint64_t slot) {
+        uint32_t id = heads[level][slot];
+        heads[level][slot] = NONE;
+        return id;
+    }
+
+    // Cascades a higher level slot down now that its range has come
+    void relinkSlot(int level, uint64_t slot) {
+        uint32_t id = takeSlot(level, slot);
+        while (id != NONE) {
+            uint32_t next = entries[id].next;
+            schedule(id, entries[id].deadline);
+            id = next;
+        }
+    }
+};
+
+HeartbeatWheel moduleHeartbeats(HEARTBEAT_CAPACITY); // ingestion thread only
+std::atomic<uint32_t> heartbeatTimeoutMs{ 500 };     // from the configuration
+std::atomic<uint64_t> heartbeatDeadMask{ 0 };        // cabinet modules without heartbeat, read by applyTelemetry()
+std::atomic<uint64_t> heartbeatExpiries{ 0 };
+std::atomic<uint64_t> heartbeatArmRequests{ 0 };     // verified modules to arm, set by reconcileSubset()
+uint64_t telemetryAliveBits = ~0ull;                 // ingestion thread only, alive by telemetry content
+
+uint64_t heartbeatTickOf(uint64_t ns) {
+    return ns / (HEARTBEAT_TICK_MS * 1000000ull);
+}
+
+uint64_t telemetryAliveMask() {
+    return telemetryAliveBits & ~heartbeatDeadMask.load(std::memory_order_relaxed);
+}
+
+// --bench-heartbeat : a full wheel in simulated time, every id reporting each
+// `periodTicks` with one in 64 falling silent half way
+int benchHeartbeat(uint32_t ids = HEARTBEAT_CAPACITY, uint64_t periodTicks = 10, uint64_t timeoutTicks = 50, uint64_t ticks = 20000) {
+    std::cout << "[Bench] Heartbeat wheel : " << ids << " ids, heartbeat every " << periodTicks * HEARTBEAT_TICK_MS
+        << " ms, timeout " << timeoutTicks * HEARTBEAT_TICK_MS << " ms, " << ticks << " ticks\n";
+    HeartbeatWheel wheel(ids);
+    wheel.setTimeout(timeoutTicks);
+    const uint64_t base = 1000, silentFrom = base + ticks / 2;
+    std::vector<uint64_t> detectedAt(ids, 0);
+    uint64_t touches = 0, touchNs = 0, advanceNs = 0, falseExpiries = 0;
+
+    for (uint64_t t = base; t < base + ticks; t++) {
+        uint64_t begin = monotonicNs();
+        for (uint32_t id = t % periodTicks; id < ids; id += periodTicks) { // staggered reporters
+            if (id % 64 == 0 && t >= silentFrom) continue;
+            wheel.touch(id, t);
+            touches++;
+        }
+        uint64_t middle = monotonicNs();
+        wheel.advance(t, [&](uint32_t id) {
+            if (id % 64 != 0) falseExpiries++;
+            else if (!detectedAt[id]) detectedAt[id] = t;
+        });
+        touchNs += middle - begin;
+        advanceNs += monotonicNs() - middle;
+    }
+
+    uint64_t worst = 0, detected = 0;
+    for (uint32_t id = 0; id < ids; id += 64) {
+        if (!detectedAt[id]) continue;
+        detected++;
+        worst = std::max(worst, detectedAt[id] - silentFrom);
+    }
+    std::cout << "Touch          : " << (touches ? touchNs / touches : 0) << " ns per heartbeat\n";
+    std::cout << "Advance        : " << advanceNs / ticks << " ns per tick\n";
+    std::cout << "Detected       : " << detected << " of " << (ids + 63) / 64 << " silent ids, worst "
+        << worst * HEARTBEAT_TICK_MS << " ms after going silent, " << falseExpiries << " false expiries\n";
+    return 0;
+}
+
+// Ingestion thread, every loop pass : expires silent modules and reports them
+void heartbeatTick() {
+    moduleHeartbeats.setTimeout((heartbeatTimeoutMs.load(std::memory_order_relaxed) + HEARTBEAT_TICK_MS - 1) / HEARTBEAT_TICK_MS);
+    uint64_t now = heartbeatTickOf(monotonicNs());
+    forEachBit(heartbeatArmRequests.exchange(0, std::memory_order_relaxed), [now](int m) { moduleHeartbeats.arm(m, now); });
+    uint64_t expired = 0;
+    moduleHeartbeats.advance(now, [&expired](uint32_t id) {
+        heartbeatExpiries.fetch_add(1, std::memory_order_relaxed);
+        if (id < 64) expired |= 1ull << id;
+    });
+    if (!expired) return;
+    heartbeatDeadMask.fetch_or(expired, std::memory_order_relaxed);
+    std::cerr << "Heartbeat : no telemetry for " << heartbeatTimeoutMs.load() << " ms from module(s)";
+    forEachBit(expired, [](int m) { std::cerr << " " << m; });
+    std::cerr << "\n";
+    if (telemetryBatchHook) telemetryBatchHook(expired, telemetryAliveMask());
+}
+
+// Decodes one batch. Frames of the same module are merged locally and
+// published once per batch.
+size_t ingestTelemetryBatch() {
+    static TelemetryFrame batch[256];
+    static TelemetrySnapshot scratch[49];
+    static bool scratchInit = false;
+
+    size_t n = telemetryQueue.popBatch(batch, 256);
+    if (n == 0) return 0;
+
+    if (!scratchInit) {
+        for (uint16_t m = 1; m < 49; m++) scratch[m] = readTelemetry(m);
+        scratchInit = true;
+    }
+
+    uint64_t touched = 0; // bit per module
+    size_t decoded = 0;   // valid frames are compacted to the front of batch
+    for (size_t i = 0; i < n; i++) {
+        uint16_t address = batch[i].moduleAddress;
+        if (address < 1 || address > 48 || !decodeTelemetryFrame(batch[i], scratch[address])) {
+            telemetryFramesInvalid.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+        touched |= 1ull << address;
+        batch[decoded++] = batch[i];
+    }
+
+    uint64_t tick = heartbeatTickOf(monotonicNs());
+    uint64_t back = 0;
+    for (uint16_t m = 1; m < 49; m++) {
+        if (!(touched & (1ull << m))) continue;
+        publishTelemetry(m, scratch[m]);
+        if (moduleHeartbeats.touch(m, tick)) back |= 1ull << m;
+    }
+    if (back) heartbeatDeadMask.fetch_and(~back, std::memory_order_relaxed);
+    telemetryFramesDecoded.fetch_add(decoded, std::memory_order_relaxed);
+
+    if (touched != 0) {
+        telemetryAliveBits = 0;
+        for (uint16_t m = 1; m < 49; m++) {
+            if (scratch[m].lastSeenNs == 0 || telemetryAlive(scratch[m])) telemetryAliveBits |= 1ull << m;
+        }
+        if (telemetryBatchHook) telemetryBatchHook(touched, telemetryAliveMask());
+    }
+
+    if (telemetryFrameHook) {
+        uint64_t now = monotonicNs();
+        for (size_t i = 0; i < decoded; i++) telemetryFrameHook(batch[i], now);
+    }
+    return n;
+}
+
+void telemetryIngestionLoop(std::atomic<bool>& run) {
+    while (run) {
+        size_t frames = ingestTelemetryBatch();
+        heartbeatTick();
+        if (frames == 0) {
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+    }
+    while (ingestTelemetryBatch() != 0) {} // drain
+}
+
+uint64_t moduleVerifiedMask = ~0ull; // modules confirmed by startup discovery, see beginDiscovery()
+
+// Copies the latest telemetry into pmArray. Called by the thread that owns
+// the allocator state, so pmArray is never written by the ingestion thread.
+// Modules not verified yet stay dead. Returns true if any module changed alive state.
+bool applyTelemetry() {
+    bool aliveChanged = false;
+    uint64_t dead = heartbeatDeadMask.load(std::memory_order_relaxed);
+    for (uint16_t i = 1; i < 49; i++) {
+        TelemetrySnapshot snap = readTelemetry(i);
+        if (snap.lastSeenNs == 0) { // no report yet, keep defaults unless silent since verification
+            if ((dead & (1ull << i)) && pmArray[i].isAlive) {
+                pmArray[i].isAlive = false;
+                aliveChanged = true;
+            }
+            continue;
+        }
+
+        pmArray[i].PhaseAVoltage = snap.PhaseAVoltage;
+        pmArray[i].PhaseBVoltage = snap.PhaseBVoltage;
+        pmArray[i].PhaseCVoltage = snap.PhaseCVoltage;
+        pmArray[i].temperature = snap.temperature;
+        pmArray[i].inputVoltage = snap.inputVoltage;
+        pmArray[i].inputCurrent = snap.inputCurrent;
+        pmArray[i].outputVoltage = snap.outputVoltage;
+        pmArray[i].outputCurrent = snap.outputCurrent;
+        pmArray[i].state = snap.state;
+
+        for (size_t b = 0; b < pmArray[i].faultBits.size(); b++) {
+            pmArray[i].faultBits[b] = (snap.faultWord >> b) & 1u;
+        }
+        pmArray[i].isFaultTriggered = snap.faultWord != 0;
+
+        bool alive = telemetryAlive(snap) && (moduleVerifiedMask & (1ull << i)) && !(dead & (1ull << i));
+        if (alive != pmArray[i].isAlive) aliveChanged = true;
+        pmArray[i].isAlive = alive;
+    }
+    return aliveChanged;
+}
+
+// pmArray[].isActive as a bit per module, for threads that must not read
+// pmArray while the allocator writes it. Republished after every pass.
+std::atomic<uint64_t> activeModuleMask{ 0 };
+
+void publishActiveModules() {
+    uint64_t active = 0;
+    for (uint16_t m = 1; m < 49; m++) {
+        if (pmArray[m].isActive) active |= 1ull << m;
+    }
+    activeModuleMask.store(active, std::memory_order_relaxed);
+}
+
+// ------------ synthetic generator ------------
+
+std::atomic<float> commandedCurrent[49] = {}; // last current setpoint sent to each module
+
+TelemetryFrame makeTelemetryFrame(uint16_t module, TelemetryFrameType type, const uint16_t* words, uint8_t count) {
+    TelemetryFrame frame{};
+    frame.moduleAddress = module;
+    frame.type = type;
+    frame.length = count * 2;
+    for (uint8_t i = 0; i < count; i++) {
+        frame.data[2 * i] = words[i] & 0xFF;
+        frame.data[2 * i + 1] = words[i] >> 8;
+    }
+    frame.timestampNs = monotonicNs();
+    return frame;
+}
+
+// Emits the 4 frame types for every module, rateHz times per second per module.
+// rateHz = 0 : as fast as possible (benchmark)
+void syntheticTelemetryGenerator(std::atomic<bool>& run, uint16_t firstModule, uint16_t lastModule, int rateHz) {
+    uint32_t tick = 0;
+    auto next = std::chrono::steady_clock::now();
+    while (run) {
+        uint64_t active = activeModuleMask.load(std::memory_order_relaxed);
+        for (uint16_t m = firstModule; m <= lastModule; m++) {
+            bool on = (active >> m) & 1u;
+            float current = commandedCurrent[m].load(std::memory_order_relaxed);
+            uint16_t out[2] = { static_cast<uint16_t>(on ? 5000 + (tick % 10) : 0), static_cast<uint16_t>(current * 100) };
+            uint16_t in[2] = { 4000, static_cast<uint16_t>(on ? 1250 : 10) };
+            uint16_t phase[3] = { 2300, 2301, 2299 };
+            uint16_t status[3] = { static_cast<uint16_t>(350 + m * 2 + (on ? 150 : 0)),
+                                   static_cast<uint16_t>(on ? 0x01 : 0x00), 0 }; // temp, state, fault word low byte
+            submitTelemetryFrame(makeTelemetryFrame(m, TelemetryFrameType::OUTPUT, out, 2));
+            submitTelemetryFrame(makeTelemetryFrame(m, TelemetryFrameType::INPUT, in, 2));
+            submitTelemetryFrame(makeTelemetryFrame(m, TelemetryFrameType::PHASE, phase, 3));
+            submitTelemetryFrame(makeTelemetryFrame(m, TelemetryFrameType::STATUS, status, 3));
+        }
+        tick++;
+        if (rateHz > 0) {
+            next += std::chrono::microseconds(1000000 / rateHz);
+            std::this_thread::sleep_until(next);
+        }
+    }
+}
+
+// ------------ benchmark ------------
+
+std::vector<uint32_t> telemetryBenchLatencyUs;
+
+void telemetryBenchHook(const TelemetryFrame& frame, uint64_t decodedNs) {
+    if (telemetryBenchLatencyUs.size() < telemetryBenchLatencyUs.capacity()) {
+        telemetryBenchLatencyUs.push_back(static_cast<uint32_t>((decodedNs - frame.timestampNs) / 1000));
+    }
+}
+
+// Measures sustained ingestion throughput and end-to-end latency (submit -> published)
+// with `producers` generator threads running flat out for `seconds`.
+int benchTelemetry(int seconds = 5, int producers = 4) {
+    std::cout << "[Bench] Telemetry ingestion: " << producers << " producers, " << seconds << " s\n";
+
+    telemetryBenchLatencyUs.reserve(4000000);
+    telemetryFrameHook = telemetryBenchHook;
+
+    std::atomic<bool> ingest{ true };
+    std::atomic<bool> produce{ true };
+    std::thread consumer(telemetryIngestionLoop, std::ref(ingest));
+
+    std::vector<std::thread> gens;
+    uint16_t perProducer = 48 / producers;
+    for (int p = 0; p < producers; p++) {
+        uint16_t first = 1 + p * perProducer;
+        uint16_t last = (p == producers - 1) ? 48 : first + perProducer - 1;
+        gens.emplace_back(syntheticTelemetryGenerator, std::ref(produce), first, last, 0);
+    }
+
+    uint64_t startFrames = telemetryFramesDecoded.load();
+    auto start = std::chrono::steady_clock::now();
+    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+    produce = false;
+    for (auto& t : gens) t.join();
+    ingest = false;
+    consumer.join();
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    telemetryFrameHook = nullptr;
+
+    uint64_t frames = telemetryFramesDecoded.load() - startFrames;
+    std::sort(telemetryBenchLatencyUs.begin(), telemetryBenchLatencyUs.end());
+    auto pct = [](double p) {
+        if (telemetryBenchLatencyUs.empty()) return 0u;
+        return telemetryBenchLatencyUs[static_cast<size_t>(p * (telemetryBenchLatencyUs.size() - 1))];
+    };
+
+    std::cout << "Frames decoded : " << frames << "\n";
+    std::cout << "Frames dropped : " << telemetryFramesDropped.load() << " (queue full)\n";
+    std::cout << "Throughput     : " << static_cast<uint64_t>(frames / elapsed) << " frames/s\n";
+    std::cout << "Latency (us)   : p50=" << pct(0.50) << " p99=" << pct(0.99) << " max=" << pct(1.0) << "\n";
+    return 0;
+}
+
+//********************************   TELEMETRY INGESTION END   ********************************************************/
+
+
+//********************************   TELEMETRY HISTORY START   ********************************************************/
+
+// Channels kept per module. Values are stored quantised (int32) :
+// voltages 0.1 V, currents 0.01 A, temperature 0.1 C
+enum class HistoryChannel : uint8_t
+{
+    OUTPUT_VOLTAGE = 0,
+    OUTPUT_CURRENT = 1,
+    TEMPERATURE = 2,
+    PHASE_A_VOLTAGE = 3,
+    PHASE_B_VOLTAGE = 4,
+    PHASE_C_VOLTAGE = 5
+};
+
+const uint8_t HISTORY_CHANNELS = 6;
+const uint16_t HISTORY_CAPACITY = 720;      // samples kept in memory per channel (1 h @ 5 s)
+const uint16_t HISTORY_WINDOW = 60;         // rolling window length in samples (5 min @ 5 s)
+const uint16_t HISTORY_FLUSH_SAMPLES = 120; // samples per on-disk block (10 min @ 5 s)
+const uint32_t HISTORY_INTERVAL_MS = 5000;
+const size_t HISTORY_MAX_FILES = 25;        // one file per hour, ~1 day kept
+const std::string HISTORY_DIR = "json_data/history";
+
+float historyScale(HistoryChannel channel) {
+    return (channel == HistoryChannel::OUTPUT_CURRENT) ? 0.01f : 0.1f;
+}
+
+int32_t historyQuantise(HistoryChannel channel, float value) {
+    return static_cast<int32_t>(std::lround(value / historyScale(channel)));
+}
+
+struct HistoryWindowStats
+{
+    float min = 0.0f;
+    float max = 0.0f;
+    float mean = 0.0f;
+    uint16_t count = 0;
+};
+
+// Fixed memory ring of quantised samples with O(1) rolling min/max/mean over the
+// last HISTORY_WINDOW samples (running sum + monotonic index queues).
+class HistoryRing
+{
+public:
+    void push(int32_t value) {
+        uint64_t seq = total++;
+        samples[seq % HISTORY_CAPACITY] = value;
+
+        windowSum += value;
+        if (seq >= HISTORY_WINDOW) windowSum -= samples[(seq - HISTORY_WINDOW) % HISTORY_CAPACITY];
+
+        // drop indices that left the window, then keep queues monotonic
+        uint64_t oldest = (seq + 1 > HISTORY_WINDOW) ? seq + 1 - HISTORY_WINDOW : 0;
+        while (!minQ.empty() && minQ.front() < oldest) minQ.pop_front();
+        while (!maxQ.empty() && maxQ.front() < oldest) maxQ.pop_front();
+        while (!minQ.empty() && at(minQ.back()) >= value) minQ.pop_back();
+        while (!maxQ.empty() && at(maxQ.back()) <= value) maxQ.pop_back();
+        minQ.push_back(seq);
+        maxQ.push_back(seq);
+    }
+
+    HistoryWindowStats window(float scale) const {
+        HistoryWindowStats stats;
+        if (total == 0) return stats;
+        stats.count = static_cast<uint16_t>(std::min<uint64_t>(total, HISTORY_WINDOW));
+        stats.min = at(minQ.front()) * scale;
+        stats.max = at(maxQ.front()) * scale;
+        stats.mean = static_cast<float>(windowSum) / stats.count * scale;
+        return stats;
+    }
+
+    int32_t at(uint64_t seq) const { return samples[seq % HISTORY_CAPACITY]; }
+    uint64_t size() const { return total; }
+
+private:
+    // Bounded index queue (at most HISTORY_WINDOW entries), no allocation
+    struct IndexQueue {
+        uint64_t items[HISTORY_WINDOW];
+        uint16_t head = 0, count = 0;
+        bool empty() const { return count == 0; }
+        uint64_t front() const { return items[head]; }
+        uint64_t back() const { return items[(head + count - 1) % HISTORY_WINDOW]; }
+        void pop_front() { head = (head + 1) % HISTORY_WINDOW; count--; }
+        void pop_back() { count--; }
+        void push_back(uint64_t v) { items[(head + count) % HISTORY_WINDOW] = v; count++; }
+    };
+
+    int32_t samples[HISTORY_CAPACITY] = {};
+    uint64_t total = 0;
+    int64_t windowSum = 0;
+    IndexQueue minQ, maxQ;
+};
+
+HistoryRing historyRings[49][HISTORY_CHANNELS]; // 0 : Default , 1-48 : modules
+uint64_t historyStartMs = 0;   // wall clock of sample 0
+uint64_t historyFlushedUpTo = 0; // samples [0, historyFlushedUpTo) are on disk
+std::mutex historyMtx;          // history only, never held together with mtx
+
+uint64_t wallClockMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+HistoryWindowStats historyWindow(uint16_t module, HistoryChannel channel) {
+    std::lock_guard<std::mutex> lock(historyMtx);
+    return historyRings[module][static_cast<uint8_t>(channel)].window(historyScale(channel));
+}
+
+void recordHistorySample() {
+    std::lock_guard<std::mutex> lock(historyMtx);
+    if (historyStartMs == 0) historyStartMs = wallClockMs();
+
+    for (uint16_t m = 1; m < 49; m++) {
+        TelemetrySnapshot snap = readTelemetry(m);
+        HistoryRing* rings = historyRings[m];
+        rings[0].push(historyQuantise(HistoryChannel::OUTPUT_VOLTAGE, snap.outputVoltage));
+        rings[1].push(historyQuantise(HistoryChannel::OUTPUT_CURRENT, snap.outputCurrent));
+        rings[2].push(historyQuantise(HistoryChannel::TEMPERATURE, snap.temperature));
+        rings[3].push(historyQuantise(HistoryChannel::PHASE_A_VOLTAGE, snap.PhaseAVoltage));
+        rings[4].push(historyQuantise(HistoryChannel::PHASE_B_VOLTAGE, snap.PhaseBVoltage));
+        rings[5].push(historyQuantise(HistoryChannel::PHASE_C_VOLTAGE, snap.PhaseCVoltage));
+    }
+}
+
+// ------------ delta + varint encoding ------------
+// Each stream : first value, then deltas, zigzag varint encoded.
+// A zero delta is written as token 0 followed by the run length.
+
+void putVarint(std::vector<uint8_t>& out, uint64_t v) {
+    while (v >= 0x80) {
+        out.push_back(static_cast<uint8_t>(v) | 0x80);
+        v >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(v));
+}
+
+bool getVarint(const uint8_t*& p, const uint8_t* end, uint64_t& v) {
+    v = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t b = *p++;
+        v |= static_cast<uint64_t>(b & 0x7F) << shift;
+        if (!(b & 0x80)) return true;
+    }
+    return false;
+}
+
+uint64_t zigzag(int64_t v) { return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63); }
+int64_t unzigzag(uint64_t v) { return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1); }
+
+void encodeHistoryStream(std::vector<uint8_t>& out, const HistoryRing& ring, uint64_t from, uint64_t to) {
+    int64_t prev = 0;
+    uint64_t zeroRun = 0;
+    for (uint64_t s = from; s < to; s++) {
+        int64_t delta = static_cast<int64_t>(ring.at(s)) - prev;
+        prev = ring.at(s);
+        if (delta == 0 && s != from) {
+            zeroRun++;
+            continue;
+        }
+        if (zeroRun) { putVarint(out, 0); putVarint(out, zeroRun); zeroRun = 0; }
+        putVarint(out, zigzag(delta)); // first value is a delta from 0
+    }
+    if (zeroRun) { putVarint(out, 0); putVarint(out, zeroRun); }
+}
+
+bool decodeHistoryStream(const uint8_t* p, const uint8_t* end, uint16_t count, std::vector<int32_t>& values) {
+    int64_t prev = 0;
+    values.clear();
+    bool first = true;
+    while (values.size() < count) {
+        uint64_t token;
+        if (!getVarint(p, end, token)) return false;
+        if (token == 0 && !first) {
+            uint64_t run;
+            if (!getVarint(p, end, run)) return false;
+            for (uint64_t r = 0; r < run && values.size() < count; r++) values.push_back(static_cast<int32_t>(prev));
+            continue;
+        }
+        prev += unzigzag(token);
+        values.push_back(static_cast<int32_t>(prev));
+        first = false;
+    }
+    return true;
+}
+
+// ------------ on-disk blocks ------------
+// File = sequence of blocks. Block header is followed by a per stream offset
+// table (48 modules x 6 channels), then the encoded streams. Readers skip
+// whole blocks by time range and decode only the requested stream.
+
+struct HistoryBlockHeader
+{
+    uint32_t magic;         // 'PMH1'
+    uint64_t startMs;       // wall clock of first sample
+    uint32_t intervalMs;
+    uint16_t sampleCount;
+    uint8_t moduleCount;
+    uint8_t channelCount;
+    uint32_t payloadBytes;  // offset table + streams
+};
+
+const uint32_t HISTORY_MAGIC = 0x31484D50; // "PMH1"
+
+std::string historyFileName(uint64_t startMs) {
+    return HISTORY_DIR + "/pm_history_" + std::to_string(startMs / 3600000) + ".bin"; // one file per hour
+}
+
+void rotateHistoryFiles() {
+    std::error_code ec;
+    std::vector<std::filesystem::path> files;
+    for (auto& entry : std::filesystem::directory_iterator(HISTORY_DIR, ec)) {
+        if (entry.path().extension() == ".bin") files.push_back(entry.path());
+    }
+    if (files.size() <= HISTORY_MAX_FILES) return;
+    std::sort(files.begin(), files.end());
+    for (size_t i = 0; i + HISTORY_MAX_FILES < files.size(); i++) {
+        std::filesystem::remove(files[i], ec);
+    }
+}
+
+// Writes samples not yet on disk as one block. Returns bytes written.
+size_t flushHistory() {
+    std::vector<uint8_t> payload;
+    HistoryBlockHeader header{};
+    {
+        std::lock_guard<std::mutex> lock(historyMtx);
+        uint64_t total = historyRings[1][0].size();
+        // samples older than the ring capacity are lost
+        uint64_t from = std::max(historyFlushedUpTo, total > HISTORY_CAPACITY ? total - HISTORY_CAPACITY : 0);
+        if (from >= total) return 0;
+
+        header.magic = HISTORY_MAGIC;
+        header.startMs = historyStartMs + from * HISTORY_INTERVAL_MS;
+        header.intervalMs = HISTORY_INTERVAL_MS;
+        header.sampleCount = static_cast<uint16_t>(total - from);
+        header.moduleCount = 48;
+        header.channelCount = HISTORY_CHANNELS;
+
+        const size_t streams = 48 * HISTORY_CHANNELS;
+        payload.resize(streams * sizeof(uint32_t));
+        for (uint16_t m = 1; m < 49; m++) {
+            for (uint8_t c = 0; c < HISTORY_CHANNELS; c++) {
+                uint32_t offset = static_cast<uint32_t>(payload.size());
+                std::memcpy(&payload[((m - 1) * HISTORY_CHANNELS + c) * sizeof(uint32_t)], &offset, sizeof(offset));
+                encodeHistoryStream(payload, historyRings[m][c], from, total);
+            }
+        }
+        header.payloadBytes = static_cast<uint32_t>(payload.size());
+        historyFlushedUpTo = total;
+    }
+
+    std::error_code ec;
+    std::filesystem::create_directories(HISTORY_DIR, ec);
+    std::ofstream out(historyFileName(header.startMs), std::ios::binary | std::ios::app);
+    if (!out.is_open()) {
+        std::cerr << "Error opening history file for writing: " << historyFileName(header.startMs) << "\n";
+        return 0;
+    }
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(payload.data()), payload.size());
+    out.close();
+
+    rotateHistoryFiles();
+    return sizeof(header) + payload.size();
+}
+
+struct HistoryPoint
+{
+    uint64_t timeMs;
+    float value;
+};
+
+// Reads [fromMs, toMs] of one module channel from the rotated files.
+// Blocks outside the range are skipped without reading their payload.
+std::vector<HistoryPoint> queryHistory(uint16_t module, HistoryChannel channel, uint64_t fromMs, uint64_t toMs) {
+    std::vector<HistoryPoint> points;
+    if (module < 1 || module > 48) return points;
+
+    std::error_code ec;
+    std::vector<std::filesystem::path> files;
+    for (auto& entry : std::filesystem::directory_iterator(HISTORY_DIR, ec)) {
+        if (entry.path().extension() == ".bin") files.push_back(entry.path());
+    }
+    std::sort(files.begin(), files.end());
+
+    uint8_t c = static_cast<uint8_t>(channel);
+    std::vector<uint8_t> payload;
+    std::vector<int32_t> values;
+
+    for (auto& file : files) {
+        std::ifstream in(file, std::ios::binary);
+        HistoryBlockHeader header;
+        while (in.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+            if (header.magic != HISTORY_MAGIC) {
+                std::cerr << "Corrupt history block in " << file << "\n";
+                break;
+            }
+            uint64_t endMs = header.startMs + static_cast<uint64_t>(header.sampleCount) * header.intervalMs;
+            if (endMs < fromMs || header.startMs > toMs || module > header.moduleCount || c >= header.channelCount) {
+                in.seekg(header.payloadBytes, std::ios::cur);
+                continue;
+            }
+
+            payload.resize(header.payloadBytes);
+            if (!in.read(reinterpret_cast<char*>(payload.data()), payload.size())) {
+                std::cerr << "Truncated history block in " << file << "\n";
+                break;
+            }
+
+            size_t stream = (module - 1) * header.channelCount + c;
+            size_t streams = static_cast<size_t>(header.moduleCount) * header.channelCount;
+            if (streams * sizeof(uint32_t) > header.payloadBytes) {
+                std::cerr << "Corrupt history block in " << file << "\n";
+                continue;
+            }
+            uint32_t begin, end = header.payloadBytes;
+            std::memcpy(&begin, &payload[stream * sizeof(uint32_t)], sizeof(begin));
+            if (stream + 1 < streams) std::memcpy(&end, &payload[(stream + 1) * sizeof(uint32_t)], sizeof(end));
+            if (begin < streams * sizeof(uint32_t) || begin > end || end > header.payloadBytes) {
+                std::cerr << "Corrupt history block in " << file << "\n";
+                continue;
+            }
+
+            if (!decodeHistoryStream(payload.data() + begin, payload.data() + end, header.sampleCount, values)) continue;
+            for (uint16_t s = 0; s < values.size(); s++) {
+                uint64_t t = header.startMs + static_cast<uint64_t>(s) * header.intervalMs;
+                if (t >= fromMs && t <= toMs) points.push_back({ t, values[s] * historyScale(channel) });
+            }
+        }
+    }
+    return points;
+}
+
+void historyLoop(std::atomic<bool>& run) {
+    auto next = std::chrono::steady_clock::now();
+    uint32_t pending = 0;
+    while (run) {
+        next += std::chrono::milliseconds(HISTORY_INTERVAL_MS);
+        while (run && std::chrono::steady_clock::now() < next) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        recordHistorySample();
+        if (++pending >= HISTORY_FLUSH_SAMPLES) {
+            flushHistory();
+            pending = 0;
+        }
+    }
+    flushHistory();
+}
+
+//********************************   TELEMETRY HISTORY END   ********************************************************/
+
+
+//********************************   METRICS EXPOSITION START   ********************************************************/
+
+const uint16_t METRICS_PORT = 9464; // bound to 127.0.0.1 only
+
+void writeHistogram(std::ostringstream& out, const std::string& name, const std::string& help, const LatencyHistogram& h) {
+    out << "# HELP " << name << " " << help << "\n";
+    out << "# TYPE " << name << " histogram\n";
+    uint64_t cumulative = 0;
+    for (int i = 0; i < LatencyHistogram::BUCKETS; i++) {
+        cumulative += h.counts[i].load(std::memory_order_relaxed);
+        if (i == LatencyHistogram::BUCKETS - 1) break; // saturating bucket, only under +Inf
+        // samples are whole microseconds, so the inclusive bound is one below the exclusive one
+        out << name << "_bucket{le=\"" << (LatencyHistogram::bucketUpperUs(i) - 1) / 1e6 << "\"} " << cumulative << "\n";
+    }
+    out << name << "_bucket{le=\"+Inf\"} " << cumulative << "\n";
+    out << name << "_sum " << h.sumUs.load(std::memory_order_relaxed) / 1e6 << "\n";
+    out << name << "_count " << cumulative << "\n";
+}
+
+// Prometheus text format (version 0.0.4)
+std::string renderMetrics() {
+    std::ostringstream out;
+
+    writeHistogram(out, "pmm_assign_power_modules_seconds", "Duration of assign_power_modules()", assignLatency);
+    writeHistogram(out, "pmm_isolate_connector_seconds", "Duration of isolateConnector()", isolateLatency);
+    writeHistogram(out, "pmm_stop_connector_seconds", "STOP command to session teardown", stopLatency);
+    writeHistogram(out, "pmm_optimise_pass_seconds", "Duration of one worker optimisation pass", optimiseLatency);
+    writeHistogram(out, "pmm_trigger_to_assignment_seconds", "Time from trigger detection to modules assigned", triggerToAssignLatency);
+    writeHistogram(out, "pmm_config_apply_seconds", "Engine time spent swapping in a reloaded configuration", configApplyLatency);
+
+    out << "# HELP pmm_switch_toggles_total Relay / mux state changes\n";
+    out << "# TYPE pmm_switch_toggles_total counter\n";
+    for (uint16_t i = 0; i < relayMuxCount; i++) {
+        uint16_t id = relayMuxTable[i].muxId;
+        out << "pmm_switch_toggles_total{kind=\"relay\",id=\"" << id << "\"} " << switchToggleCount[id].load(std::memory_order_relaxed) << "\n";
+    }
+    for (uint16_t i = 0; i < connectorMuxCount; i++) {
+        uint16_t id = connectorPairMuxTable[i].muxId;
+        out << "pmm_switch_toggles_total{kind=\"mux\",id=\"" << id << "\"} " << switchToggleCount[id].load(std::memory_order_relaxed) << "\n";
+    }
+
+    out << "# HELP pmm_connector_current_amperes Per connector current\n";
+    out << "# TYPE pmm_connector_current_amperes gauge\n";
+    for (int c = 1; c <= 12; c++) {
+        std::string label = connectorName(static_cast<ConnectorType>(c));
+        out << "pmm_connector_current_amperes{connector=\"" << label << "\",kind=\"delivered\"} " << connectorDeliveredCurrent[c].load(std::memory_order_relaxed) << "\n";
+        out << "pmm_connector_current_amperes{connector=\"" << label << "\",kind=\"allocated\"} " << connectorAllocatedCurrent[c].load(std::memory_order_relaxed) << "\n";
+        out << "pmm_connector_current_amperes{connector=\"" << label << "\",kind=\"requested\"} " << connectorRequestedCurrent[c].load(std::memory_order_relaxed) << "\n";
+    }
+
+    out << "# TYPE pmm_trigger_actions_total counter\n";
+    out << "pmm_trigger_actions_total " << triggerActionCount.load(std::memory_order_relaxed) << "\n";
+    out << "# TYPE pmm_admission_waiting gauge\n";
+    out << "pmm_admission_waiting " << admissionWaiting.load(std::memory_order_relaxed) << "\n";
+    out << "# TYPE pmm_plan_cache_total counter\n";
+    out << "pmm_plan_cache_total{result=\"hit\"} " << planCacheHits.load(std::memory_order_relaxed) << "\n";
+    out << "pmm_plan_cache_total{result=\"miss\"} " << planCacheMisses.load(std::memory_order_relaxed) << "\n";
+    out << "pmm_plan_cache_total{result=\"evicted\"} " << planCacheEvictions.load(std::memory_order_relaxed) << "\n";
+    out << "# TYPE pmm_config_reloads_total counter\n";
+    out << "pmm_config_reloads_total{result=\"applied\"} " << configReloads.load(std::memory_order_relaxed) << "\n";
+    out << "pmm_config_reloads_total{result=\"rejected\"} " << configRejects.load(std::memory_order_relaxed) << "\n";
+    out << "# TYPE pmm_setpoint_total counter\n";
+    out << "pmm_setpoint_total{path=\"fast\"} " << setpointFastCount.load(std::memory_order_relaxed) << "\n";
+    out << "pmm_setpoint_total{path=\"escalated\"} " << setpointEscalatedCount.load(std::memory_order_relaxed) << "\n";
+    out << "# TYPE pmm_superset_plans_total counter\n";
+    out << "pmm_superset_plans_total{result=\"committed\"} " << supersetPlansCommitted.load(std::memory_order_relaxed) << "\n";
+    out << "pmm_superset_plans_total{result=\"diverged\"} " << supersetPlansDiverged.load(std::memory_order_relaxed) << "\n";
+    out << "# TYPE pmm_coordination_steps_total counter\n";
+    out << "pmm_coordination_steps_total " << coordinationSteps.load(std::memory_order_relaxed) << "\n";
+    out << "# TYPE pmm_optimise_cycles_total counter\n";
+    out << "pmm_optimise_cycles_total " << optimiseCycleCount.load(std::memory_order_relaxed) << "\n";
+    out << "# TYPE pmm_telemetry_frames_total counter\n";
+    out << "pmm_telemetry_frames_total{result=\"decoded\"} " << telemetryFramesDecoded.load(std::memory_order_relaxed) << "\n";
+    out << "pmm_telemetry_frames_total{result=\"dropped\"} " << telemetryFramesDropped.load(std::memory_order_relaxed) << "\n";
+    out << "pmm_telemetry_frames_total{result=\"invalid\"} " << telemetryFramesInvalid.load(std::memory_order_relaxed) << "\n";
+    return out.str();
+}
+
+// Minimal HTTP/1.0 server : every request gets the current metrics.
+void metricsServerLoop(std::atomic<bool>& run, uint16_t port = METRICS_PORT) {
+    int listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenFd < 0) {
+        std::cerr << "Metrics : socket() failed\n";
+        return;
+    }
+    int yes = 1;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(listenFd, 8) < 0) {
+        std::cerr << "Metrics : cannot listen on 127.0.0.1:" << port << "\n";
+        close(listenFd);
+        return;
+    }
+
+    while (run) {
+        pollfd pfd{ listenFd, POLLIN, 0 };
+        if (poll(&pfd, 1, 500) <= 0) continue; // wake up to check run flag
+
+        int fd = accept(listenFd, nullptr, nullptr);
+        if (fd < 0) continue;
+
+        char request[1024];
+        pollfd rfd{ fd, POLLIN, 0 };
+        if (poll(&rfd, 1, 1000) > 0) recv(fd, request, sizeof(request), 0); // request content is ignored
+
+        std::string body = renderMetrics();
+        std::string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+            + std::to_string(body.size()) + "\r\n\r\n" + body;
+        size_t sent = 0;
+        while (sent < response.size()) {
+            ssize_t n = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0) break;
+            sent += n;
+        }
+        close(fd);
+    }
+    close(listenFd);
+}
+
+// Local scraper : returns the metrics body, empty on failure.
+std::string scrapeMetrics(uint16_t port = METRICS_PORT) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return "";
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+        close(fd);
+        return "";
+    }
+
+    std::string request = "GET /metrics HTTP/1.0\r\n\r\n";
+    send(fd, request.data(), request.size(), MSG_NOSIGNAL);
+
+    std::string response;
+    char buffer[4096];
+    ssize_t n;
+    while ((n = recv(fd, buffer, sizeof(buffer), 0)) > 0) response.append(buffer, n);
+    close(fd);
+
+    size_t bodyStart = response.find("\r\n\r\n");
+    return (bodyStart == std::string::npos) ? "" : response.substr(bodyStart + 4);
+}
+
+//********************************   METRICS EXPOSITION END   ********************************************************/
+
+
+//********************************   CURRENT RAMP ENGINE START   ********************************************************/
+
+// Moves module current setpoints towards each connector's demand at a bounded
+// rate instead of switching modules on/off at full current. When modules are
+// added or removed, the others take over the current first (make before break),
+// so the connector's delivered current never drops during rebalancing.
+
+const float RAMP_RATE_A_PER_S = 20.0f; // per module
+const uint32_t RAMP_TICK_MS = 100;
+
+struct ModuleRamp
+{
+    ConnectorType owner = ConnectorType::DEFAULT;
+    float setpoint = 0.0f;   // currently commanded current (A)
+    float target = 0.0f;
+    bool releasing = false;  // handing over before isolation
+    bool handover = false;   // released by rampHandover(), switched once at 0 A
+    bool profiling = false;
+    ProfilingType type = ProfilingType::INCREASE;
+};
+
+struct ModuleSetpoint
+{
+    uint16_t module;
+    float current;
+};
+
+ModuleRamp rampState[49]; // 0 : Default , 1-48 : modules
+std::mutex rampMtx;       // ramp state only, never held together with mtx
+
+// Hardware hook : one call per control tick with every changed setpoint
+void (*setpointBatchSink)(const ModuleSetpoint* setpoints, size_t count) = nullptr;
+
+float connectorDemand(ConnectorType connector) {
+    const Connector& c = connectorArray[static_cast<int>(connector)];
+    if (!c.isActive) return 0.0f;
+    return (c.EVTargetCurrent > 0) ? c.EVTargetCurrent : c.EVMaxCurrent;
+}
+
+// Recomputes per module targets of a connector from the current ownership.
+// Called by the allocator side after any assignment / isolation.
+void rampRetarget(ConnectorType connector) {
+    if (connector == ConnectorType::DEFAULT) return;
+    float demand = connectorDemand(connector);
+
+    std::lock_guard<std::mutex> lock(rampMtx);
+    float capacity = 0.0f;
+    for (uint16_t i = 1; i < 49; i++) {
+        if (pmArray[i].Connector == connector && pmArray[i].isActive && pmArray[i].isAlive && !rampState[i].releasing) {
+            capacity += pmArray[i].MaxCurrent;
+        }
+    }
+    float delivered = std::min(demand, capacity);
+
+    // Split in proportion to MaxCurrent x thermal weight, capped at MaxCurrent;
+    // what a capped (hot) module cannot take goes to the others.
+    float share[49] = {};
+    bool capped[49] = {};
+    float remaining = delivered;
+    for (int pass = 0; pass < 48 && remaining > 0.01f; pass++) {
+        float weightSum = 0.0f;
+        for (uint16_t i = 1; i < 49; i++) {
+            if (pmArray[i].Connector == connector && pmArray[i].isActive && pmArray[i].isAlive && !rampState[i].releasing && !capped[i]) {
+                weightSum += pmArray[i].MaxCurrent * thermalWeight(i);
+            }
+        }
+        if (weightSum <= 0) break;
+        float assigned = 0.0f;
+        for (uint16_t i = 1; i < 49; i++) {
+            if (!(pmArray[i].Connector == connector && pmArray[i].isActive && pmArray[i].isAlive && !rampState[i].releasing && !capped[i])) continue;
+            float add = remaining * pmArray[i].MaxCurrent * thermalWeight(i) / weightSum;
+            if (share[i] + add >= pmArray[i].MaxCurrent) {
+                add = pmArray[i].MaxCurrent - share[i];
+                capped[i] = true;
+            }
+            share[i] += add;
+            assigned += add;
+        }
+        remaining -= assigned;
+    }
+
+    for (uint16_t i = 1; i < 49; i++) {
+        ModuleRamp& ramp = rampState[i];
+        bool owned = pmArray[i].Connector == connector && pmArray[i].isActive && pmArray[i].isAlive;
+        if (owned) {
+            if (ramp.owner != connector && ramp.handover) continue; // still handing over to its previous owner
+            if (ramp.owner != connector) ramp = ModuleRamp(); // newly assigned, starts from 0 A
+            ramp.owner = connector;
+            ramp.target = ramp.releasing ? 0.0f : share[i];
+        }
+        else if (ramp.owner == connector && !ramp.releasing) {
+            // isolated without handover : output is already gone
+            ramp = ModuleRamp();
+            commandedCurrent[i].store(0.0f, std::memory_order_relaxed);
+        }
+    }
+}
+
+void rampRetargetAll() {
+    for (int c = 1; c <= 12; c++) rampRetarget(static_cast<ConnectorType>(c));
+}
+
+// One control tick. Increases are applied first; decreases are limited so
+// the connector total never falls below min(current total, target total).
+void rampTick(float dt) {
+    std::vector<ModuleSetpoint> batch;
+    float step = RAMP_RATE_A_PER_S * dt;
+    {
+        std::lock_guard<std::mutex> lock(rampMtx);
+        for (int c = 1; c <= 12; c++) {
+            ConnectorType connector = static_cast<ConnectorType>(c);
+            float total = 0, totalTarget = 0, up = 0, down = 0;
+            for (uint16_t i = 1; i < 49; i++) {
+                const ModuleRamp& ramp = rampState[i];
+                if (ramp.owner != connector) continue;
+                total += ramp.setpoint;
+                totalTarget += ramp.target;
+                if (ramp.target > ramp.setpoint) up += std::min(step, ramp.target - ramp.setpoint);
+                else down += std::min(step, ramp.setpoint - ramp.target);
+            }
+            if (total == 0 && totalTarget == 0) continue;
+
+            float allowedDown = up + std::max(0.0f, total - totalTarget);
+            float downScale = (down > 0) ? std::min(1.0f, allowedDown / down) : 0.0f;
+
+            for (uint16_t i = 1; i < 49; i++) {
+                ModuleRamp& ramp = rampState[i];
+                if (ramp.owner != connector) continue;
+                float previous = ramp.setpoint;
+                if (ramp.target > ramp.setpoint) {
+                    ramp.setpoint = std::min(ramp.target, ramp.setpoint + step);
+                    ramp.type = ProfilingType::INCREASE;
+                }
+                else if (ramp.target < ramp.setpoint) {
+                    ramp.setpoint = std::max(ramp.target, ramp.setpoint - std::min(step, ramp.setpoint - ramp.target) * downScale);
+                    ramp.type = ProfilingType::DECREASE;
+                }
+                ramp.profiling = std::fabs(ramp.setpoint - ramp.target) > 0.01f;
+                if (!ramp.profiling) ramp.setpoint = ramp.target;
+                if (ramp.setpoint != previous) {
+                    batch.push_back({ i, ramp.setpoint });
+                    commandedCurrent[i].store(ramp.setpoint, std::memory_order_relaxed);
+                }
+            }
+        }
+    }
+    if (setpointBatchSink && !batch.empty()) setpointBatchSink(batch.data(), batch.size());
+}
+
+void rampLoop(std::atomic<bool>& run) {
+    auto next = std::chrono::steady_clock::now();
+    while (run) {
+        next += std::chrono::milliseconds(RAMP_TICK_MS);
+        std::this_thread::sleep_until(next);
+        rampTick(RAMP_TICK_MS / 1000.0f);
+    }
+}
+
+// Hands the current of a module node (or of the single module, wholeNode =
+// false) over to the rest of its connector before isolateModule() /
+// releaseModule() frees it. Returns at once : the next sequence opens its
+// switches once rampHandoversDone().
+void rampHandover(uint16_t module, bool wholeNode) {
+    ConnectorType connector = wholeNode ? nodeOwner(module) : pmArray[module].Connector;
+    if (connector == ConnectorType::DEFAULT) return;
+    uint16_t first = wholeNode ? nodeOf(module) : module;
+    uint16_t last = wholeNode ? first + 1 : module;
+    {
+        std::lock_guard<std::mutex> lock(rampMtx);
+        for (uint16_t i = first; i <= last && i < 49; i++) {
+            if (rampState[i].owner == connector) rampState[i].releasing = rampState[i].handover = true;
+        }
+    }
+    rampRetarget(connector);
+}
+
+// True once every rampHandover() module reached 0 A, which are then dropped
+// from the ramp (force : drop them anyway)
+bool rampHandoversDone(bool force = false) {
+    std::lock_guard<std::mutex> lock(rampMtx);
+    for (uint16_t i = 1; i < 49; i++) {
+        if (!force && rampState[i].handover && rampState[i].setpoint > 0.01f) return false;
+    }
+    for (uint16_t i = 1; i < 49; i++) {
+        if (!rampState[i].handover) continue;
+        rampState[i] = ModuleRamp();
+        commandedCurrent[i].store(0.0f, std::memory_order_relaxed);
+    }
+    return true;
+}
+
+// Starts ramping every module of a connector to 0 A, returns at once
+void rampBeginPowerDown(ConnectorType connector) {
+    std::lock_guard<std::mutex> lock(rampMtx);
+    for (uint16_t i = 1; i < 49; i++) {
+        if (rampState[i].owner == connector) {
+            rampState[i].releasing = true;
+            rampState[i].target = 0.0f;
+        }
+    }
+}
+
+// True once its releasing modules reached 0 A (force : drop them anyway)
+bool rampReleased(ConnectorType connector, bool force = false) {
+    std::lock_guard<std::mutex> lock(rampMtx);
+    for (uint16_t i = 1; i < 49; i++) {
+        if (!force && rampState[i].owner == connector && rampState[i].releasing && rampState[i].setpoint > 0.01f) return false;
+    }
+    for (uint16_t i = 1; i < 49; i++) {
+        if (rampState[i].owner != connector || !rampState[i].releasing) continue;
+        rampState[i] = ModuleRamp();
+        commandedCurrent[i].store(0.0f, std::memory_order_relaxed);
+    }
+    return true;
+}
+
+// True while a module of the connector is still moving towards its target
+bool rampProfiling(ConnectorType connector) {
+    std::lock_guard<std::mutex> lock(rampMtx);
+    for (uint16_t i = 1; i < 49; i++) {
+        if (rampState[i].owner == connector && rampState[i].profiling) return true;
+    }
+    return false;
+}
+
+// Nominal time for a full ramp of one module, twice, plus two ticks of margin
+uint32_t rampStepTimeoutMs() {
+    float worst = 0.0f;
+    for (uint16_t i = 1; i < 49; i++) worst = std::max(worst, pmArray[i].MaxCurrent);
+    return static_cast<uint32_t>(2000 * worst / RAMP_RATE_A_PER_S) + 2 * RAMP_TICK_MS;
+}
+
+// Mirrors ramp progress into pmArray (isProfilingOngoing / ProfileType)
+void syncRampStatus() {
+    std::lock_guard<std::mutex> lock(rampMtx);
+    for (uint16_t i = 1; i < 49; i++) {
+        pmArray[i].isProfilingOngoing = rampState[i].profiling;
+        pmArray[i].ProfileType = rampState[i].type;
+    }
+}
+
+//********************************   CURRENT RAMP ENGINE END   ********************************************************/
+
+
+//******************************************   SWITCHING SEQUENCES START   ******************************************************/
+
+// Physical switching runs as timed sequences : ramp down, wait, open relays /
+// muxes, let the contacts settle, close the new ones, settle, ramp up. Every
+// sequence is a C++20 coroutine resumed by a timer executor that the engine
+// thread polls, so the sequences of many connectors interleave on the engine
+// thread without blocking it or each other.
+// The allocator still changes ownership and the relay / mux tables at once;
+// physicalSwitch[] is what has actually been sent to switchingPlanSink, and a
+// step only sends the switches whose table state still wants that position,
+// so a sequence cancelled half way never leaves the hardware inconsistent.
+
+const uint32_t CONTACT_SETTLE_MS = 200;
+
+bool physicalSwitch[512] = {}; // by relay / mux id, commanded position
+
+struct SequenceControl
+{
+    const char* name = "";
+    uint16_t connectors = 0;     // bit per connector, for cancellation
+    bool cancellable = true;
+    bool cancelled = false;
+    bool done = false;
+    uint64_t waitToken = 0;      // 0 : running, else the timer it waits for
+    std::coroutine_handle<> handle;
+};
+
+class SequenceExecutor {
+public:
+    void schedule(const std::shared_ptr<SequenceControl>& control, uint64_t dueNs) {
+        control->waitToken = ++lastToken;
+        timers.push({ dueNs, control->waitToken, control });
+    }
+
+    // Resumes every sequence whose timer expired. Returns how many ran.
+    size_t runDue(uint64_t nowNs) {
+        size_t resumed = 0;
+        while (!timers.empty() && timers.top().dueNs <= nowNs) {
+            Timer timer = timers.top();
+            timers.pop();
+            if (timer.control->done || timer.token != timer.control->waitToken) continue; // woken earlier
+            timer.control->waitToken = 0;
+            timer.control->handle.resume();
+            resumed++;
+        }
+        return resumed;
+    }
+
+private:
+    struct Timer
+    {
+        uint64_t dueNs;
+        uint64_t token;
+        std::shared_ptr<SequenceControl> control;
+        bool operator>(const Timer& other) const { return dueNs > other.dueNs; }
+    };
+    std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers;
+    uint64_t lastToken = 0;
+};
+
+SequenceExecutor switchExecutor;                             // engine thread only
+std::vector<std::shared_ptr<SequenceControl>> activeSequences; // engine thread only
+bool connectorStopping[13] = {};                              // stop sequence running
+
+// Coroutine type of a sequence : created suspended, started by launchSequence(),
+// frame freed when the body returns
+struct SwitchSequence
+{
+    struct promise_type
+    {
+        std::shared_ptr<SequenceControl> control = std::make_shared<SequenceControl>();
+
+        SwitchSequence get_return_object() {
+            control->handle = std::coroutine_handle<promise_type>::from_promise(*this);
+            return SwitchSequence{ control };
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() { control->done = true; }
+        void unhandled_exception() {
+            control->done = true;
+            std::cerr << "[Sequence] " << control->name << " aborted by exception\n";
+        }
+    };
+
+    std::shared_ptr<SequenceControl> control;
+};
+
+// co_await sequenceSleep(ms) : false if the sequence was cancelled meanwhile
+struct SequenceSleep
+{
+    uint32_t ms;
+    std::shared_ptr<SequenceControl> control;
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<SwitchSequence::promise_type> handle) {
+        control = handle.promise().control;
+        switchExecutor.schedule(control, monotonicNs() + ms * 1000000ull);
+    }
+    bool await_resume() const noexcept { return !control->cancelled; }
+};
+
+SequenceSleep sequenceSleep(uint32_t ms) { return { ms, nullptr }; }
+
+void launchSequence(SwitchSequence sequence, const char* name, uint16_t connectors, bool cancellable = true) {
+    sequence.control->name = name;
+    sequence.control->connectors = connectors;
+    sequence.control->cancellable = cancellable;
+    activeSequences.push_back(sequence.control);
+    switchExecutor.schedule(sequence.control, monotonicNs());
+}
+
+// A stop arrived : running sequences of the connector give up at their next step
+void cancelSequences(ConnectorType connector) {
+    uint16_t bit = 1u << static_cast<int>(connector);
+    for (auto& control : activeSequences) {
+        if (control->done || !control->cancellable || !(control->connectors & bit)) continue;
+        std::cout << "\n[Sequence] Cancelling " << control->name << " of connector " << static_cast<int>(connector);
+        control->cancelled = true;
+        if (control->waitToken) switchExecutor.schedule(control, monotonicNs()); // wake now
+    }
+}
+
+void reapSequences() {
+    activeSequences.erase(std::remove_if(activeSequences.begin(), activeSequences.end(),
+        [](const std::shared_ptr<SequenceControl>& control) { return control->done; }), activeSequences.end());
+}
+
+bool sequencesRunning() {
+    return !activeSequences.empty();
+}
+
+// Switches whose table state differs from what was commanded : opens, closes
+std::pair<std::vector<uint16_t>, std::vector<uint16_t>> pendingSwitching() {
+    std::pair<std::vector<uint16_t>, std::vector<uint16_t>> pending;
+    for (const SwitchCommand& sw : captureSwitchState()) {
+        if (sw.id >= 512 || physicalSwitch[sw.id] == sw.on) continue;
+        (sw.on ? pending.second : pending.first).push_back(sw.id);
+    }
+    return pending;
+}
+
+// Sends the switches of `ids` that the tables still want in position `on`.
+// Returns true if anything was sent.
+bool actuateStep(const std::vector<uint16_t>& ids, bool on) {
+    std::vector<SwitchCommand> logical = captureSwitchState();
+    std::vector<SwitchCommand> step;
+    for (uint16_t id : ids) {
+        auto it = std::find_if(logical.begin(), logical.end(), [id](const SwitchCommand& sw) { return sw.id == id; });
+        if (it == logical.end() || it->on != on || physicalSwitch[id] == on) continue;
+        physicalSwitch[id] = on;
+        step.push_back({ id, on });
+    }
+    applySwitchingPlan(step);
+    return !step.empty();
+}
+
+// Nothing is opened under a module still handing over; past deadlineNs it is
+// dropped under load
+bool handoversReleased(uint64_t deadlineNs) {
+    if (rampHandoversDone()) return true;
+    if (monotonicNs() < deadlineNs) return false;
+    std::cerr << "[Sequence] Handover timed out, opening under load\n";
+    rampHandoversDone(true);
+    return true;
+}
+
+// Connectors of a trigger batch : contacts first, current only once closed
+SwitchSequence startSequence(std::vector<ConnectorType> connectors) {
+    uint64_t handoverDeadline = monotonicNs() + rampStepTimeoutMs() * 1000000ull;
+    while (!handoversReleased(handoverDeadline)) co_await sequenceSleep(RAMP_TICK_MS);
+    auto [opens, closes] = pendingSwitching();
+    if (actuateStep(opens, false) && !co_await sequenceSleep(CONTACT_SETTLE_MS)) co_return;
+    if (actuateStep(closes, true) && !co_await sequenceSleep(CONTACT_SETTLE_MS)) co_return;
+
+    for (ConnectorType connector : connectors) rampRetarget(connector);
+    uint64_t deadline = monotonicNs() + rampStepTimeoutMs() * 1000000ull;
+    for (ConnectorType connector : connectors) {
+        while (rampProfiling(connector)) {
+            if (monotonicNs() >= deadline) {
+                std::cerr << "[Sequence] Ramp up of connector " << static_cast<int>(connector) << " timed out\n";
+                break;
+            }
+            if (!co_await sequenceSleep(RAMP_TICK_MS)) co_return;
+        }
+    }
+}
+
+// Session end : ramp down, tear down, open, settle, then hand the freed
+// modules to waiting connectors. Not cancellable.
+SwitchSequence stopSequence(ConnectorType connector, uint64_t issuedNs) {
+    int c = static_cast<int>(connector);
+    rampBeginPowerDown(connector);
+    uint64_t deadline = monotonicNs() + rampStepTimeoutMs() * 1000000ull;
+    while (!rampReleased(connector)) {
+        if (monotonicNs() >= deadline) {
+            std::cerr << "[Sequence] Ramp down of connector " << c << " timed out, opening anyway\n";
+            rampReleased(connector, true);
+            break;
+        }
+        co_await sequenceSleep(RAMP_TICK_MS);
+    }
+
+    stopConnectorState(connector);
+    if (issuedNs) stopLatency.record((monotonicNs() - issuedNs) / 1000);
+    connectorArray[c].EVMaxVoltage = 0;
+    connectorArray[c].EVMaxCurrent = 0;
+    connectorStopping[c] = false;
+    releaseConnectorEvents(connector);
+
+    uint64_t handoverDeadline = monotonicNs() + rampStepTimeoutMs() * 1000000ull;
+    while (!handoversReleased(handoverDeadline)) co_await sequenceSleep(RAMP_TICK_MS);
+    auto [opens, closes] = pendingSwitching();
+    if (actuateStep(opens, false)) co_await sequenceSleep(CONTACT_SETTLE_MS);
+    if (actuateStep(closes, true)) co_await sequenceSleep(CONTACT_SETTLE_MS);
+    rampRetargetAll();
+}
+
+// Brings the hardware in line with the tables after an optimiser pass or a
+// fault reroute, once the modules it moves were handed over at 0 A.
+SwitchSequence flushSequence() {
+    uint64_t handoverDeadline = monotonicNs() + rampStepTimeoutMs() * 1000000ull;
+    while (!handoversReleased(handoverDeadline)) co_await sequenceSleep(RAMP_TICK_MS);
+    auto [opens, closes] = pendingSwitching();
+    if (actuateStep(opens, false)) co_await sequenceSleep(CONTACT_SETTLE_MS);
+    if (actuateStep(closes, true)) co_await sequenceSleep(CONTACT_SETTLE_MS);
+    rampRetargetAll();
+}
+
+//******************************************   SWITCHING SEQUENCES END   ******************************************************/
+
+//******************************************   STARTUP DISCOVERY START   ******************************************************/
+
+// Before charging, every module is identified and its ratings read, and every
+// relay / mux position is read back. Subsets sit on their own bus segment and
+// are probed in parallel, one job each : its modules, its chain's relays and
+// every mux of its two connectors. A finished subset is handed to the engine,
+// which reconciles probed against expected state (reconcileSubset) and makes
+// that subset's connectors available while the rest may still be probing.
+// Expected state comes from the warm start snapshot written by the persistence
+// thread; a module that identifies with the address it had in the snapshot
+// keeps the snapshot's ratings and is not read again. No session survives a
+// restart, so every switch found closed is opened.
+
+const uint32_t SNAPSHOT_MAGIC = 0x31534D50; // "PMS1"
+const uint16_t SNAPSHOT_VERSION = 1;
+
+struct ModuleProbe
+{
+    uint32_t moduleAddress = 0;
+    bool present = false;
+    float MaxVoltage = 0.0f;
+    float MaxCurrent = 0.0f;
+    float MinVoltage = 0.0f;
+    float MinCurrent = 0.0f;
+    float MaxPower = 0.0f;
+    float MinPower = 0.0f;
+    float MaxTemperature = 0.0f;
+};
+
+struct SnapshotHeader
+{
+    uint32_t magic;        // 'PMS1'
+    uint16_t version;
+    uint16_t moduleCount;  // ModuleProbe records, module 1 first
+    uint16_t switchCount;  // SwitchCommand records after the modules
+    uint64_t savedMs;      // wall clock
+    uint64_t checksum;     // FNV-1a of the records
+};
+
+// Hardware abstraction of the discovery bus. Calls block for one or more bus
+// transactions; jobs of different subsets call it concurrently.
+struct ProbeBackend
+{
+    bool (*identify)(uint16_t module, uint32_t& address); // false : no answer
+    bool (*readRatings)(uint16_t module, ModuleProbe& out);
+    bool (*readSwitch)(uint16_t id, bool& closed);        // feedback contact
+};
+
+// ------------ simulated backend ------------
+
+uint32_t simulatedBusTransactionUs = 2000;
+uint64_t simulatedAbsentModules = 0;              // bit = module id
+std::atomic<bool> simulatedSwitchClosed[512] = {}; // positions found at boot
+
+void simulatedTransaction(int count) {
+    std::this_thread::sleep_for(std::chrono::microseconds(simulatedBusTransactionUs * count));
+}
+
+bool simulatedIdentify(uint16_t module, uint32_t& address) {
+    simulatedTransaction(1);
+    if (simulatedAbsentModules & (1ull << module)) return false;
+    address = 0x100 + module;
+    return true;
+}
+
+bool simulatedReadRatings(uint16_t, ModuleProbe& out) {
+    simulatedTransaction(4); // voltage, current, power and temperature limits
+    out.MaxVoltage = 1000.0f;
+    out.MaxCurrent = 30.0f;
+    out.MinVoltage = 150.0f;
+    out.MinCurrent = 0.0f;
+    out.MaxPower = 30000.0f;
+    out.MaxTemperature = 75.0f;
+    return true;
+}
+
+bool simulatedReadSwitch(uint16_t id, bool& closed) {
+    simulatedTransaction(1);
+    closed = simulatedSwitchClosed[id].load(std::memory_order_relaxed);
+    return true;
+}
+
+ProbeBackend probeBackend{ simulatedIdentify, simulatedReadRatings, simulatedReadSwitch };
+
+// ------------ warm start snapshot ------------
+
+ModuleProbe snapshotModules[49];
+bool snapshotSwitchClosed[512] = {};
+bool warmSnapshotLoaded = false;
+// Modules that answered discovery, whatever their health; unverified ones keep
+// what the snapshot expected. Written by the engine, read by the persistence thread.
+std::atomic<uint64_t> modulePresentMask{ ~1ull };
+
+uint64_t snapshotChecksum(const std::vector<uint8_t>& records) {
+    uint64_t hash = 1469598103934665603ull; // FNV-1a
+    for (uint8_t b : records) hash = (hash ^ b) * 1099511628211ull;
+    return hash;
+}
+
+// Persistence thread : modules and switch positions of a published state,
+// written to a temporary file and renamed so a crash never leaves half a snapshot
+bool saveCabinetSnapshot(const std::string& filename, const ModuleStatus* modules, uint64_t presentMask,
+    const PmPairRelayMux* relays, size_t relayCount, const ConnectorPairMux* muxes, size_t muxCount) {
+    std::vector<uint8_t> records(48 * sizeof(ModuleProbe) + (relayCount + muxCount) * sizeof(SwitchCommand));
+    uint8_t* p = records.data();
+    for (uint16_t m = 1; m < 49; m++) {
+        ModuleProbe record{};
+        record.moduleAddress = modules[m].moduleAddress;
+        record.present = (presentMask >> m) & 1u; // a faulted module is still there
+        record.MaxVoltage = modules[m].MaxVoltage;
+        record.MaxCurrent = modules[m].MaxCurrent;
+        record.MinVoltage = modules[m].MinVoltage;
+        record.MinCurrent = modules[m].MinCurrent;
+        record.MaxPower = modules[m].MaxPower;
+        record.MinPower = modules[m].MinPower;
+        record.MaxTemperature = modules[m].MaxTemperature;
+        std::memcpy(p, &record, sizeof(record));
+        p += sizeof(record);
+    }
+    for (size_t i = 0; i < relayCount + muxCount; i++) {
+        SwitchCommand record = (i < relayCount) ? SwitchCommand{ relays[i].muxId, relays[i].status }
+                                                : SwitchCommand{ muxes[i - relayCount].muxId, muxes[i - relayCount].status };
+        std::memcpy(p, &record, sizeof(record));
+        p += sizeof(record);
+    }
+
+    SnapshotHeader header{ SNAPSHOT_MAGIC, SNAPSHOT_VERSION, 48, static_cast<uint16_t>(relayCount + muxCount),
+        static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count()),
+        snapshotChecksum(records) };
+    std::string temporary = filename + ".tmp";
+    {
+        std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+        if (!out.is_open()) return false;
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(records.data()), records.size());
+        if (!out) return false;
+    }
+    std::error_code ec;
+    std::filesystem::rename(temporary, filename, ec);
+    return !ec;
+}
+
+// Start up : fills the expected state and pmArray ratings from the snapshot.
+// False (cold start, compiled in defaults expected) if missing or corrupt.
+bool loadCabinetSnapshot(const std::string& filename) {
+    std::ifstream in(filename, std::ios::binary);
+    if (!in.is_open()) return false;
+
+    SnapshotHeader header{};
+    in.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!in || header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION || header.moduleCount != 48) {
+        std::cerr << "ERROR : ignoring snapshot " << filename << " : bad header\n";
+        return false;
+    }
+    std::vector<uint8_t> records(48 * sizeof(ModuleProbe) + header.switchCount * sizeof(SwitchCommand));
+    in.read(reinterpret_cast<char*>(records.data()), records.size());
+    if (!in || snapshotChecksum(records) != header.checksum) {
+        std::cerr << "ERROR : ignoring snapshot " << filename << " : truncated or corrupt\n";
+        return false;
+    }
+
+    const uint8_t* p = records.data();
+    for (uint16_t m = 1; m < 49; m++, p += sizeof(ModuleProbe)) {
+        std::memcpy(&snapshotModules[m], p, sizeof(ModuleProbe));
+        const ModuleProbe& record = snapshotModules[m];
+        if (!record.present) continue;
+        pmArray[m].moduleAddress = record.moduleAddress;
+        pmArray[m].MaxVoltage = record.MaxVoltage;
+        pmArray[m].MaxCurrent = record.MaxCurrent;
+        substitutedRatingMask &= ~(1ull << m);
+        pmArray[m].MinVoltage = record.MinVoltage;
+        pmArray[m].MinCurrent = record.MinCurrent;
+        pmArray[m].MaxPower = record.MaxPower;
+        pmArray[m].MinPower = record.MinPower;
+        pmArray[m].MaxTemperature = record.MaxTemperature;
+    }
+    std::fill(snapshotSwitchClosed, snapshotSwitchClosed + 512, false);
+    for (uint16_t i = 0; i < header.switchCount; i++, p += sizeof(SwitchCommand)) {
+        SwitchCommand record;
+        std::memcpy(&record, p, sizeof(record));
+        if (record.id < 512) snapshotSwitchClosed[record.id] = record.on;
+    }
+    warmSnapshotLoaded = true;
+    return true;
+}
+
+// ------------ probing ------------
+
+struct SubsetProbe
+{
+    std::vector<SwitchCommand> switches; // id, closed
+    uint16_t warmModules = 0;            // ratings taken from the snapshot
+    uint64_t elapsedNs = 0;
+};
+
+ModuleProbe probedModules[49];  // each written by the job of its subset only
+SubsetProbe subsetProbes[64];   // by subset id, handed over with SUBSET_VERIFIED
+uint16_t connectorAvailableMask = 0x1FFE; // engine thread only, cleared by beginDiscovery()
+std::atomic<uint64_t> startupMismatches{ 0 };
+std::atomic<uint64_t> subsetVerifiedNs[64] = {}; // when each subset became available
+
+// Start up, before the engine runs : nothing is usable until verified
+void beginDiscovery() {
+    connectorAvailableMask = 0;
+    for (auto& verified : subsetVerifiedNs) verified.store(0, std::memory_order_relaxed);
+    moduleVerifiedMask = 0;
+    uint64_t expected = 0;
+    for (uint16_t m = 1; m < 49; m++) {
+        pmArray[m].isAlive = false;
+        if (!warmSnapshotLoaded || snapshotModules[m].present) expected |= 1ull << m;
+    }
+    modulePresentMask.store(expected, std::memory_order_relaxed);
+}
+
+bool connectorAvailable(ConnectorType connector) {
+    return connectorAvailableMask & (1u << static_cast<int>(connector));
+}
+
+// Job of one subset : identify / read its modules, read back its switches
+void probeSubset(uint16_t subset) {
+    uint64_t begin = monotonicNs();
+    SubsetProbe& probe = subsetProbes[subset];
+    probe = SubsetProbe();
+
+    uint16_t first = RuntimeTopology::subsetModuleBegin(subset);
+    for (uint16_t m = first; m < first + RuntimeTopology::modulesPerSubset() && m < 49; m++) {
+        ModuleProbe& module = probedModules[m];
+        module = ModuleProbe();
+        uint32_t address = 0;
+        if (!probeBackend.identify(m, address)) continue;
+        if (warmSnapshotLoaded && snapshotModules[m].present && snapshotModules[m].moduleAddress == address) {
+            module = snapshotModules[m];
+            probe.warmModules++;
+        }
+        else if (!probeBackend.readRatings(m, module)) continue;
+        module.moduleAddress = address;
+        module.present = true;
+    }
+
+    auto readBack = [&probe](uint16_t id) {
+        bool closed = true; // unreadable : assume the unsafe position, reconcile opens it
+        if (!probeBackend.readSwitch(id, closed)) closed = true;
+        probe.switches.push_back({ id, closed });
+    };
+    for (uint16_t i = 0; i < relayMuxCount; i++) {
+        if ((relayMuxTable[i].pmA - 1) / RuntimeTopology::modulesPerSubset() + 1 == subset) readBack(relayMuxTable[i].muxId);
+    }
+    for (uint16_t i = 0; i < connectorMuxCount; i++) {
+        const ConnectorPairMux& mux = connectorPairMuxTable[i];
+        if (RuntimeTopology::subset(static_cast<uint16_t>(mux.connectorA)) == subset
+            || RuntimeTopology::subset(static_cast<uint16_t>(mux.connectorB)) == subset) readBack(mux.muxId);
+    }
+    probe.elapsedNs = monotonicNs() - begin;
+}
+
+// Engine thread : takes a probed subset into pmArray and the switch tables.
+// Returns the connectors that became available.
+uint16_t reconcileSubset(uint16_t subset) {
+    const SubsetProbe& probe = subsetProbes[subset];
+    uint16_t first = RuntimeTopology::subsetModuleBegin(subset);
+    uint16_t absent = 0;
+
+    for (uint16_t m = first; m < first + RuntimeTopology::modulesPerSubset() && m < 49; m++) {
+        const ModuleProbe& module = probedModules[m];
+        bool expected = !warmSnapshotLoaded || snapshotModules[m].present;
+        if (module.present != expected) {
+            startupMismatches.fetch_add(1, std::memory_order_relaxed);
+            std::cout << "\n[Startup] Module " << m << (module.present ? " answered, expected absent" : " did not answer");
+        }
+        moduleVerifiedMask |= 1ull << m;
+        pmArray[m].isAlive = module.present;
+        if (module.present) {
+            modulePresentMask.fetch_or(1ull << m, std::memory_order_relaxed);
+            heartbeatArmRequests.fetch_or(1ull << m, std::memory_order_relaxed); // must report from now on
+        }
+        else modulePresentMask.fetch_and(~(1ull << m), std::memory_order_relaxed);
+        if (!module.present) {
+            absent++;
+            continue;
+        }
+        pmArray[m].moduleAddress = module.moduleAddress;
+        pmArray[m].MaxVoltage = module.MaxVoltage;
+        pmArray[m].MaxCurrent = module.MaxCurrent;
+        substitutedRatingMask &= ~(1ull << m);
+        pmArray[m].MinVoltage = module.MinVoltage;
+        pmArray[m].MinCurrent = module.MinCurrent;
+        pmArray[m].MaxPower = module.MaxPower;
+        pmArray[m].MinPower = module.MinPower;
+        pmArray[m].MaxTemperature = module.MaxTemperature;
+    }
+
+    std::vector<SwitchCommand> opens;
+    for (const SwitchCommand& sw : probe.switches) {
+        bool expected = warmSnapshotLoaded && snapshotSwitchClosed[sw.id];
+        if (sw.on != expected) {
+            startupMismatches.fetch_add(1, std::memory_order_relaxed);
+            std::cout << "\n[Startup] Switch " << sw.id << " found " << (sw.on ? "closed" : "open") << ", expected " << (expected ? "closed" : "open");
+        }
+        if (sw.on) opens.push_back({ sw.id, false });
+        physicalSwitch[sw.id] = false;
+        if (int index = relayTableIndex(sw.id); index >= 0) setRelayStatus(relayMuxTable[index], false);
+        else if (int index = muxTableIndex(sw.id); index >= 0) setMuxStatus(connectorPairMuxTable[index], false);
+    }
+    applySwitchingPlan(opens);
+
+    uint16_t available = 0;
+    for (uint16_t c = 1; c <= 12; c++) {
+        if (RuntimeTopology::subset(c) == subset) available |= 1u << c;
+    }
+    connectorAvailableMask |= available;
+    subsetVerifiedNs[subset].store(monotonicNs(), std::memory_order_release);
+    evseLimitsStale = 0x1FFE;
+    planCacheClear();
+    moduleCapacityFreed = true;
+    std::cout << "\n[Startup] Subset " << subset << " verified in " << probe.elapsedNs / 1000000 << " ms ("
+        << probe.warmModules << " warm, " << absent << " absent), connectors";
+    forEachBit(available, [](int c) { std::cout << " " << c; });
+    std::cout << " available\n";
+    return available;
+}
+
+//******************************************   STARTUP DISCOVERY END   ******************************************************/
+
+//******************************************   ENGINE START   ******************************************************/
+
+// One engine thread owns all cabinet state (pmArray, connectorArray, relay /
+// mux tables, admission queue) and is its only writer. Everything else talks
+// to it through bounded lock-free queues :
+//  - in  : engineCommands (MPSC) - start / stop / update from the trigger
+//          thread, telemetry and fault events from the ingestion thread
+//  - out : persistenceResults / metricsResults (SPSC) - state snapshots for
+//          the JSON writer and the metrics updater
+// The optimisation pass runs on the engine thread every optimisePeriodMs of the
+// active configuration, switching sequences are resumed by the engine loop as
+// their timers expire.
+
+const uint32_t ENGINE_IDLE_SLEEP_US = 500;
+const uint32_t ENGINE_SPIN_US = 200;          // keeps polling this long after the last work
+const uint32_t ENGINE_SUBMIT_RETRY_US = 2000; // producer gives up after this when the queue is full
+
+enum class EngineCommandType : uint8_t
+{
+    START,
+    STOP,
+    UPDATE,
+    BATCH_END, // closes a trigger batch : starts are solved together
+    TELEMETRY, // new telemetry published, coalesced
+    FAULT,     // module alive state changed
+    SETPOINT,  // EVTargetCurrent / EVTargetVoltage, handled ahead of the ordered commands
+    SUBSET_VERIFIED // startup discovery of subset `module` finished, handled ahead too
+};
+
+struct EngineCommand
+{
+    EngineCommandType type;
+    ConnectorType connector = ConnectorType::DEFAULT;
+    float voltage = 0.0f;
+    float current = 0.0f;
+    uint8_t priority = 0;
+    uint16_t module = 0;  // FAULT, SUBSET_VERIFIED : subset id
+    bool alive = false;   // FAULT : new state
+    uint64_t issuedNs = 0;
+    uint32_t connectorEvent = 0; // shared memory events of the connector up to this one, 0 none
+    bool parked = false;         // waited for the connector's stop sequence (engine only)
+};
+
+// Sleeps while word == expected, at most timeoutUs. `shared` : the word lives in shared memory.
+void futexWait(std::atomic<uint32_t>& word, uint32_t expected, uint32_t timeoutUs, bool shared) {
+    timespec timeout{ static_cast<time_t>(timeoutUs / 1000000), static_cast<long>(timeoutUs % 1000000) * 1000 };
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), shared ? FUTEX_WAIT : FUTEX_WAIT_PRIVATE, expected, &timeout, nullptr, 0);
+}
+
+void futexWake(std::atomic<uint32_t>& word, bool shared) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), shared ? FUTEX_WAKE : FUTEX_WAKE_PRIVATE, INT32_MAX, nullptr, nullptr, 0);
+}
+
+MpscRing<EngineCommand, 256> engineCommands;
+std::atomic<uint32_t> engineDoorbell{ 0 };   // bumped per command, wakes an idle engine
+std::atomic<bool> engineSleeping{ false };
+std::atomic<uint64_t> engineCommandsHandled{ 0 };
+std::atomic<uint64_t> engineCommandsDropped{ 0 };
+std::atomic<bool> telemetryCommandPending{ false };
+
+// Producer side, any thread. Retries briefly when the queue is full.
+void wakeEngine() {
+    engineDoorbell.fetch_add(1);
+    if (engineSleeping.load()) futexWake(engineDoorbell, false);
+}
+
+bool submitEngineCommand(const EngineCommand& command) {
+    uint64_t deadline = monotonicNs() + ENGINE_SUBMIT_RETRY_US * 1000ull;
+    while (!engineCommands.push(command)) {
+        if (monotonicNs() > deadline) {
+            engineCommandsDropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        std::this_thread::yield();
+    }
+    wakeEngine();
+    return true;
+}
+
+// Cabinet state as published by the engine
+struct EngineResult
+{
+    uint64_t sequence = 0;
+    Connector connectors[13];
+    ModuleStatus modules[49];
+    PmPairRelayMux relays[64];
+    uint16_t relayCount = 0;
+    ConnectorPairMux muxes[64];
+    uint16_t muxCount = 0;
+};
+
+SpscRing<EngineResult, 4> persistenceResults;
+SpscRing<EngineResult, 4> metricsResults;
+
+// Called on the engine thread after the state changed or a shared memory
+// event was handled or the EVSE limits moved (publishConnectorLimits)
+void (*limitsPublishHook)() = nullptr;
+uint32_t connectorEventsHandled[13] = {};  // engine thread only
+uint32_t connectorEventsReceived[13] = {}; // engine thread only
+bool connectorEventsHeld[13] = {};         // a start / stop of the connector is not done yet
+bool connectorLimitsDirty = false;        // engine thread only
+
+// ------------ engine thread ------------
+
+// Acknowledges the connector's shared memory events once its start was
+// allocated or its stop sequence finished; events behind those wait with them
+void releaseConnectorEvents(ConnectorType connector) {
+    int c = static_cast<int>(connector);
+    connectorEventsHeld[c] = false;
+    if (connectorEventsHandled[c] == connectorEventsReceived[c]) return;
+    connectorEventsHandled[c] = connectorEventsReceived[c];
+    connectorLimitsDirty = true;
+}
+
+struct EngineBatch
+{
+    bool open = false;
+    std::vector<std::pair<ConnectorType, uint64_t>> starts; // connector, issuedNs
+};
+
+EngineBatch engineBatch;
+std::vector<std::pair<ConnectorType, uint64_t>> deferredStarts; // connectors not verified yet
+
+void openEngineBatch() {
+    if (engineBatch.open) return;
+    engineBatch.open = true;
+    applyTelemetry();
+}
+
+void closeEngineBatch() {
+    if (!engineBatch.open) return;
+    TRACE_SCOPE("runTriggerActions");
+
+    for (auto it = engineBatch.starts.begin(); it != engineBatch.starts.end();) {
+        if (connectorAvailable(it->first)) {
+            ++it;
+            continue;
+        }
+        std::cout << "Connector " << static_cast<int>(it->first) << " not verified yet, start deferred\n";
+        deferredStarts.push_back(*it);
+        it = engineBatch.starts.erase(it);
+    }
+
+    if (!engineBatch.starts.empty()) {
+        std::vector<ConnectorType> starts;
+        for (auto& start : engineBatch.starts) starts.push_back(start.first);
+        std::cout << "Assigning PM to " << starts.size() << " connector(s) as one batch\n";
+        assign_power_modules_batch(starts);
+        for (ConnectorType connector : starts) releaseConnectorEvents(connector);
+        uint64_t now = monotonicNs();
+        uint16_t mask = 0;
+        for (auto& [conn, issuedNs] : engineBatch.starts) {
+            mask |= 1u << static_cast<int>(conn);
+            triggerToAssignLatency.record((now - issuedNs) / 1000);
+        }
+        admissionUpdateAll(); // queued if it could not reach sufficientPower()
+        dispatchFreedCapacity();
+        launchSequence(startSequence(starts), "start", mask);
+    }
+    else {
+        admissionUpdateAll();
+        dispatchFreedCapacity();
+        launchSequence(flushSequence(), "flush", 0, false);
+    }
+    engineBatch = EngineBatch();
+}
+
+// A module failed (or came back) : reroute its connector right away
+void handleModuleFault(uint16_t module, bool alive) {
+    applyTelemetry();
+    planCacheClear(); // cached plans assumed the old health
+    if (alive) {
+        std::cout << "\n[Engine] Module " << module << " back alive";
+        moduleCapacityFreed = true;
+        dispatchFreedCapacity();
+        launchSequence(flushSequence(), "flush", 0, false);
+        return;
+    }
+    ConnectorType owner = pmArray[module].isActive ? pmArray[module].Connector : ConnectorType::DEFAULT;
+    std::cout << "\n[Engine] Module " << module << " failed, owner " << static_cast<int>(owner);
+    if (owner == ConnectorType::DEFAULT) return;
+    while (connectorDeficit(owner) > 0 && dispatchStep(owner)) {}
+    admissionUpdate(owner);
+    launchSequence(flushSequence(), "flush", 0, false); // ramps the owner back up once closed
+}
+
+// A subset passed startup discovery : take it in and run the starts that
+// waited for its connectors
+void handleSubsetVerified(uint16_t subset) {
+    uint16_t available = reconcileSubset(subset);
+    bool batchOpen = engineBatch.open; // its BATCH_END is still to come
+    openEngineBatch();
+    for (auto it = deferredStarts.begin(); it != deferredStarts.end();) {
+        if (!(available & (1u << static_cast<int>(it->first)))) {
+            ++it;
+            continue;
+        }
+        engineBatch.starts.push_back(*it);
+        it = deferredStarts.erase(it);
+    }
+    if (!batchOpen) closeEngineBatch(); // also hands the new modules to waiting connectors
+}
+
+// ------------ setpoint fast path ------------
+
+// The vehicle moves EVTargetCurrent / EVTargetVoltage many times a second.
+// Inside the band the owned modules can serve ([EVSEMinCurrent,
+// EVSEMaxCurrent] from updateEvseLimits()) a setpoint only redistributes the
+// ramp targets of those modules; relays and muxes are never touched. Demand
+// above the band escalates to dispatchStep(), at most once per holdoff so a
+// noisy target does not chase the topology. Demand below the band is not
+// escalated : the owned modules hold EVSEMinCurrent until the optimiser pass
+// removes modules, which it sizes on EVMaxCurrent, not on the target.
+
+const uint32_t SETPOINT_ESCALATE_HOLDOFF_MS = 1000;
+const float SETPOINT_BAND_MARGIN_A = 1.0f;
+
+uint64_t setpointEscalatedNs[13] = {}; // engine thread only
+
+// Returns true if the cabinet state changed (escalated)
+bool handleSetpoint(const EngineCommand& command) {
+    int c = static_cast<int>(command.connector);
+    Connector& connector = connectorArray[c];
+    connector.EVTargetCurrent = command.current;
+    connector.EVTargetVoltage = command.voltage;
+    if (!connector.isActive || connectorStopping[c]) return false; // applies once the session runs
+
+    if ((evseLimitsStale & (1u << c)) && updateEvseLimits(false)) connectorLimitsDirty = true; // pushed by the engine loop
+    float wanted = std::min(command.current, connector.EVMaxCurrent);
+    uint64_t now = monotonicNs();
+    if (wanted <= connector.EVSEMaxCurrent + SETPOINT_BAND_MARGIN_A
+        || now - setpointEscalatedNs[c] < SETPOINT_ESCALATE_HOLDOFF_MS * 1000000ull) {
+        rampRetarget(command.connector);
+        setpointFastCount.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    setpointEscalatedNs[c] = now;
+    setpointEscalatedCount.fetch_add(1, std::memory_order_relaxed);
+    bool grown = false;
+    while (connector.EVSEMaxCurrent < wanted && dispatchStep(command.connector)) {
+        deriveEvseLimits(c);
+        grown = true;
+    }
+    std::cout << "\n[Engine] Setpoint " << wanted << " A above the band of connector " << c
+        << (grown ? ", grown to " : ", stays at ") << connector.EVSEMaxCurrent << " A";
+    rampRetarget(command.connector);
+    if (!grown) return false;
+    connectorLimitsDirty = true;
+    launchSequence(flushSequence(), "flush", 0, false); // closes the new path, then ramps onto it
+    return true;
+}
+
+// ------------ configuration ------------
+
+// Engine thread (or start up before it) : swaps `next` in and brings the
+// cabinet in line with it. Modules still on the previous substitute rating
+// take the new one; their connectors are retargeted and re-admitted.
+void applyEngineConfig(const PmmConfig& next) {
+    ScopedLatency latency(configApplyLatency);
+    float previousRating = activeConfig.moduleRatedCurrent;
+    bool curveChanged = next.efficiencyCurve && next.efficiencyCurve != activeConfig.efficiencyCurve;
+    activeConfig = next;
+    std::cout << "[Config] Generation " << next.generation << " applied\n";
+
+    if (curveChanged) moduleEfficiencyCurve = *next.efficiencyCurve; // parsed and validated by reloadConfig()
+    heartbeatTimeoutMs.store(next.heartbeatTimeoutMs, std::memory_order_relaxed);
+    if (next.moduleRatedCurrent == previousRating) return;
+
+    forEachBit(substitutedRatingMask, [&next](int m) { pmArray[m].MaxCurrent = next.moduleRatedCurrent; });
+    evseLimitsStale = 0x1FFE;
+    planCacheClear();
+    rampRetargetAll();
+    moduleCapacityFreed = true; // a higher rating may satisfy waiting connectors
+    admissionUpdateAll();
+    dispatchFreedCapacity();
+    launchSequence(flushSequence(), "flush", 0, false);
+}
 
-        std::cout << "[Worker] Starting optimization cycle...\n";
+// A start or update for a connector whose stop sequence still runs waits for it
+bool commandWaits(const EngineCommand& command) {
+    if (command.type != EngineCommandType::START && command.type != EngineCommandType::UPDATE) return false;
+    return connectorStopping[static_cast<int>(command.connector)];
+}
 
-        {
-            std::unique_lock<std::mutex> lock(mtx);
-            workerRunning = true;
-            workerSleeping = false;
+// Returns true if the cabinet state changed
+bool handleEngineCommand(const EngineCommand& command) {
+    int c = static_cast<int>(command.connector);
+    if (command.connectorEvent) {
+        connectorEventsReceived[c] = command.connectorEvent;
+        if (command.type == EngineCommandType::START || command.type == EngineCommandType::STOP) connectorEventsHeld[c] = true;
+        if (!connectorEventsHeld[c]) releaseConnectorEvents(command.connector);
+    }
+    switch (command.type) {
+    case EngineCommandType::START:
+        openEngineBatch();
+        connectorArray[c].EVMaxVoltage = command.voltage;
+        connectorArray[c].EVMaxCurrent = command.current;
+        connectorPriority[c] = command.priority; // a setpoint that arrived first keeps its target
+        if (std::none_of(engineBatch.starts.begin(), engineBatch.starts.end(), [&](const auto& start) { return start.first == command.connector; })) {
+            engineBatch.starts.push_back({ command.connector, command.issuedNs }); // a repeated START only updates the demand
+        }
+        return false; // solved at BATCH_END
+    case EngineCommandType::STOP:
+        openEngineBatch();
+        connectorArray[c].EVTargetCurrent = 0.0f; // session over : a later setpoint belongs to the next one
+        connectorArray[c].EVTargetVoltage = 0.0f;
+        std::erase_if(engineBatch.starts, [&](const auto& start) { return start.first == command.connector; });
+        std::erase_if(deferredStarts, [&](const auto& start) { return start.first == command.connector; });
+        cancelSequences(command.connector);
+        if (connectorStopping[c]) return false; // acknowledged when the running stop completes
+        if (!connectorStatus(command.connector)) {
+            releaseConnectorEvents(command.connector);
+            return false;
         }
+        connectorStopping[c] = true;
+        launchSequence(stopSequence(command.connector, command.issuedNs), "stop", 1u << c, false);
+        return false; // state changes when the ramp down completed
+    case EngineCommandType::UPDATE:
+        openEngineBatch();
+        connectorArray[c].EVMaxVoltage = command.voltage;
+        connectorArray[c].EVMaxCurrent = command.current;
+        rampRetarget(command.connector);
+        admissionUpdate(command.connector);
+        return true;
+    case EngineCommandType::BATCH_END:
+        if (!engineBatch.open) return false;
+        closeEngineBatch();
+        return true;
+    case EngineCommandType::TELEMETRY:
+        telemetryCommandPending.store(false, std::memory_order_relaxed);
+        applyTelemetry();
+        return false;
+    case EngineCommandType::FAULT:
+        handleModuleFault(command.module, command.alive);
+        return true;
+    case EngineCommandType::SETPOINT:
+        return handleSetpoint(command);
+    case EngineCommandType::SUBSET_VERIFIED:
+        handleSubsetVerified(command.module);
+        return true;
+    }
+    return false;
+}
+
+void runOptimisePass() {
+    std::cout << "[Engine] Starting optimization cycle...\n";
+    ScopedLatency latency(optimiseLatency);
+    TRACE_SCOPE("optimise_pass");
+    beginOptimiserCycle();
+    applyTelemetry();
+    printModuleStatus();
+    if (whatIfRebalance()) { // best of many candidate plans replaces this cycle's local moves
+        defragmentCabinet();
+        admissionUpdateAll();
+        optimiseCycleCount.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    for (int i = 1; i <= 12; i++) {
+        std::cout << "[Engine] removing Extra Modules from Connector " << i << "...\n";
+        opt_removeModules(static_cast<ConnectorType>(i));
+    }
+    dispatchFreedCapacity();
+    printModuleStatus();
+
+    for (int i = 1; i <= 3; i++) {
+        std::cout << "[Engine] assigning Modules : Iteration  " << i << "...\n";
+        opt_assignModules(i);
+    }
+
+    for (int i = 1; i <= 12; i++) {
+        std::cout << "[Engine] assigning extra Modules to Connector " << i << "...\n";
+        assign_extra_modules(static_cast<ConnectorType>(i));
+    }
+
+    defragmentCabinet();
+    admissionUpdateAll(); // ramps follow in the flush sequence, once switched
+    optimiseCycleCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+void captureEngineResult(EngineResult& result) {
+    syncRampStatus();
+    static uint64_t sequence = 0;
+    result.sequence = ++sequence;
+    std::copy(connectorArray, connectorArray + 13, result.connectors);
+    std::copy(pmArray, pmArray + 49, result.modules);
+    result.relayCount = std::min<uint16_t>(relayMuxCount, 64);
+    std::copy(relayMuxTable, relayMuxTable + result.relayCount, result.relays);
+    result.muxCount = std::min<uint16_t>(connectorMuxCount, 64);
+    std::copy(connectorPairMuxTable, connectorPairMuxTable + result.muxCount, result.muxes);
+}
 
-        // Do work
-        printModuleStatus();
-        for (int i = 1; i <= 12; i++) {
-            std::cout << "[Worker] removing Extra Modules from Connector " << i << "...\n";
-            opt_removeModules(static_cast<ConnectorType>(i));
+void engineLoop(std::atomic<bool>& run) {
+    traceThreadName("engine");
+    static EngineResult latest; // engine only
+    bool persistPending = false, metricsPending = false;
+    std::deque<EngineCommand> pending; // popped, in order; a connector's commands wait for its stop sequence
+    auto lastCycle = std::chrono::steady_clock::now();
+    uint64_t nextOptimiseNs = 0; // first pass right away
+    uint64_t nextEvseRefreshNs = 0;
+    uint64_t lastWorkNs = 0;
+
+    while (run) {
+        bool changed = false;
+        bool worked = false;
+        if (configGeneration.load(std::memory_order_acquire) > activeConfig.generation) {
+            applyEngineConfig(*configSnapshot()); // between two passes : no command sees a mix
+            changed = worked = true;
         }
-        printModuleStatus();
 
+        EngineCommand command;
+        while (engineCommands.pop(command)) {
+            worked = true;
+            if (command.type != EngineCommandType::SETPOINT && command.type != EngineCommandType::SUBSET_VERIFIED) {
+                pending.push_back(command);
+                continue;
+            }
+            changed |= handleEngineCommand(command); // never waits behind a stop sequence
+            engineCommandsHandled.fetch_add(1, std::memory_order_relaxed);
+        }
+        worked |= !pending.empty();
+        uint16_t parked = 0; // connectors whose commands wait, in order, behind their stop sequence
+        for (auto it = pending.begin(); it != pending.end();) {
+            uint16_t bit = 1u << static_cast<int>(it->connector);
+            if (commandWaits(*it) || (parked & bit)) {
+                parked |= bit;
+                it->parked = true;
+                ++it;
+                continue;
+            }
+            bool batchOpen = engineBatch.open;
+            changed |= handleEngineCommand(*it);
+            if (it->parked && !batchOpen && engineBatch.open) { // its BATCH_END went ahead without it
+                closeEngineBatch();
+                changed = true;
+            }
+            engineCommandsHandled.fetch_add(1, std::memory_order_relaxed);
+            it = pending.erase(it);
+        }
 
-        for (int i = 1; i <= 3; i++) {
-            std::cout << "[Worker] assigning Modules : Iteration  " << i << "...\n";
-            opt_assignModules(i);
+        if (switchExecutor.runDue(monotonicNs()) > 0) {
+            reapSequences();
+            changed = worked = true;
         }
 
-        for (int i = 1; i <= 12; i++) {
-            std::cout << "[Worker] removing Extra Modules from Connector " << i << "...\n";
-            assign_extra_modules(static_cast<ConnectorType>(i));
+        uint64_t now = monotonicNs();
+        if (now >= nextOptimiseNs && !sequencesRunning() && !engineBatch.open) {
+            runOptimisePass();
+            launchSequence(flushSequence(), "flush", 0, false);
+            auto cycleEnd = std::chrono::steady_clock::now();
+            accumulateEfficiencySavings(std::chrono::duration<double, std::ratio<3600>>(cycleEnd - lastCycle).count());
+            lastCycle = cycleEnd;
+            std::cout << "[Engine] Efficiency policy : estimated " << estimatedKWhSavedPerDay() << " kWh/day saved\n";
+            nextOptimiseNs = monotonicNs() + activeConfig.optimisePeriodMs * 1000000ull;
+            changed = worked = true;
         }
 
-        //saving to json file
-        saveConnectorArrayToJson("json_data/connectors.json");
-        createModuleStatusJson("json_data/modules.json");
-        createMuxRelayJson("json_data/mux.json");
-        createConnectorModuleJson("json_data/connector_modules.json");
+        bool refreshPresent = now >= nextEvseRefreshNs;
+        if (refreshPresent) {
+            applyTelemetry();
+            markDeratedConnectors();
+            nextEvseRefreshNs = now + EVSE_REFRESH_MS * 1000000ull;
+        }
+        if (updateEvseLimits(refreshPresent)) connectorLimitsDirty = true;
 
-        {
-            std::unique_lock<std::mutex> lock(mtx);
-            workerRunning = false;
-            workerSleeping = true;
-            cv.notify_all(); // notify trigger that worker is sleeping
+        if (changed) {
+            publishActiveModules();
+            captureEngineResult(latest);
+            persistPending = metricsPending = true;
+        }
+        if ((changed || connectorLimitsDirty) && limitsPublishHook) limitsPublishHook(); // vehicle side first
+        connectorLimitsDirty = false;
+        // consumers only need the newest state : retry until it fits
+        if (persistPending && persistenceResults.push(latest)) persistPending = false;
+        if (metricsPending && metricsResults.push(latest)) metricsPending = false;
+
+        if (worked) lastWorkNs = monotonicNs();
+        else if (monotonicNs() - lastWorkNs <= ENGINE_SPIN_US * 1000ull) std::this_thread::yield();
+        else {
+            engineSleeping.store(true);
+            uint32_t bell = engineDoorbell.load();
+            if (engineCommands.empty()) futexWait(engineDoorbell, bell, ENGINE_IDLE_SLEEP_US, false); // a submit wakes it at once
+            engineSleeping.store(false);
         }
+    }
+}
+
+// ------------ producers ------------
+
+// Installed as telemetryBatchHook : runs on the ingestion thread
+void engineTelemetryHook(uint64_t touched, uint64_t aliveMask) {
+    static uint64_t lastAliveMask = ~0ull; // ingestion thread only
+    uint64_t changedMask = (aliveMask ^ lastAliveMask) & touched & ~1ull; // only reported / expired modules change
+    lastAliveMask ^= changedMask;
+    for (uint16_t m = 1; m < 49; m++) {
+        if (!(changedMask & (1ull << m))) continue;
+        EngineCommand command{ EngineCommandType::FAULT };
+        command.module = m;
+        command.alive = (aliveMask >> m) & 1u;
+        command.issuedNs = monotonicNs();
+        submitEngineCommand(command);
+    }
+    if (!telemetryCommandPending.exchange(true, std::memory_order_relaxed)) {
+        EngineCommand command{ EngineCommandType::TELEMETRY };
+        command.issuedNs = monotonicNs();
+        if (!submitEngineCommand(command)) telemetryCommandPending.store(false, std::memory_order_relaxed);
+    }
+}
+
+// Turns the actions of trigger.json into engine commands, closed by one
+// BATCH_END. Actions that could not be queued are left for the next poll.
+// Returns true if any action was taken.
+bool submitTriggerActions(json& trig) {
+    uint64_t detectedNs = monotonicNs();
+    bool modified = false;
+
+    for (auto& kv : trig.items()) {
+        auto& key = kv.key();
+        auto& val = kv.value();
+
+        std::string action = val.value("action", "none");
+        int voltage = val.value("EVMaxVoltage", 0);
+        int current = val.value("EVMaxCurrent", 0);
+
+        std::cout << "[Trigger] " << key
+            << " action=" << action
+            << " V=" << voltage
+            << " I=" << current << "\n";
+
+        if (action == "none") continue;
 
-        // Sleep for 60s (can be interrupted by running flag)
-        for (int i = 0; i < 20 && running; i++) {
-            std::this_thread::sleep_for(std::chrono::seconds(1));
+        EngineCommand command{ EngineCommandType::START };
+        if (action == "stop") command.type = EngineCommandType::STOP;
+        else if (action == "update") command.type = EngineCommandType::UPDATE;
+        else if (action == "setpoint") command.type = EngineCommandType::SETPOINT;
+        else if (action != "start") continue;
+        command.connector = stringToConnector(key);
+        command.voltage = static_cast<float>(voltage);
+        command.current = static_cast<float>(current);
+        if (command.type == EngineCommandType::SETPOINT) {
+            command.voltage = val.value("EVTargetVoltage", 0.0f);
+            command.current = val.value("EVTargetCurrent", 0.0f);
         }
+        command.priority = val.value("priority", 0);
+        command.issuedNs = detectedNs;
+        if (!submitEngineCommand(command)) continue;
+
+        triggerActionCount.fetch_add(1, std::memory_order_relaxed);
+        // Reset action after handling
+        val["action"] = "none";
+        modified = true;
     }
+
+    if (modified) submitEngineCommand({ EngineCommandType::BATCH_END });
+    return modified;
 }
 
 // ---- Trigger Thread ----
 void triggerListener() {
+    traceThreadName("trigger");
     while (running) {
-        std::this_thread::sleep_for(std::chrono::seconds(5)); // poll every 5s
+        std::shared_ptr<const PmmConfig> config = configSnapshot();
+        std::this_thread::sleep_for(std::chrono::milliseconds(config->triggerPollMs));
 
         std::cout << "[Trigger] Checking for trigger actions...\n";
 
-        std::ifstream in("json_data/trigger.json");
+        std::ifstream in(config->triggerPath);
         if (!in) continue;
 
         json trig;
@@ -1525,39 +6396,729 @@ void triggerListener() {
         catch (...) {
             continue; // skip malformed json
         }
+        in.close();
 
-        bool hasWork = false;
-        for (auto& [key, val] : trig.items()) {
-            if (val.value("action", "none") != "none") {
-                hasWork = true;
-                break;
+        // If we modified anything, write back to file
+        if (submitTriggerActions(trig)) {
+            std::ofstream out(config->triggerPath);
+            if (out) {
+                out << std::setw(4) << trig;  // pretty print with 4 spaces
+            }
+            std::cout << "[Trigger] Actions queued to engine.\n";
+        }
+    }
+}
+
+// Startup discovery : one probe job per subset, each hands its result to the engine
+std::vector<std::thread> startDiscovery() {
+    std::vector<std::thread> jobs;
+    for (uint16_t subset = 1; subset <= runtimeCabinet.subsets; subset++) {
+        jobs.emplace_back([subset] {
+            traceThreadName("discovery");
+            probeSubset(subset);
+            EngineCommand command{ EngineCommandType::SUBSET_VERIFIED };
+            command.module = subset;
+            command.issuedNs = monotonicNs();
+            while (!submitEngineCommand(command)) {} // the engine must see every subset
+        });
+    }
+    return jobs;
+}
+
+// --bench-startup : cold discovery, then a warm one from the snapshot the
+// cold pass left, with the time each subset's connectors became available
+int benchStartup() {
+    std::cout << "[Bench] Startup discovery : " << runtimeCabinet.subsets << " subsets in parallel, "
+        << simulatedBusTransactionUs << " us per bus transaction\n";
+    std::string snapshot = (std::filesystem::temp_directory_path() / "pmm_bench.snapshot").string();
+    std::filesystem::remove(snapshot);
+    simulatedSwitchClosed[203] = true; // left closed by the previous run
+    simulatedAbsentModules = 1ull << 13;
+
+    auto pass = [&](const char* label) {
+        warmSnapshotLoaded = false;
+        bool warm = loadCabinetSnapshot(snapshot);
+        beginDiscovery();
+        std::cout.setstate(std::ios::failbit); // engine chatter
+        std::atomic<bool> run{ true };
+        std::thread engine(engineLoop, std::ref(run));
+        uint64_t begin = monotonicNs();
+        std::vector<std::thread> jobs = startDiscovery();
+        for (auto& job : jobs) job.join();
+        auto verified = [] {
+            for (uint16_t s = 1; s <= runtimeCabinet.subsets; s++) if (!subsetVerifiedNs[s].load()) return false;
+            return true;
+        };
+        while (!verified()) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        run = false;
+        engine.join();
+        std::cout.clear();
+
+        uint64_t first = UINT64_MAX, last = 0, serial = 0;
+        for (uint16_t s = 1; s <= runtimeCabinet.subsets; s++) {
+            first = std::min(first, subsetVerifiedNs[s].load() - begin);
+            last = std::max(last, subsetVerifiedNs[s].load() - begin);
+            serial += subsetProbes[s].elapsedNs;
+        }
+        std::cout << label << (warm ? " (snapshot) " : " (no snapshot) ") << ": first connectors after " << first / 1000000
+            << " ms, whole cabinet after " << last / 1000000 << " ms, serial probing " << serial / 1000000 << " ms\n";
+        saveCabinetSnapshot(snapshot, pmArray, modulePresentMask.load(), relayMuxTable, relayMuxCount, connectorPairMuxTable, connectorMuxCount);
+    };
+    pass("Cold start");
+    simulatedSwitchClosed[203] = false; // opened by the cold pass
+    pass("Warm start");
+    std::cout << "Mismatches     : " << startupMismatches.load() << "\n";
+    std::filesystem::remove(snapshot);
+    return 0;
+}
+
+// Re-reads CONFIG_PATH whenever its modification time, or the one of the
+// efficiency curve it names, changes
+void configWatchLoop(std::atomic<bool>& run) {
+    traceThreadName("config");
+    int64_t seen = fileStamp(CONFIG_PATH); // loaded by main
+    int64_t seenCurve = configSnapshot()->efficiencyStamp;
+    while (run) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(CONFIG_POLL_MS));
+        int64_t stamp = fileStamp(CONFIG_PATH);
+        int64_t curveStamp = fileStamp(configSnapshot()->efficiencyPath);
+        if ((stamp == 0 || stamp == seen) && curveStamp == seenCurve) continue;
+        std::cout << "[Config] " << (stamp != seen ? CONFIG_PATH : configSnapshot()->efficiencyPath.c_str()) << " changed, reloading\n";
+        if (stamp != 0) seen = stamp;
+        seenCurve = curveStamp;
+        if (reloadConfig(CONFIG_PATH)) {
+            seenCurve = configSnapshot()->efficiencyStamp;
+            wakeEngine();
+        }
+    }
+}
+
+// --bench-config : engine round trip of setpoint commands while the
+// configuration is reloaded every `reloadMs`, against a quiet baseline
+int benchConfigReload(int rounds = 2000, int reloadMs = 5) {
+    std::cout << "[Bench] Configuration reload : " << rounds << " setpoints per phase, reload every " << reloadMs << " ms\n";
+    std::filesystem::path dir = std::filesystem::temp_directory_path();
+    std::string files[2] = { (dir / "pmm_bench_config_a.json").string(), (dir / "pmm_bench_config_b.json").string() };
+    std::ofstream(files[0]) << R"({"moduleRatedCurrent": 30, "extraPowerMarginA": 60, "triggerPollMs": 5000})";
+    std::ofstream(files[1]) << R"({"moduleRatedCurrent": 32, "extraPowerMarginA": 64, "triggerPollMs": 4000})";
+
+    std::cout.setstate(std::ios::failbit); // engine chatter
+    std::atomic<bool> run{ true };
+    std::thread engine(engineLoop, std::ref(run));
+    EngineCommand start{ EngineCommandType::START, ConnectorType::Connector1, 400.0f, 120.0f };
+    submitEngineCommand(start);
+    submitEngineCommand({ EngineCommandType::BATCH_END });
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+
+    auto phase = [&](bool reloading) -> std::string {
+        std::atomic<bool> reload{ reloading };
+        std::thread reloader([&] {
+            for (int i = 0; reload; i++) {
+                if (reloadConfig(files[i % 2])) wakeEngine();
+                std::this_thread::sleep_for(std::chrono::milliseconds(reloadMs));
+            }
+        });
+        std::vector<uint64_t> latencyUs;
+        for (int i = 0; i < rounds; i++) {
+            EngineCommand setpoint{ EngineCommandType::SETPOINT, ConnectorType::Connector1, 400.0f, 40.0f + (i % 8) * 10.0f };
+            uint64_t handled = engineCommandsHandled.load();
+            uint64_t begin = monotonicNs();
+            if (!submitEngineCommand(setpoint)) continue;
+            while (engineCommandsHandled.load() == handled) std::this_thread::yield();
+            latencyUs.push_back((monotonicNs() - begin) / 1000);
+            std::this_thread::sleep_for(std::chrono::microseconds(500));
+        }
+        reload = false;
+        reloader.join();
+        std::sort(latencyUs.begin(), latencyUs.end());
+        auto pct = [&](double p) { return latencyUs.empty() ? 0 : latencyUs[static_cast<size_t>(p * (latencyUs.size() - 1))]; };
+        return "p50=" + std::to_string(pct(0.50)) + " p99=" + std::to_string(pct(0.99)) + " max=" + std::to_string(pct(1.0)) + " us";
+    };
+
+    uint64_t reloadsBefore = configReloads.load();
+    std::string baseline = phase(false);
+    std::string reloading = phase(true);
+    run = false;
+    engine.join();
+    std::cout.clear();
+
+    std::cout << "Baseline       : " << baseline << "\n";
+    std::cout << "Reloading      : " << reloading << "\n";
+
+    uint64_t applied = configApplyLatency.total.load();
+    std::cout << "Reloads        : " << configReloads.load() - reloadsBefore << " published, " << applied << " applied by the engine\n";
+    std::cout << "Apply (us)     : mean=" << (applied ? configApplyLatency.sumUs.load() / applied : 0) << "\n";
+    for (const std::string& file : files) std::filesystem::remove(file);
+    return 0;
+}
+
+// ------------ consumers ------------
+
+// Writes the newest published state to the JSON files
+void persistenceLoop(std::atomic<bool>& run) {
+    traceThreadName("persistence");
+    static EngineResult result; // persistence thread only
+    while (run) {
+        bool have = false;
+        while (persistenceResults.pop(result)) have = true;
+        if (!have) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            continue;
+        }
+        TRACE_SCOPE("json_write");
+        std::shared_ptr<const PmmConfig> config = configSnapshot();
+        saveConnectorArrayToJson(config->connectorsPath, result.connectors);
+        createModuleStatusJson(config->modulesPath, result.modules);
+        createMuxRelayJson(config->muxPath, result.relays, result.relayCount, result.muxes, result.muxCount);
+        createConnectorModuleJson(config->connectorModulesPath, result.modules);
+        saveCabinetSnapshot(config->snapshotPath, result.modules, modulePresentMask.load(std::memory_order_relaxed), result.relays, result.relayCount, result.muxes, result.muxCount);
+    }
+}
+
+void metricsResultLoop(std::atomic<bool>& run) {
+    static EngineResult result; // metrics result thread only
+    while (run) {
+        bool have = false;
+        while (metricsResults.pop(result)) have = true;
+        if (have) updateConnectorMetrics(result.modules, result.connectors);
+        else std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+}
+
+//******************************************   ENGINE END   ******************************************************/
+
+//******************************************   CONNECTOR SHARED MEMORY START   ******************************************************/
+
+// Zero-copy exchange with the ConnectorModule processes through one POSIX
+// shared memory object with a fixed, versioned layout : a channel per
+// connector holding
+//  - events : SPSC ring of start / stop / update actions (ConnectorModule -> PMM), lossless
+//  - demand : seqlock mailbox with the latest EV limits and targets (ConnectorModule -> PMM)
+//  - limits : seqlock mailbox with the EVSE limits (PMM -> ConnectorModule),
+//             republished by the engine after every state change
+// connectors.json / trigger.json keep working alongside.
+// --connector-standin runs a local ConnectorModule against a running PMM.
+
+const char* CONNECTOR_SHM_NAME = "/pmm_connectors";
+const uint32_t CONNECTOR_SHM_MAGIC = 0x504D4D43; // "PMMC"
+const uint16_t CONNECTOR_SHM_VERSION = 1;
+const uint32_t CONNECTOR_EVENT_SLOTS = 16;       // per connector, power of two
+const uint32_t CONNECTOR_SHM_SPIN_US = 200;      // busy polling after the last event
+const uint32_t CONNECTOR_SHM_IDLE_US = 100000;   // then sleeps on the doorbell
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free && std::atomic<uint64_t>::is_always_lock_free,
+    "shared memory atomics must be lock free");
+
+enum class ConnectorAction : uint8_t
+{
+    NONE,
+    START,
+    STOP,
+    UPDATE
+};
+
+// ConnectorModule -> PMM
+struct ConnectorDemand
+{
+    uint8_t action;            // ConnectorAction, events only
+    uint8_t priority;
+    uint8_t controlPilotState; // PLCModule::ControlPilotState
+    uint8_t stateMachineState; // PLCModule::StateMachineState
+    float EVMaxCurrent;
+    float EVMaxVoltage;
+    float EVTargetCurrent;
+    float EVTargetVoltage;
+    float EVMaxPower;
+    uint64_t publishedNs;      // CLOCK_MONOTONIC
+};
+
+// PMM -> ConnectorModule
+struct ConnectorLimits
+{
+    uint8_t isActive;
+    float EVSEMaxCurrent;
+    float EVSEMaxVoltage;
+    float EVSEMinCurrent;
+    float EVSEMinVoltage;
+    float EVSEPresentCurrent;
+    float EVSEPresentVoltage;
+    float EVSEMaxPower;
+    float allocatedCurrent;    // MaxCurrent of the owned alive modules
+    uint32_t eventsHandled;    // events of this channel the engine has acted on
+    uint64_t publishedNs;
+};
+
+// Single writer seqlock, readers retry while a write is in flight
+template <typename T>
+struct alignas(64) ShmSeqlock
+{
+    std::atomic<uint32_t> seq;
+    T value;
+
+    void write(const T& v) {
+        uint32_t s = seq.load(std::memory_order_relaxed);
+        seq.store(s + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        std::memcpy(&value, &v, sizeof(T));
+        seq.store(s + 2, std::memory_order_release);
+    }
+
+    bool read(T& out) const {
+        uint32_t s = seq.load(std::memory_order_acquire);
+        if (s & 1u) return false;
+        std::memcpy(&out, &value, sizeof(T));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return seq.load(std::memory_order_relaxed) == s;
+    }
+};
+
+struct alignas(64) ConnectorChannel
+{
+    alignas(64) std::atomic<uint32_t> eventHead; // written by the ConnectorModule
+    alignas(64) std::atomic<uint32_t> eventTail; // written by the PMM
+    ConnectorDemand events[CONNECTOR_EVENT_SLOTS];
+    ShmSeqlock<ConnectorDemand> demand;
+    ShmSeqlock<ConnectorLimits> limits;
+};
+
+struct ConnectorShmLayout
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t connectorCount;
+    uint32_t layoutSize;
+    alignas(64) std::atomic<uint32_t> doorbell;  // rung by ConnectorModules after a write
+    std::atomic<uint32_t> pmmSleeping;           // PMM waits on the doorbell
+    ConnectorChannel channels[13]; // 0 unused
+};
+
+ConnectorShmLayout* connectorShm = nullptr;
+
+// PMM creates and initialises the object, ConnectorModules attach to it and
+// refuse a layout of another version
+ConnectorShmLayout* openConnectorShm(bool create) {
+    int fd = shm_open(CONNECTOR_SHM_NAME, create ? (O_CREAT | O_RDWR) : O_RDWR, 0660);
+    if (fd < 0) {
+        std::cerr << "[ConnectorShm] shm_open " << CONNECTOR_SHM_NAME << " failed : " << std::strerror(errno) << "\n";
+        return nullptr;
+    }
+    if (create && ftruncate(fd, sizeof(ConnectorShmLayout)) != 0) {
+        std::cerr << "[ConnectorShm] ftruncate failed : " << std::strerror(errno) << "\n";
+        close(fd);
+        return nullptr;
+    }
+    void* p = mmap(nullptr, sizeof(ConnectorShmLayout), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        std::cerr << "[ConnectorShm] mmap failed : " << std::strerror(errno) << "\n";
+        return nullptr;
+    }
+
+    ConnectorShmLayout* shm = static_cast<ConnectorShmLayout*>(p);
+    if (create) {
+        shm->magic = 0; // attachers wait for the magic
+        std::memset(static_cast<void*>(shm->channels), 0, sizeof(shm->channels));
+        for (ConnectorChannel& channel : shm->channels) new (&channel) ConnectorChannel();
+        new (&shm->doorbell) std::atomic<uint32_t>(0);
+        new (&shm->pmmSleeping) std::atomic<uint32_t>(0);
+        shm->version = CONNECTOR_SHM_VERSION;
+        shm->connectorCount = 12;
+        shm->layoutSize = sizeof(ConnectorShmLayout);
+        std::atomic_thread_fence(std::memory_order_release);
+        shm->magic = CONNECTOR_SHM_MAGIC;
+    }
+    else if (shm->magic != CONNECTOR_SHM_MAGIC || shm->version != CONNECTOR_SHM_VERSION || shm->layoutSize != sizeof(ConnectorShmLayout)) {
+        std::cerr << "[ConnectorShm] layout mismatch (version " << shm->version << ", expected " << CONNECTOR_SHM_VERSION << ")\n";
+        munmap(p, sizeof(ConnectorShmLayout));
+        return nullptr;
+    }
+    return shm;
+}
+
+// Unmaps the object; the PMM (owner) also removes it so no stale object stays in /dev/shm
+void closeConnectorShm(ConnectorShmLayout* shm, bool owner) {
+    if (!shm) return;
+    munmap(shm, sizeof(ConnectorShmLayout));
+    if (owner) shm_unlink(CONNECTOR_SHM_NAME);
+}
+
+// ConnectorModule side : wakes the PMM after an event or a demand write
+void ringConnectorDoorbell(ConnectorShmLayout& shm) {
+    shm.doorbell.fetch_add(1);
+    if (shm.pmmSleeping.load()) futexWake(shm.doorbell, true);
+}
+
+// ConnectorModule side : false when the ring is full
+bool pushConnectorEvent(ConnectorShmLayout& shm, int connector, const ConnectorDemand& event) {
+    ConnectorChannel& channel = shm.channels[connector];
+    uint32_t head = channel.eventHead.load(std::memory_order_relaxed);
+    if (head - channel.eventTail.load(std::memory_order_acquire) >= CONNECTOR_EVENT_SLOTS) return false;
+    channel.events[head % CONNECTOR_EVENT_SLOTS] = event;
+    channel.eventHead.store(head + 1, std::memory_order_release);
+    ringConnectorDoorbell(shm);
+    return true;
+}
+
+void publishConnectorDemand(ConnectorShmLayout& shm, int connector, const ConnectorDemand& demand) {
+    shm.channels[connector].demand.write(demand);
+    ringConnectorDoorbell(shm);
+}
+
+// ------------ PMM side ------------
+
+// Installed as limitsPublishHook : runs on the engine thread
+void publishConnectorLimits() {
+    if (!connectorShm) return;
+    uint64_t now = monotonicNs();
+    for (int c = 1; c <= 12; c++) {
+        const Connector& connector = connectorArray[c];
+        ConnectorLimits limits{};
+        limits.isActive = connector.isActive;
+        limits.EVSEMaxCurrent = connector.EVSEMaxCurrent;
+        limits.EVSEMaxVoltage = connector.EVSEMaxVoltage;
+        limits.EVSEMinCurrent = connector.EVSEMinCurrent;
+        limits.EVSEMinVoltage = connector.EVSEMinVoltage;
+        limits.EVSEPresentCurrent = connector.EVSEPresentCurrent;
+        limits.EVSEPresentVoltage = connector.EVSEPresentVoltage;
+        limits.EVSEMaxPower = connector.EVSEMaxPower;
+        limits.allocatedCurrent = connectorCapacity(static_cast<ConnectorType>(c));
+        limits.eventsHandled = connectorEventsHandled[c];
+        limits.publishedNs = now;
+        connectorShm->channels[c].limits.write(limits);
+    }
+}
+
+// Turns ring events and demand mailbox changes into engine commands, one
+// BATCH_END per poll. An event that cannot be queued stays in the ring.
+void connectorShmLoop(std::atomic<bool>& run) {
+    traceThreadName("connector_shm");
+    uint32_t demandSeq[13] = {};
+    ConnectorDemand lastDemand[13] = {};
+    uint64_t lastEventNs = 0;
+
+    while (run) {
+        bool submitted = false;
+        uint32_t bell = connectorShm->doorbell.load(); // before scanning : a later ring is not lost
+        for (int c = 1; c <= 12; c++) {
+            ConnectorChannel& channel = connectorShm->channels[c];
+            uint32_t tail = channel.eventTail.load(std::memory_order_relaxed);
+            while (tail != channel.eventHead.load(std::memory_order_acquire)) {
+                const ConnectorDemand& event = channel.events[tail % CONNECTOR_EVENT_SLOTS];
+                EngineCommand command{ EngineCommandType::START };
+                if (event.action == static_cast<uint8_t>(ConnectorAction::STOP)) command.type = EngineCommandType::STOP;
+                else if (event.action == static_cast<uint8_t>(ConnectorAction::UPDATE)) command.type = EngineCommandType::UPDATE;
+                command.connector = static_cast<ConnectorType>(c);
+                command.voltage = event.EVMaxVoltage;
+                command.current = event.EVMaxCurrent;
+                command.priority = event.priority;
+                command.issuedNs = event.publishedNs;
+                command.connectorEvent = tail + 1;
+                if (event.action == static_cast<uint8_t>(ConnectorAction::NONE) || !submitEngineCommand(command)) break;
+                channel.eventTail.store(++tail, std::memory_order_release);
+                submitted = true;
+            }
+
+            // demand mailbox : latest EV limits of a running session, coalesced
+            uint32_t seq = channel.demand.seq.load(std::memory_order_acquire);
+            ConnectorDemand demand;
+            if (seq != demandSeq[c] && channel.demand.read(demand)) {
+                demandSeq[c] = seq;
+                if (demand.EVMaxCurrent != lastDemand[c].EVMaxCurrent || demand.EVMaxVoltage != lastDemand[c].EVMaxVoltage) {
+                    EngineCommand command{ EngineCommandType::UPDATE };
+                    command.connector = static_cast<ConnectorType>(c);
+                    command.voltage = demand.EVMaxVoltage;
+                    command.current = demand.EVMaxCurrent;
+                    command.issuedNs = demand.publishedNs;
+                    submitted |= submitEngineCommand(command);
+                }
+                if (demand.EVTargetCurrent != lastDemand[c].EVTargetCurrent || demand.EVTargetVoltage != lastDemand[c].EVTargetVoltage) {
+                    EngineCommand command{ EngineCommandType::SETPOINT }; // fast path, no batch
+                    command.connector = static_cast<ConnectorType>(c);
+                    command.voltage = demand.EVTargetVoltage;
+                    command.current = demand.EVTargetCurrent;
+                    command.issuedNs = demand.publishedNs;
+                    if (submitEngineCommand(command)) lastEventNs = monotonicNs(); // keeps spinning while the EV streams
+                }
+                lastDemand[c] = demand;
             }
         }
-        if (!hasWork) continue;
 
-        std::unique_lock<std::mutex> lock(mtx);
+        uint64_t now = monotonicNs();
+        if (submitted) {
+            submitEngineCommand({ EngineCommandType::BATCH_END });
+            lastEventNs = now;
+        }
+        else if (now - lastEventNs <= CONNECTOR_SHM_SPIN_US * 1000ull) std::this_thread::yield();
+        else {
+            connectorShm->pmmSleeping.store(1);
+            if (connectorShm->doorbell.load() == bell) futexWait(connectorShm->doorbell, bell, CONNECTOR_SHM_IDLE_US, true);
+            connectorShm->pmmSleeping.store(0);
+        }
+    }
+}
+
+// ------------ stand-in ConnectorModule ------------
+
+// Waits until the engine has acted on `events` events of the channel
+bool waitConnectorLimits(ConnectorChannel& channel, uint32_t events, ConnectorLimits& limits, uint64_t timeoutMs) {
+    uint64_t deadline = monotonicNs() + timeoutMs * 1000000ull;
+    while (monotonicNs() < deadline) {
+        if (channel.limits.read(limits) && limits.eventsHandled >= events) return true;
+        std::this_thread::yield();
+    }
+    return false;
+}
+
+// --connector-standin [connector] [sessions] : plays a ConnectorModule against
+// a running PMM and reports the demand-to-limits latency of its starts
+int connectorStandIn(int connector, int sessions) {
+    ConnectorShmLayout* shm = openConnectorShm(false);
+    if (!shm || connector < 1 || connector > 12) return 1;
+    ConnectorChannel& channel = shm->channels[connector];
+    std::vector<uint64_t> latencyNs;
+
+    for (int s = 0; s < sessions; s++) {
+        ConnectorLimits limits{};
+        while (channel.limits.read(limits) && limits.isActive) std::this_thread::sleep_for(std::chrono::milliseconds(10)); // previous stop ramping down
+
+        ConnectorDemand start{};
+        start.action = static_cast<uint8_t>(ConnectorAction::START);
+        start.EVMaxCurrent = 60.0f + 30.0f * (s % 4);
+        start.EVMaxVoltage = 400.0f;
+        start.publishedNs = monotonicNs();
+        uint32_t events = channel.eventHead.load(std::memory_order_relaxed) + 1;
+        if (!pushConnectorEvent(*shm, connector, start)) break;
+        if (!waitConnectorLimits(channel, events, limits, 1000)) {
+            std::cerr << "[StandIn] no limits for start " << s << "\n";
+            closeConnectorShm(shm, false);
+            return 1;
+        }
+        latencyNs.push_back(limits.publishedNs - start.publishedNs);
+        std::cout << "[StandIn] session " << s << " : " << start.EVMaxCurrent << " A requested, " << limits.allocatedCurrent << " A allocated\n";
+
+        ConnectorDemand stop{};
+        stop.action = static_cast<uint8_t>(ConnectorAction::STOP);
+        stop.publishedNs = monotonicNs();
+        events = channel.eventHead.load(std::memory_order_relaxed) + 1;
+        pushConnectorEvent(*shm, connector, stop);
+        waitConnectorLimits(channel, events, limits, 1000);
+    }
+
+    std::sort(latencyNs.begin(), latencyNs.end());
+    auto pct = [&](double p) { return latencyNs.empty() ? 0.0 : latencyNs[static_cast<size_t>(p * (latencyNs.size() - 1))] / 1000.0; };
+    std::cout << "Demand to limits (us) : p50=" << pct(0.50) << " p99=" << pct(0.99) << " max=" << pct(1.0) << "\n";
+    closeConnectorShm(shm, false);
+    return 0;
+}
+
+//******************************************   CONNECTOR SHARED MEMORY END   ******************************************************/
+
+
+//******************************************   LAYOUT BENCHMARK START   ******************************************************/
+
+// --bench-layout : topology queries and full allocation passes with the
+// compile time StandardTopology against the RuntimeTopology fallback
+
+template <class Topology>
+uint64_t layoutQueryRound() {
+    using Engine = AllocationEngine<Topology>;
+    uint64_t sum = 0;
+    for (uint16_t c = 1; c <= 12; c++) {
+        sum += Topology::defaultModule(c) + Topology::subset(c) + Topology::superset(c);
+        for (uint16_t d = 1; d <= 12; d++) sum += Topology::muxExistence(c, d);
+        sum += static_cast<uint64_t>(Engine::connectorCapacity(static_cast<ConnectorType>(c)));
+    }
+    for (uint16_t m = 1; m < 48; m += 2) {
+        uint16_t relayIds[2];
+        Engine::getRelay(m, relayIds);
+        sum += relayIds[0] + relayIds[1] + Topology::relayBetween(m, m + 2);
+        sum += Engine::relayStatus(relayIds[0]) + Engine::muxStatus(static_cast<uint16_t>(301 + m % 12));
+    }
+    return sum;
+}
+
+void resetCabinetState() {
+    for (uint16_t i = 1; i < 49; i++) {
+        pmArray[i].Connector = ConnectorType::DEFAULT;
+        pmArray[i].isActive = false;
+    }
+    for (int c = 1; c <= 12; c++) connectorArray[c].isActive = false;
+    for (uint16_t i = 0; i < relayMuxCount; i++) relayMuxTable[i].status = false;
+    for (uint16_t i = 0; i < connectorMuxCount; i++) connectorPairMuxTable[i].status = false;
+    rebuildOwnershipIndex();
+}
+
+// All 12 connectors start one after the other (uneven demand), then the cabinet is reset
+double allocationPassUs(int passes) {
+    auto start = std::chrono::steady_clock::now();
+    for (int p = 0; p < passes; p++) {
+        resetCabinetState();
+        for (int c = 1; c <= 12; c++) {
+            connectorArray[c].EVMaxCurrent = static_cast<float>(30 + 40 * ((c + p) % 4));
+            assign_power_modules_search(static_cast<ConnectorType>(c)); // the search, not the plan cache
+        }
+    }
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / passes;
+}
+
+int benchLayout(int rounds = 200000, int passes = 2000) {
+    std::cout << "[Bench] Cabinet layout : " << rounds << " query rounds, " << passes << " allocation passes\n";
+    resetCabinetState();
 
-        // If worker is running, wait until it sleeps
-        cv.wait(lock, [] { return workerSleeping; });
+    auto timeRounds = [rounds](auto round) {
+        uint64_t sum = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int r = 0; r < rounds; r++) {
+            sum += round();
+            pmArray[1 + r % 48].MaxCurrent = 30.0f; // keep the state observable between rounds
+        }
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / rounds;
+        return std::make_pair(ns, sum);
+    };
+    auto [standardNs, standardSum] = timeRounds(layoutQueryRound<StandardTopology>);
+    auto [runtimeNs, runtimeSum] = timeRounds(layoutQueryRound<RuntimeTopology>);
+    if (standardSum != runtimeSum) std::cerr << "Layout mismatch : compile time and runtime answers differ\n";
+
+    bool selected = specialisedLayout;
+    std::cout.setstate(std::ios::failbit); // allocation logging would dominate
+    specialisedLayout = true;
+    double standardUs = allocationPassUs(passes);
+    specialisedLayout = false;
+    double runtimeUs = allocationPassUs(passes);
+    std::cout.clear();
+    specialisedLayout = selected;
+    resetCabinetState();
+
+    std::cout << "Query round (ns)     : compile time " << standardNs << " , runtime " << runtimeNs
+        << " (x" << runtimeNs / std::max(standardNs, 1e-9) << ")\n";
+    std::cout << "Allocation pass (us) : compile time " << standardUs << " , runtime " << runtimeUs
+        << " (x" << runtimeUs / std::max(standardUs, 1e-9) << ")\n";
+    return 0;
+}
 
-        std::cout << "[Trigger] Worker is asleep, running trigger...\n";
-        runTriggerActions(trig);
+// --bench-hierarchical : one batch starting every connector of the first
+// 1..n supersets, solved per superset in parallel against the single
+// sequential loop. Reports the batch latency, the current handed out and the
+// pairs the coordination step still had to add.
+int benchHierarchical(int passes = 2000) {
+    uint16_t supersets = runtimeCabinet.subsets / 2;
+    std::cout << "[Bench] Hierarchical allocation : " << passes << " batches per point, "
+        << std::max(1u, std::thread::hardware_concurrency()) << " thread(s)\n";
+    bool selected = hierarchicalAllocation;
+
+    auto batchUs = [passes](uint16_t count, bool hierarchical, float& allocated, double& steps) {
+        hierarchicalAllocation = hierarchical;
+        std::vector<ConnectorType> starts;
+        for (int c = 1; c <= 4 * count; c++) starts.push_back(static_cast<ConnectorType>(c));
+        uint64_t totalNs = 0, stepsBefore = coordinationSteps.load();
+        allocated = 0.0f;
+        for (int p = 0; p < passes; p++) {
+            resetCabinetState();
+            for (int c = 1; c <= 12; c++) connectorArray[c].EVMaxCurrent = static_cast<float>(60 + 60 * ((c + p) % 3));
+            uint64_t begin = monotonicNs();
+            assign_power_modules_batch(starts);
+            totalNs += monotonicNs() - begin;
+            for (ConnectorType connector : starts) allocated += connectorCapacity(connector);
+        }
+        allocated /= passes;
+        steps = static_cast<double>(coordinationSteps.load() - stepsBefore) / passes;
+        return totalNs / 1000.0 / passes;
+    };
 
-        std::cout << "[Trigger] Finished actions.\n";
+    std::cout.setstate(std::ios::failbit); // allocation logging would dominate
+    std::vector<std::string> lines;
+    for (uint16_t count = 1; count <= supersets; count++) {
+        float sequentialA = 0.0f, hierarchicalA = 0.0f;
+        double unused = 0.0, steps = 0.0;
+        double sequentialUs = batchUs(count, false, sequentialA, unused);
+        double hierarchicalUs = batchUs(count, true, hierarchicalA, steps);
+        std::ostringstream line;
+        line << count << " superset(s) : sequential " << sequentialUs << " us (" << sequentialA << " A), hierarchical "
+            << hierarchicalUs << " us (" << hierarchicalA << " A), " << steps << " coordination steps per batch\n";
+        lines.push_back(line.str());
     }
+    std::cout.clear();
+    hierarchicalAllocation = selected;
+    resetCabinetState();
+    for (const std::string& line : lines) std::cout << line;
+    return 0;
 }
 
+//******************************************   LAYOUT BENCHMARK END   ******************************************************/
+
+
 // ---- Main ----
-int main() {
-    std::thread tWorker(workerLoop);
+int main(int argc, char* argv[]) {
+    std::string mode = (argc > 1) ? argv[1] : "";
+    selectCabinetLayout();
+    if (mode == "--bench-telemetry") return benchTelemetry();
+    if (mode == "--bench-layout") return benchLayout();
+    if (mode == "--bench-config") return benchConfigReload();
+    if (mode == "--bench-startup") return benchStartup();
+    if (mode == "--bench-heartbeat") return benchHeartbeat();
+    if (mode == "--bench-hierarchical") return benchHierarchical();
+    if (mode == "--connector-standin") return connectorStandIn((argc > 2) ? std::atoi(argv[2]) : 1, (argc > 3) ? std::atoi(argv[3]) : 20);
+    if (mode == "--scrape-metrics") {
+        std::cout << scrapeMetrics();
+        return 0;
+    }
+    std::string traceFile;
+    if (mode == "--trace") {
+        traceFile = (argc > 2) ? argv[2] : "json_data/trace.json";
+        tracingEnabled = true;
+    }
+
+    PmmConfig startup = reloadConfig(CONFIG_PATH) ? *configSnapshot() : PmmConfig(); // compiled in defaults if missing
+    try {
+        if (!startup.efficiencyCurve) startup.efficiencyCurve = readEfficiencyCurve(startup.efficiencyPath);
+    }
+    catch (const std::exception& e) {
+        std::cerr << "ERROR : " << e.what() << "\n";
+    }
+    applyEngineConfig(startup);
+    if (loadCabinetSnapshot(activeConfig.snapshotPath)) std::cout << "[Startup] Warm start from " << activeConfig.snapshotPath << "\n";
+    beginDiscovery();
+
+    std::thread tTelemetry(telemetryIngestionLoop, std::ref(running));
+    std::thread tGenerator(syntheticTelemetryGenerator, std::ref(running), 1, 48, 10); // simulated modules @ 10 Hz
+    std::thread tHistory(historyLoop, std::ref(running));
+    std::thread tRamp(rampLoop, std::ref(running));
+    std::thread tMetrics(metricsServerLoop, std::ref(running), METRICS_PORT);
+    telemetryBatchHook = engineTelemetryHook;
+    connectorShm = openConnectorShm(true);
+    if (connectorShm) limitsPublishHook = publishConnectorLimits;
+    std::thread tEngine(engineLoop, std::ref(running));
+    std::vector<std::thread> discoveryJobs = startDiscovery(); // connectors become available subset by subset
+    std::thread tConnectorShm;
+    if (connectorShm) tConnectorShm = std::thread(connectorShmLoop, std::ref(running));
+    std::thread tPersistence(persistenceLoop, std::ref(running));
+    std::thread tMetricsResults(metricsResultLoop, std::ref(running));
     std::thread tTrigger(triggerListener);
+    std::thread tConfig(configWatchLoop, std::ref(running));
 
     // Let it run for demo
     std::this_thread::sleep_for(std::chrono::seconds(600));// 10 minutes
     running = false;
 
-    tWorker.join();
     tTrigger.join();
+    tConfig.join();
+    for (std::thread& job : discoveryJobs) job.join();
+    if (tConnectorShm.joinable()) tConnectorShm.join();
+    tEngine.join();
+    limitsPublishHook = nullptr; // the engine published through it until now
+    closeConnectorShm(connectorShm, true);
+    connectorShm = nullptr;
+    tPersistence.join();
+    tMetricsResults.join();
+    tGenerator.join();
+    tTelemetry.join();
+    tHistory.join();
+    tRamp.join();
+    tMetrics.join();
+
+    if (!traceFile.empty() && exportChromeTrace(traceFile)) {
+        std::cout << "Trace written to " << traceFile << "\n";
+    }
 
     std::cout << "Program exiting.\n";
     return 0;